@@ -0,0 +1,323 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <random>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include "../src/Processor.h"
+
+//Example: type ./ProcessorBench > bench.json in a Release build, compare the files of two commits
+//Options: --scale N multiplies the size of every workload, --repeat R timed runs per result,
+//--workload and --engine keep only the named ones, --workload assembly times the assemblers alone
+
+// Every allocation of the process is counted, a run should make none once it is warm
+static std::atomic<uint64_t> allocations(0);
+
+// The replaced operators share one allocator. It is kept out of line, so the compiler
+// never sees malloc and free paired with new and delete.
+__attribute__((noinline)) static void *Allocate(size_t size) {
+    return malloc(size == 0 ? 1 : size);
+}
+
+__attribute__((noinline)) static void Release(void *ptr) {
+    free(ptr);
+}
+
+void *operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    void *ptr = Allocate(size);
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void operator delete(void *ptr) noexcept {
+    Release(ptr);
+}
+
+void operator delete(void *ptr, size_t size) noexcept {
+    (void) size;
+    Release(ptr);
+}
+
+struct Workload {
+    std::string name;
+    std::string source;
+    // Input of one run for the given scale
+    std::string (*input)(int scale);
+};
+
+// Pairs of neighbouring Fibonacci numbers take the most steps, random pairs are mixed in
+std::string EuclidInput(int scale) {
+    int count = scale * 10;
+    std::mt19937 random(1);
+    std::uniform_int_distribution<int> value(1, 1 << 30);
+    std::vector<int> fibonacci = {1, 1};
+    while (fibonacci.back() < (1 << 30)) {
+        fibonacci.push_back(fibonacci[fibonacci.size() - 1] + fibonacci[fibonacci.size() - 2]);
+    }
+    std::stringstream input;
+    input << count << "\n";
+    for (int k = 0; k < count; k++) {
+        if (k % 2 == 0) {
+            int index = 20 + k % (fibonacci.size() - 21);
+            input << fibonacci[index + 1] << " " << fibonacci[index] << "\n";
+        } else {
+            input << value(random) << " " << value(random) << "\n";
+        }
+    }
+    return input.str();
+}
+
+std::string CountInput(int scale) {
+    return std::to_string(scale * 100) + "\n";
+}
+
+std::string EchoInput(int scale) {
+    int count = scale * 100;
+    std::stringstream input;
+    input << count << "\n";
+    for (int k = 0; k < count; k++) {
+        input << k * 7919 % 1000003 - 500000 << "\n";
+    }
+    return input.str();
+}
+
+const std::vector<Workload> kWorkloads = {
+        // gcd of every pair, RAX and RBX hold the pair
+        {"euclid",
+         "in\npop RCX\nnext:\npush RCX\npush 0\nje done\n"
+         "in\npop RAX\nin\npop RBX\n"
+         "gcd:\npush RBX\npush 0\nje found\npush RAX\npush RBX\nmod\npush RBX\npop RAX\npop RBX\njmp gcd\n"
+         "found:\npush RAX\nout\npush RCX\npush -1\nadd\npop RCX\njmp next\n"
+         "done:\nend",
+         EuclidInput},
+        // A long chain of arithmetic on the stack, one loop jump per chain
+        {"arith",
+         "in\npop RCX\npush 1\npop RAX\n"
+         "loop:\npush RCX\npush 0\nje done\n"
+         "push RAX\npush 31\nmul\npush RCX\nadd\npush 1000003\nmod\npop RAX\n"
+         "push RAX\npush 17\nmul\npush RAX\npush 13\nmul\nadd\npush 7\nadd\npush 1000003\nmod\n"
+         "push 1009\nmul\npush 3\nadd\npush 1000003\nmod\npop RAX\n"
+         "push RCX\npush -1\nadd\npop RCX\njmp loop\n"
+         "done:\npush RAX\nout",
+         CountInput},
+        // Counter residues pick one of several short paths, most commands are jumps. Registers
+        // outlive the run, the counters start from zero every time.
+        {"branch",
+         "in\npop RCX\nmov RAX 0\nmov RBX 0\nmov RDX 0\n"
+         "loop:\npush RCX\npush 0\nje done\n"
+         "push RCX\npush 3\nmod\npush 0\njne odd3\npush RAX\npush 1\nadd\npop RAX\njmp five\n"
+         "odd3:\npush RCX\npush 3\nmod\npush 1\njne two3\npush RBX\npush 1\nadd\npop RBX\njmp five\n"
+         "two3:\npush RDX\npush 1\nadd\npop RDX\n"
+         "five:\npush RCX\npush 5\nmod\npush 0\nje skip\njmp next\n"
+         "skip:\npush RAX\npush RBX\nadd\npop RAX\n"
+         "next:\npush RCX\npush -1\nadd\npop RCX\njmp loop\n"
+         "done:\npush RAX\nout\npush RBX\nout\npush RDX\nout",
+         CountInput},
+        // Every value goes in and straight out
+        {"echo",
+         "in\npop RCX\n"
+         "loop:\npush RCX\npush 0\nje done\nin\nout\npush RCX\npush -1\nadd\npop RCX\njmp loop\n"
+         "done:\nend",
+         EchoInput},
+};
+
+struct EngineName {
+    Engine engine;
+    const char *name;
+};
+
+const std::vector<EngineName> kEngines = {
+        {kSwitchEngine, "switch"}, {kThreadedEngine, "threaded"}, {kJitEngine, "jit"}, {kIrEngine, "ir"},
+        {kCompactEngine, "compact"}, {kCachedEngine, "cached"}
+};
+
+struct Measurement {
+    uint64_t dispatches;
+    double ns_per_run;
+    double allocations_per_run;
+    // Same runs through the array API, without streams
+    double direct_ns_per_run;
+    double direct_allocations_per_run;
+    bool ok;
+};
+
+// Runs of the array API, the output vector is reused like an embedder would
+void MeasureDirect(Processor &p, const std::string &input, const std::string &expected, int repeat,
+                   Measurement &measurement) {
+    std::vector<int> values;
+    std::stringstream text(input);
+    for (int value; text >> value;) {
+        values.push_back(value);
+    }
+    std::stringstream expected_text(expected);
+    std::vector<int> expected_values;
+    for (int value; expected_text >> value;) {
+        expected_values.push_back(value);
+    }
+    std::vector<int> output;
+    output.reserve(expected_values.size());
+    std::vector<double> times;
+    uint64_t allocated = 0;
+    for (int k = 0; k < repeat; k++) {
+        output.clear();
+        uint64_t before = allocations.load();
+        auto start = std::chrono::steady_clock::now();
+        RunResult result = p.Run(values.data(), values.size(), output);
+        auto finish = std::chrono::steady_clock::now();
+        allocated += allocations.load() - before;
+        times.push_back(std::chrono::duration<double, std::nano>(finish - start).count());
+        measurement.ok = measurement.ok && result.Ok() && output == expected_values;
+    }
+    std::sort(times.begin(), times.end());
+    measurement.direct_ns_per_run = times[times.size() / 2];
+    measurement.direct_allocations_per_run = static_cast<double>(allocated) / repeat;
+}
+
+// Dispatches are counted by a profiled run, the timed runs go without the profiler. The
+// input streams are made before the clock starts, the parsing of the input is part of a run.
+Measurement Measure(const Workload &workload, Engine engine, int scale, int repeat) {
+    std::string input = workload.input(scale);
+    std::stringstream text(workload.source);
+    Processor p(text, 1000, engine);
+    Measurement measurement = {0, 0, 0, 0, 0, true};
+
+    std::stringstream profiled_in(input);
+    std::stringstream profiled_out;
+    Profile profile(*p.GetProgram());
+    measurement.ok = p.Run(&profiled_in, profiled_out, profile).Ok();
+    for (int pc = 0; pc <= p.Size(); pc++) {
+        measurement.dispatches += profile.Count(pc);
+    }
+    std::string expected = profiled_out.str();
+
+    // The first run compiles the JIT and IR forms, it is not timed
+    std::stringstream warm_in(input);
+    std::stringstream warm_out;
+    measurement.ok = p.Run(&warm_in, warm_out).Ok() && measurement.ok && warm_out.str() == expected;
+
+    std::vector<double> times;
+    uint64_t allocated = 0;
+    for (int k = 0; k < repeat; k++) {
+        std::stringstream in(input);
+        std::stringstream out;
+        uint64_t before = allocations.load();
+        auto start = std::chrono::steady_clock::now();
+        RunResult result = p.Run(&in, out);
+        auto finish = std::chrono::steady_clock::now();
+        allocated += allocations.load() - before;
+        times.push_back(std::chrono::duration<double, std::nano>(finish - start).count());
+        measurement.ok = measurement.ok && result.Ok() && out.str() == expected;
+    }
+    // Median, a single preempted run does not move it
+    std::sort(times.begin(), times.end());
+    measurement.ns_per_run = times[times.size() / 2];
+    measurement.allocations_per_run = static_cast<double>(allocated) / repeat;
+    MeasureDirect(p, input, expected, repeat, measurement);
+    return measurement;
+}
+
+struct AssemblyTime {
+    size_t lines;
+    double serial_ms;
+    double parallel_ms;
+    bool ok;
+};
+
+// A generated program of scale * 100 blocks, each jumping to a mark further on or further back
+AssemblyTime MeasureAssembly(int scale, int repeat) {
+    std::string text;
+    int blocks = scale * 100;
+    for (int k = 0; k < blocks; k++) {
+        int target = k % 2 == 0 ? std::min(k + 17, blocks - 1) : std::max(k - 5, 0);
+        text += "b" + std::to_string(k) + ":\npush RAX\npush " + std::to_string(k) + "\nadd\npop RAX\npush RAX\n"
+                "push 0\njne b" + std::to_string(target) + "\nmov RBX " + std::to_string(k) + "\n";
+    }
+    text += "end";
+    AssemblyTime time = {0, 0, 0, true};
+    std::vector<double> serial, parallel;
+    for (int k = 0; k < repeat; k++) {
+        std::stringstream stream(text);
+        Assembler assembler(1);
+        auto start = std::chrono::steady_clock::now();
+        assembler.Assemble(stream);
+        auto middle = std::chrono::steady_clock::now();
+        ParallelAssembler parallel_assembler(1);
+        parallel_assembler.Assemble(text);
+        auto finish = std::chrono::steady_clock::now();
+        serial.push_back(std::chrono::duration<double, std::milli>(middle - start).count());
+        parallel.push_back(std::chrono::duration<double, std::milli>(finish - middle).count());
+        time.lines = assembler.Lines().size();
+        time.ok = time.ok && assembler.Code() == parallel_assembler.Code();
+    }
+    std::sort(serial.begin(), serial.end());
+    std::sort(parallel.begin(), parallel.end());
+    time.serial_ms = serial[serial.size() / 2];
+    time.parallel_ms = parallel[parallel.size() / 2];
+    return time;
+}
+
+int main(int argc, char *argv[]) {
+    int scale = 1000;
+    int repeat = 5;
+    std::string only_workload;
+    std::string only_engine;
+    for (int k = 1; k + 1 < argc; k += 2) {
+        if (strcmp(argv[k], "--scale") == 0) {
+            scale = std::max(1, atoi(argv[k + 1]));
+        } else if (strcmp(argv[k], "--repeat") == 0) {
+            repeat = std::max(1, atoi(argv[k + 1]));
+        } else if (strcmp(argv[k], "--workload") == 0) {
+            only_workload = argv[k + 1];
+        } else if (strcmp(argv[k], "--engine") == 0) {
+            only_engine = argv[k + 1];
+        } else {
+            std::cerr << "unknown option " << argv[k] << std::endl;
+            return 1;
+        }
+    }
+
+    bool ok = true;
+    std::cout << "{\n  \"scale\": " << scale << ",\n  \"repeat\": " << repeat << ",\n  \"results\": [";
+    const char *separator = "\n";
+    for (const Workload &workload : kWorkloads) {
+        if (!only_workload.empty() && workload.name != only_workload) {
+            continue;
+        }
+        for (const EngineName &engine : kEngines) {
+            if (!only_engine.empty() && engine.name != only_engine) {
+                continue;
+            }
+            Measurement m = Measure(workload, engine.engine, scale, repeat);
+            ok = ok && m.ok;
+            std::cout << separator << "    {\"workload\": \"" << workload.name << "\", \"engine\": \"" << engine.name
+                      << "\", \"ok\": " << (m.ok ? "true" : "false") << ", \"dispatches\": " << m.dispatches
+                      << ", \"ns_per_run\": " << static_cast<uint64_t>(m.ns_per_run)
+                      << ", \"instructions_per_second\": " << static_cast<uint64_t>(m.dispatches * 1e9 / m.ns_per_run)
+                      << ", \"ns_per_dispatch\": " << m.ns_per_run / std::max<uint64_t>(m.dispatches, 1)
+                      << ", \"allocations_per_run\": " << m.allocations_per_run
+                      << ", \"direct_ns_per_run\": " << static_cast<uint64_t>(m.direct_ns_per_run)
+                      << ", \"direct_allocations_per_run\": " << m.direct_allocations_per_run << "}";
+            separator = ",\n";
+        }
+    }
+    std::cout << "\n  ]";
+    if (only_workload.empty() || only_workload == "assembly") {
+        AssemblyTime time = MeasureAssembly(scale, repeat);
+        ok = ok && time.ok;
+        std::cout << ",\n  \"assembly\": {\"ok\": " << (time.ok ? "true" : "false") << ", \"lines\": " << time.lines
+                  << ", \"threads\": " << std::thread::hardware_concurrency() << ", \"serial_ms\": " << time.serial_ms
+                  << ", \"parallel_ms\": " << time.parallel_ms << "}";
+    }
+    std::cout << "\n}" << std::endl;
+    return ok ? 0 : 1;
+}
@@ -1,20 +1,252 @@
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
 #include <iostream>
+#include <unistd.h>
 #include "src/Processor.h"
+#include "src/Transpiler.h"
 
 //Example: type ./Processor ./data/sum_cin.txt
+//Precompile: type ./Processor -c ./data/sum_cin.txt sum_cin.pbc, then ./Processor sum_cin.pbc
+//Profile: type ./Processor -p ./data/euclid.txt, writes euclid.txt.prof and euclid.txt.folded
+//Stream: type ./Processor -s <(./generator), assembles while reading, skips the image cache
+//Batch: type ./Processor -b ./data/sum_cin.txt a.in b.in, outputs go to a.in.out and b.in.out
+//Memory: type ./Processor -m table.bin prog.txt, LOAD and STORE work on the words of table.bin
+//Layout: type ./Processor -l ./data/euclid.txt euclid.pbc < train.in, lays out the blocks for the paths train.in takes
+//Gas: type ./Processor -g 1000000 prog.txt, stops with "out of gas" after a million commands
+//Engine: type ./Processor -e jit ./data/sum_cin.txt, also in front of -s, -b, -m and -g; the engines are
+//switch, threaded, jit, ir, compact and cached
+//Transpile: type ./Processor -t ./data/euclid.txt euclid.cpp, defines int euclid(int (*in)(), void (*out)(int))
 
-void TestProcessor(std::istream *in, const std::string &file_name) {
-    std::ifstream file(file_name);
-    Processor p(file, 1000);
-    file.close();
+// Names for -e, in the order of Engine
+const char *const kEngineNames[] = {"switch", "threaded", "jit", "ir", "compact", "cached"};
+
+// Gas of -g, a count of commands in decimal. Signs, trailing text and counts past 64 bits are refused.
+bool ParseGas(const char *text, uint64_t &gas) {
+    if (!isdigit(static_cast<unsigned char>(text[0]))) {
+        return false;
+    }
+    char *end = nullptr;
+    errno = 0;
+    gas = strtoull(text, &end, 10);
+    return *end == '\0' && errno == 0;
+}
+
+// Reads the whole file into text, false with a message if it can't be opened
+bool ReadText(const std::string &file_name, std::stringstream &text) {
+    std::ifstream file(file_name, std::ios::binary);
+    if (!file) {
+        std::cerr << "unable to open " << file_name << std::endl;
+        return false;
+    }
+    text << file.rdbuf();
+    return true;
+}
+
+bool TestProcessor(std::istream *in, const std::string &file_name, const std::string &memory_name = "",
+                   uint64_t gas = kUnlimitedGas, Engine engine = kDefaultEngine) {
+    std::unique_ptr<Processor> p = LoadProcessor(file_name, 1000, engine);
+    if (p == nullptr) {
+        std::cerr << "unable to open " << file_name << std::endl;
+        return false;
+    }
+    p->SetGas(gas);
+    if (!memory_name.empty() && !p->MapMemory(memory_name)) {
+        std::cerr << "unable to map " << memory_name << std::endl;
+        return false;
+    }
     if (in == &std::cin) {
         std::cout << std::endl;
+        // A terminal gets every value at once, pipes and files get large blocks
+        p->SetInteractive(isatty(STDIN_FILENO) || isatty(STDOUT_FILENO));
+    }
+    RunResult result = p->Run(in, std::cout);
+    if (!result.Ok()) {
+        std::cerr << file_name << ": " << TrapMessage(result.trap) << " at " << result.pc << std::endl;
+    }
+    return result.Ok();
+}
+
+// Assembles the program while it arrives, for pipes and programs too large to hold as text
+bool Streamed(const std::string &file_name, Engine engine) {
+    std::ifstream file(file_name, std::ios::binary);
+    if (!file) {
+        std::cerr << "unable to open " << file_name << std::endl;
+        return false;
+    }
+    Processor p(file, 1 << 16, engine);
+    file.close();
+    std::ios::sync_with_stdio(false);
+    RunResult result = p.Run(&std::cin, std::cout);
+    if (!result.Ok()) {
+        std::cerr << file_name << ": " << TrapMessage(result.trap) << " at " << result.pc << std::endl;
+    }
+    return result.Ok();
+}
+
+void Assemble(const std::string &file_name, const std::string &image_name) {
+    std::stringstream text;
+    if (!ReadText(file_name, text)) {
+        exit(1);
+    }
+    Processor p(text, 1000);
+    if (!p.SaveImage(image_name, HashSource(text.str()))) {
+        std::cerr << "unable to write " << image_name << std::endl;
+        exit(1);
+    }
+}
+
+// Runs the program from stdin with profiling, the listing and the folded stacks go next to it
+bool Profiled(const std::string &file_name) {
+    std::stringstream text;
+    if (!ReadText(file_name, text)) {
+        return false;
+    }
+    // Parsed from the text, an image has no line table for the listing
+    Processor p(text, 1000);
+    Profile profile(*p.GetProgram());
+    RunResult result = p.Run(&std::cin, std::cout, profile);
+    if (!result.Ok()) {
+        std::cerr << file_name << ": " << TrapMessage(result.trap) << " at " << result.pc << std::endl;
+    }
+    std::ofstream listing(file_name + ".prof");
+    text.clear();
+    text.seekg(0, text.beg);
+    profile.WriteListing(text, listing);
+    std::ofstream folded(file_name + ".folded");
+    profile.WriteFolded(folded, file_name.substr(file_name.find_last_of('/') + 1));
+    return result.Ok();
+}
+
+// Trains the program on stdin and writes an image with the blocks laid out for the paths it took
+bool Trained(const std::string &file_name, const std::string &image_name) {
+    std::stringstream text;
+    if (!ReadText(file_name, text)) {
+        return false;
+    }
+    Processor p(text, 1000);
+    Profile profile(*p.GetProgram());
+    RunResult result = p.Run(&std::cin, std::cout, profile);
+    if (!result.Ok()) {
+        std::cerr << file_name << ": " << TrapMessage(result.trap) << " at " << result.pc << std::endl;
+    }
+    if (!LayOut(*p.GetProgram(), profile)->SaveImage(image_name, HashSource(text.str()))) {
+        std::cerr << "unable to write " << image_name << std::endl;
+        return false;
     }
-    p.Run(in, std::cout);
+    return result.Ok();
+}
+
+// The function is named after the file, without the extension
+bool Transpile(const std::string &file_name, const std::string &cpp_name) {
+    std::ifstream file(file_name, std::ios::binary);
+    if (!file) {
+        std::cerr << "unable to open " << file_name << std::endl;
+        return false;
+    }
+    Program program(file, 1000);
+    file.close();
+    std::string function = file_name.substr(file_name.find_last_of('/') + 1);
+    function = function.substr(0, function.find('.'));
+    for (char &c : function) {
+        c = isalnum(static_cast<unsigned char>(c)) ? c : '_';
+    }
+    if (function.empty() || isdigit(static_cast<unsigned char>(function[0]))) {
+        function = "program_" + function;
+    }
+    std::ofstream cpp(cpp_name);
+    Transpiler transpiler(program);
+    if (!transpiler.Write(function, cpp)) {
+        std::cerr << file_name << ": the stack depth is not proven, only proven programs are transpiled" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Runs the program over every input file on all cores
+bool RunBatch(const std::string &file_name, const std::vector<std::string> &input_names, Engine engine) {
+    std::shared_ptr<const Program> program = LoadProgram(file_name, 1000);
+    if (program == nullptr) {
+        std::cerr << "unable to open " << file_name << std::endl;
+        return false;
+    }
+    Processor p(program, engine);
+    std::vector<std::unique_ptr<std::ifstream>> input_files;
+    std::vector<std::unique_ptr<std::ofstream>> output_files;
+    std::vector<std::istream*> inputs;
+    std::vector<std::ostream*> outputs;
+    for (const std::string &name : input_names) {
+        input_files.emplace_back(new std::ifstream(name));
+        output_files.emplace_back(new std::ofstream(name + ".out"));
+        inputs.push_back(input_files.back().get());
+        outputs.push_back(output_files.back().get());
+    }
+    std::vector<RunResult> results = p.RunBatch(inputs, outputs);
+    bool ok = true;
+    for (size_t k = 0; k < results.size(); k++) {
+        if (!results[k].Ok()) {
+            std::cerr << input_names[k] << ": " << TrapMessage(results[k].trap) << " at " << results[k].pc << std::endl;
+            ok = false;
+        }
+    }
+    return ok;
 }
 
 int main(int argc, char *argv[]) {
+    Engine engine = kDefaultEngine;
+    if (argc >= 3 && std::string(argv[1]) == "-e") {
+        const char *const *name = std::find_if(std::begin(kEngineNames), std::end(kEngineNames),
+                                               [&](const char *known) { return strcmp(known, argv[2]) == 0; });
+        if (name == std::end(kEngineNames)) {
+            std::cerr << "unknown engine " << argv[2] << ", one of:";
+            for (const char *known : kEngineNames) {
+                std::cerr << " " << known;
+            }
+            std::cerr << std::endl;
+            return 1;
+        }
+        engine = static_cast<Engine>(name - std::begin(kEngineNames));
+        // The mode and the files follow as if there were no engine option
+        argv[2] = argv[0];
+        argv += 2;
+        argc -= 2;
+    }
+    if (argc == 4 && std::string(argv[1]) == "-c") {
+        Assemble(argv[2], argv[3]);
+        return 0;
+    }
+    if (argc == 4 && std::string(argv[1]) == "-t") {
+        return Transpile(argv[2], argv[3]) ? 0 : 1;
+    }
+    if (argc == 4 && std::string(argv[1]) == "-l") {
+        return Trained(argv[2], argv[3]) ? 0 : 1;
+    }
+    if (argc == 3 && std::string(argv[1]) == "-p") {
+        return Profiled(argv[2]) ? 0 : 1;
+    }
+    if (argc == 3 && std::string(argv[1]) == "-s") {
+        return Streamed(argv[2], engine) ? 0 : 1;
+    }
+    if (argc == 4 && std::string(argv[1]) == "-m") {
+        std::ios::sync_with_stdio(false);
+        return TestProcessor(&std::cin, argv[3], argv[2], kUnlimitedGas, engine) ? 0 : 1;
+    }
+    if (argc == 4 && std::string(argv[1]) == "-g") {
+        std::ios::sync_with_stdio(false);
+        uint64_t gas;
+        if (!ParseGas(argv[2], gas)) {
+            std::cerr << "usage: " << argv[0] << " [-e engine] -g <gas> <program>, gas is a count of commands"
+                      << std::endl;
+            return 1;
+        }
+        return TestProcessor(&std::cin, argv[3], "", gas, engine) ? 0 : 1;
+    }
+    if (argc >= 3 && std::string(argv[1]) == "-b") {
+        return RunBatch(argv[2], std::vector<std::string>(argv + 3, argv + argc), engine) ? 0 : 1;
+    }
     assert(argc == 2);
-    TestProcessor(&std::cin, argv[1]);
-    return 0;
+    // Lets std::cin buffer ahead instead of reading through stdio one character at a time
+    std::ios::sync_with_stdio(false);
+    return TestProcessor(&std::cin, argv[1], "", kUnlimitedGas, engine) ? 0 : 1;
 }
\ No newline at end of file
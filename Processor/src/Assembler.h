@@ -0,0 +1,335 @@
+#ifndef PROCESSOR_ASSEMBLER_H
+#define PROCESSOR_ASSEMBLER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <istream>
+#include <map>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include "Commands.h"
+
+// Source name of a command or a register
+struct Mnemonic {
+    const char *name;
+    int value;
+    bool is_register;
+};
+
+constexpr Mnemonic kMnemonics[] = {
+        {"push", PUSH, false},
+        {"pop", POP, false},
+        {"dup", DUP, false},
+        {"swp", SWP, false},
+        {"mov", MOV, false},
+        {"in", IN, false},
+        {"out", OUT, false},
+        {"mul", MUL, false},
+        {"add", ADD, false},
+        {"mod", MOD, false},
+        {"jmp", JMP, false},
+        {"je", JE, false},
+        {"jne", JNE, false},
+        {"end", END, false},
+        {"hlt", HLT, false},
+        {"call", CALL, false},
+        {"ret", RET, false},
+        {"load", LOAD, false},
+        {"store", STORE, false},
+        {"RAX", RAX, true},
+        {"RBX", RBX, true},
+        {"RCX", RCX, true},
+        {"RDX", RDX, true}
+};
+
+const int kMnemonicsCount = sizeof(kMnemonics) / sizeof(kMnemonics[0]);
+const unsigned kMnemonicSlots = 64;
+
+// Mixes the first two characters, the last one and the length. The multipliers are picked
+// so that every mnemonic gets a slot of its own, which the static_assert below checks.
+constexpr unsigned MnemonicHash(const char *text, size_t length) {
+    return length < 2 ? 0 : (static_cast<unsigned char>(text[0]) * 2u + static_cast<unsigned char>(text[1]) * 6u +
+                             static_cast<unsigned char>(text[length - 1]) * 4u + length) % kMnemonicSlots;
+}
+
+struct MnemonicTable {
+    // Index in kMnemonics, -1 for an empty slot
+    int slots[kMnemonicSlots];
+    bool perfect;
+};
+
+constexpr MnemonicTable MakeMnemonicTable() {
+    MnemonicTable table{};
+    for (unsigned s = 0; s < kMnemonicSlots; s++) {
+        table.slots[s] = -1;
+    }
+    table.perfect = true;
+    for (int k = 0; k < kMnemonicsCount; k++) {
+        unsigned slot = MnemonicHash(kMnemonics[k].name, std::string_view(kMnemonics[k].name).size());
+        table.perfect = table.perfect && table.slots[slot] == -1;
+        table.slots[slot] = k;
+    }
+    return table;
+}
+
+constexpr MnemonicTable kMnemonicTable = MakeMnemonicTable();
+static_assert(kMnemonicTable.perfect, "mnemonics collide in the hash, pick other multipliers");
+
+// One probe and one comparison, null for an unknown name
+inline const Mnemonic *FindMnemonic(std::string_view name) {
+    int k = kMnemonicTable.slots[MnemonicHash(name.data(), name.size())];
+    return k >= 0 && name == kMnemonics[k].name ? &kMnemonics[k] : nullptr;
+}
+
+// Translates source text to code in a single pass, so the input does not have to be
+// seekable and may be a pipe. A jump to a mark that has not appeared yet leaves a hole,
+// which is patched once the mark is defined.
+class Assembler {
+public:
+    // Capacity is only a hint, the code grows as long as there is input
+    explicit Assembler(int capacity = 0) { code.reserve(capacity); }
+
+    void Assemble(std::istream &input);
+    void AssembleLine(std::string_view line);
+    // Checks that every jump got its mark, the code is complete afterwards
+    void Finish();
+
+    std::vector<int> &Code() { return code; }
+    std::map<std::string, int> &Marks() { return marks; }
+    // Offset of the code of every line
+    std::vector<int> &Lines() { return lines; }
+    // Offsets of the jump operands still waiting for their mark, Finish() expects none
+    std::map<std::string, std::vector<int>> &Pending() { return pending; }
+
+private:
+    void EmitTarget(std::string_view mark);
+    static int Number(std::string_view text) { return std::stoi(std::string(text)); }
+    // Register index, -1 if the text is not a register
+    static int RegisterOf(std::string_view text);
+
+    std::vector<int> code;
+    std::map<std::string, int> marks;
+    std::vector<int> lines;
+    // Offsets of the jump operands waiting for every undefined mark
+    std::map<std::string, std::vector<int>> pending;
+};
+
+void Assembler::Assemble(std::istream &input) {
+    std::string line;
+    while (getline(input, line, '\n')) {
+        AssembleLine(line);
+    }
+    Finish();
+}
+
+int Assembler::RegisterOf(std::string_view text) {
+    const Mnemonic *mnemonic = FindMnemonic(text);
+    return mnemonic != nullptr && mnemonic->is_register ? mnemonic->value : -1;
+}
+
+void Assembler::EmitTarget(std::string_view mark) {
+    auto found = marks.find(std::string(mark));
+    if (found != marks.end()) {
+        code.push_back(found->second);
+        return;
+    }
+    pending[std::string(mark)].push_back(code.size());
+    code.push_back(0);
+}
+
+void Assembler::AssembleLine(std::string_view line) {
+    lines.push_back(code.size());
+    size_t offset = line.find(' ');
+    std::string_view cmd_str = line.substr(0, offset);
+    std::string_view value_str = offset != std::string_view::npos ? line.substr(offset + 1) : std::string_view();
+    const Mnemonic *mnemonic = FindMnemonic(cmd_str);
+    if (mnemonic == nullptr || mnemonic->is_register) {
+        assert(!cmd_str.empty() && cmd_str.back() == ':' && "unknown command");
+        assert(value_str.empty() && "unexpected operand for mark");
+        // A mark takes a word of its own and points right past it
+        code.push_back(HLT);
+        std::string name(cmd_str.substr(0, cmd_str.size() - 1));
+        assert(marks.find(name) == marks.end() && "duplicate mark");
+        marks[name] = code.size();
+        auto waiting = pending.find(name);
+        if (waiting != pending.end()) {
+            for (int hole : waiting->second) {
+                code[hole] = code.size();
+            }
+            pending.erase(waiting);
+        }
+        return;
+    }
+    int cmd = mnemonic->value;
+    if (cmd == PUSH || cmd == JMP || cmd == JE || cmd == JNE || cmd == CALL || cmd == DUP || cmd == MOV ||
+        cmd == LOAD || cmd == STORE) {
+        assert(!value_str.empty() && "expected: operand");
+    } else if (cmd != POP) {
+        assert(value_str.empty() && "unexpected operand");
+    }
+    if (cmd == PUSH || cmd == LOAD || cmd == STORE) {
+        // The address of LOAD and STORE is a number or a register, like the operand of PUSH
+        static const int kRegisterForm[] = {PUSHR, LOADR, STORER};
+        int r = RegisterOf(value_str);
+        code.push_back(r >= 0 ? kRegisterForm[cmd == PUSH ? 0 : cmd == LOAD ? 1 : 2] : cmd);
+        code.push_back(r >= 0 ? r : Number(value_str));
+    } else if (cmd == DUP) {
+        code.push_back(DUP);
+        code.push_back(Number(value_str));
+    } else if (JumpOperand(cmd) != 0) {
+        code.push_back(cmd);
+        EmitTarget(value_str);
+    } else if (cmd == MOV) {
+        size_t second = value_str.find(' ');
+        assert(second != std::string_view::npos && "expected: operand");
+        int r1 = RegisterOf(value_str.substr(0, second));
+        assert(r1 >= 0 && "expected: register");
+        std::string_view value_str2 = value_str.substr(second + 1);
+        int r2 = RegisterOf(value_str2);
+        code.push_back(r2 >= 0 ? MOV : MOVD);
+        code.push_back(r1);
+        code.push_back(r2 >= 0 ? r2 : Number(value_str2));
+    } else if (cmd == POP && !value_str.empty()) {
+        int r = RegisterOf(value_str);
+        assert(r >= 0 && "expected: register");
+        code.push_back(POPR);
+        code.push_back(r);
+    } else {
+        code.push_back(cmd);
+    }
+}
+
+void Assembler::Finish() {
+    // Jumps to a mark that never appeared keep target 0
+    assert(pending.empty() && "undefined mark");
+    pending.clear();
+}
+
+// Assembles text that is in memory on all cores. The text is cut at line ends into chunks,
+// which an Assembler each turns into code of their own, offsets counted from the start of
+// the chunk and jumps to marks of other chunks left as holes. The marks of all chunks then
+// go into one table, and every chunk moves its code to its place in the program, shifting
+// its jump targets and filling its holes from the table, again in parallel.
+class ParallelAssembler {
+public:
+    // Capacity is only a hint, like for Assembler. Threads are all cores if 0. Chunks are at
+    // least min_chunk bytes long, so short text is assembled on the calling thread.
+    explicit ParallelAssembler(int capacity = 0, int threads = 0, size_t min_chunk = kMinChunk);
+
+    void Assemble(std::string_view text);
+
+    std::vector<int> &Code() { return code; }
+    std::map<std::string, int> &Marks() { return marks; }
+    std::vector<int> &Lines() { return lines; }
+
+private:
+    static constexpr size_t kMinChunk = 1 << 16;
+    // Chunks per thread, so that a slow chunk does not hold up a whole share
+    static constexpr size_t kChunksPerThread = 4;
+
+    // Runs task(k) for every k below count, spread over the threads
+    template <typename Task>
+    void Parallel(size_t count, Task task) const;
+
+    int capacity;
+    int threads;
+    size_t min_chunk;
+    std::vector<int> code;
+    std::map<std::string, int> marks;
+    std::vector<int> lines;
+};
+
+ParallelAssembler::ParallelAssembler(int capacity, int threads, size_t min_chunk)
+        : capacity(capacity), threads(threads), min_chunk(std::max<size_t>(min_chunk, 1)) {
+    if (this->threads <= 0) {
+        this->threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+}
+
+template <typename Task>
+void ParallelAssembler::Parallel(size_t count, Task task) const {
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t k = next++; k < count; k = next++) {
+            task(k);
+        }
+    };
+    std::vector<std::thread> pool;
+    for (size_t t = 1; t < std::min<size_t>(threads, count); t++) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (std::thread &thread : pool) {
+        thread.join();
+    }
+}
+
+void ParallelAssembler::Assemble(std::string_view text) {
+    // Every chunk but the last one ends right after a line end
+    size_t chunk_size = std::max(min_chunk, text.size() / (threads * kChunksPerThread) + 1);
+    std::vector<std::string_view> chunks;
+    for (size_t begin = 0; begin < text.size();) {
+        size_t end = begin + chunk_size < text.size() ? text.find('\n', begin + chunk_size) : std::string_view::npos;
+        end = end == std::string_view::npos ? text.size() : end + 1;
+        chunks.push_back(text.substr(begin, end - begin));
+        begin = end;
+    }
+
+    // Lines are split like getline does, the text after the last line end is a line if it is not empty
+    std::vector<Assembler> parts(chunks.size());
+    Parallel(chunks.size(), [&](size_t k) {
+        std::string_view chunk = chunks[k];
+        for (size_t begin = 0; begin < chunk.size();) {
+            size_t end = std::min(chunk.find('\n', begin), chunk.size());
+            parts[k].AssembleLine(chunk.substr(begin, end - begin));
+            begin = end + 1;
+        }
+    });
+
+    std::vector<size_t> code_base(parts.size() + 1, 0);
+    std::vector<size_t> line_base(parts.size() + 1, 0);
+    marks.clear();
+    for (size_t k = 0; k < parts.size(); k++) {
+        for (auto &mark : parts[k].Marks()) {
+            bool added = marks.emplace(mark.first, mark.second + code_base[k]).second;
+            assert(added && "duplicate mark");
+            (void) added;
+        }
+        code_base[k + 1] = code_base[k] + parts[k].Code().size();
+        line_base[k + 1] = line_base[k] + parts[k].Lines().size();
+    }
+
+    code.clear();
+    code.reserve(std::max<size_t>(capacity, code_base.back()));
+    code.resize(code_base.back());
+    lines.assign(line_base.back(), 0);
+    Parallel(parts.size(), [&](size_t k) {
+        std::vector<int> &part = parts[k].Code();
+        int base = code_base[k];
+        for (size_t i = 0; i < part.size(); i += kCommandLength[part[i]]) {
+            int operand = JumpOperand(part[i]);
+            if (operand != 0) {
+                part[i + operand] += base;
+            }
+        }
+        // Jumps to a mark that never appeared keep target 0
+        for (auto &waiting : parts[k].Pending()) {
+            auto found = marks.find(waiting.first);
+            assert(found != marks.end() && "undefined mark");
+            for (int hole : waiting.second) {
+                part[hole] = found != marks.end() ? found->second : 0;
+            }
+        }
+        std::copy(part.begin(), part.end(), code.begin() + base);
+        std::vector<int> &part_lines = parts[k].Lines();
+        for (size_t line = 0; line < part_lines.size(); line++) {
+            lines[line_base[k] + line] = part_lines[line] + base;
+        }
+    });
+}
+
+#endif //PROCESSOR_ASSEMBLER_H
@@ -0,0 +1,69 @@
+#ifndef PROCESSOR_COMMANDS_H
+#define PROCESSOR_COMMANDS_H
+
+#define REGISTERS_SIZE 4
+// Deepest nesting of CALL in a run
+#define RETURN_STACK_SIZE (1 << 12)
+// Largest data memory in words, so that a byte offset of any address fits in 32 bits
+#define MEMORY_MAX_SIZE (1 << 28)
+// Deepest operand stack of a proven program. A DUP of more than half as many pairs traps
+// with kStackOverflow on every engine.
+#define STACK_MAX_SIZE (1 << 24)
+
+enum Command {
+    PUSH, PUSHR, POP, POPR, DUP, SWP, MOV, MOVD, IN, OUT, MUL, ADD, MOD, JMP, JE, JNE, END, HLT, CALL, RET,
+    LOAD, STORE, LOADR, STORER,
+    // Superinstructions, produced only by the optimizer
+    PUSH_JE, PUSH_JNE, PUSH_ADD, PUSH_MUL, DUP_POP, POP_SWP,
+    COMMANDS_COUNT
+};
+
+enum Register {
+    RAX, RBX, RCX, RDX
+};
+
+// Number of program words taken by each command together with its operands
+const int kCommandLength[COMMANDS_COUNT] = {
+        2, 2, 1, 2, 2, 1, 3, 3, 1, 1, 1, 1, 1, 2, 2, 2, 1, 1, 2, 1,
+        2, 2, 2, 2,
+        3, 3, 2, 2, 2, 1
+};
+
+inline bool IsCommand(int cmd) {
+    return static_cast<unsigned>(cmd) < COMMANDS_COUNT;
+}
+
+inline bool IsRegister(int r) {
+    return static_cast<unsigned>(r) < REGISTERS_SIZE;
+}
+
+// Remainder as the hardware computes it, except INT_MIN % -1 which would fault
+inline int Remainder(int lhs, int rhs) {
+    return rhs == -1 ? 0 : lhs % rhs;
+}
+
+// Offset of the jump target inside the command, 0 if the command does not jump
+inline int JumpOperand(int cmd) {
+    switch (cmd) {
+        case JMP:
+        case JE:
+        case JNE:
+        case CALL:
+            return 1;
+        case PUSH_JE:
+        case PUSH_JNE:
+            return 2;
+        default:
+            return 0;
+    }
+}
+
+inline bool IsMemoryAccess(int cmd) {
+    return cmd == LOAD || cmd == STORE || cmd == LOADR || cmd == STORER;
+}
+
+inline bool IsConditionalJump(int cmd) {
+    return cmd == JE || cmd == JNE || cmd == PUSH_JE || cmd == PUSH_JNE;
+}
+
+#endif //PROCESSOR_COMMANDS_H
@@ -0,0 +1,177 @@
+#ifndef PROCESSOR_COMPACT_H
+#define PROCESSOR_COMPACT_H
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+#include "Commands.h"
+
+// Opcodes of the byte encoding. Commands with a register keep it in the low bits of the
+// opcode, MOV keeps the destination in bits 2-3 and the source in bits 0-1.
+enum CompactOp {
+    kCompactPush, kCompactPop, kCompactDup, kCompactSwp, kCompactIn, kCompactOut, kCompactMul, kCompactAdd,
+    kCompactMod, kCompactJmp, kCompactJe, kCompactJne, kCompactEnd, kCompactCall, kCompactRet, kCompactLoad,
+    kCompactStore, kCompactPushJe, kCompactPushJne, kCompactPushAdd, kCompactPushMul, kCompactDupPop,
+    kCompactPopSwp, kCompactBadRegister,
+    kCompactPushR = 24, kCompactPopR = 28, kCompactMovD = 32, kCompactLoadR = 36, kCompactStoreR = 40,
+    kCompactMov = 48,
+    kCompactOpsCount = 64
+};
+
+// Immediates are zigzag varints, so small numbers of either sign take a byte. Jump targets
+// are plain varints.
+inline void PutVarint(std::vector<uint8_t> &code, uint32_t value) {
+    while (value >= 0x80) {
+        code.push_back(static_cast<uint8_t>(value | 0x80));
+        value >>= 7;
+    }
+    code.push_back(static_cast<uint8_t>(value));
+}
+
+inline void PutSigned(std::vector<uint8_t> &code, int value) {
+    PutVarint(code, (static_cast<uint32_t>(value) << 1) ^ static_cast<uint32_t>(value >> 31));
+}
+
+// Most operands fit into a byte, the loop is left for the rest
+inline uint32_t ReadVarint(const uint8_t *&ip) {
+    uint32_t value = *ip++;
+    if (value < 0x80) [[likely]] {
+        return value;
+    }
+    value &= 0x7f;
+    for (int shift = 7;; shift += 7) {
+        uint32_t byte = *ip++;
+        value |= (byte & 0x7f) << shift;
+        if (byte < 0x80) {
+            return value;
+        }
+    }
+}
+
+inline int ReadSigned(const uint8_t *&ip) {
+    uint32_t value = ReadVarint(ip);
+    return static_cast<int>((value >> 1) ^ (0u - (value & 1)));
+}
+
+// Byte encoding of a program for the compact engine: a one byte opcode, registers packed
+// into it, and variable length operands, about a third of the size of the code words, so
+// large programs stay in the caches. HLT takes no bytes and the end of the code gets an END
+// of its own. Programs that jump to no command, or that end in a bad or truncated
+// command, are not encoded, the other engines report these traps.
+class CompactProgram {
+public:
+    CompactProgram(const int *program, int program_size);
+
+    bool IsEncoded() const { return encoded; }
+    const uint8_t *Code() const { return code.data(); }
+    int Size() const { return code.size(); }
+    // Offset of the command in the code words, from the offset of its first byte
+    int Pc(int offset) const;
+
+private:
+    void Encode(const int *program, int i, const std::vector<int> &offset);
+
+    std::vector<uint8_t> code;
+    bool encoded = false;
+    // Offsets of the encoded commands in both forms, in increasing order
+    std::vector<int> offsets;
+    std::vector<int> pcs;
+};
+
+CompactProgram::CompactProgram(const int *program, int program_size) {
+    std::vector<int> starts;
+    std::vector<bool> boundary(program_size + 1, false);
+    for (int i = 0; i < program_size; i += kCommandLength[program[i]]) {
+        if (!IsCommand(program[i]) || i + kCommandLength[program[i]] > program_size) {
+            return;
+        }
+        starts.push_back(i);
+        boundary[i] = true;
+    }
+    boundary[program_size] = true;
+    for (int i : starts) {
+        int operand = JumpOperand(program[i]);
+        if (operand != 0 && (static_cast<unsigned>(program[i + operand]) > static_cast<unsigned>(program_size) ||
+                             !boundary[program[i + operand]])) {
+            return;
+        }
+    }
+
+    // A jump gets longer when its target moves further, which moves other targets in turn.
+    // Offsets only grow, so this settles after a few rounds.
+    std::vector<int> offset(program_size + 1, 0);
+    for (bool changed = true; changed;) {
+        changed = false;
+        code.clear();
+        for (int i : starts) {
+            changed = changed || offset[i] != static_cast<int>(code.size());
+            offset[i] = code.size();
+            Encode(program, i, offset);
+        }
+        changed = changed || offset[program_size] != static_cast<int>(code.size());
+        offset[program_size] = code.size();
+    }
+    code.push_back(kCompactEnd);
+
+    for (int i : starts) {
+        if (program[i] != HLT) {
+            offsets.push_back(offset[i]);
+            pcs.push_back(i);
+        }
+    }
+    offsets.push_back(offset[program_size]);
+    pcs.push_back(program_size);
+    encoded = true;
+}
+
+void CompactProgram::Encode(const int *program, int i, const std::vector<int> &offset) {
+    static const int kOps[COMMANDS_COUNT] = {
+            kCompactPush, kCompactPushR, kCompactPop, kCompactPopR, kCompactDup, kCompactSwp, kCompactMov,
+            kCompactMovD, kCompactIn, kCompactOut, kCompactMul, kCompactAdd, kCompactMod, kCompactJmp, kCompactJe,
+            kCompactJne, kCompactEnd, -1, kCompactCall, kCompactRet, kCompactLoad, kCompactStore, kCompactLoadR,
+            kCompactStoreR, kCompactPushJe, kCompactPushJne, kCompactPushAdd, kCompactPushMul, kCompactDupPop,
+            kCompactPopSwp
+    };
+    int cmd = program[i];
+    int arg = kCommandLength[cmd] > 1 ? program[i + 1] : 0;
+    switch (cmd) {
+        case HLT:
+            break;
+        case PUSHR:
+        case POPR:
+        case LOADR:
+        case STORER:
+            code.push_back(IsRegister(arg) ? kOps[cmd] + arg : kCompactBadRegister);
+            break;
+        case MOVD:
+            if (!IsRegister(arg)) {
+                code.push_back(kCompactBadRegister);
+                break;
+            }
+            code.push_back(kCompactMovD + arg);
+            PutSigned(code, program[i + 2]);
+            break;
+        case MOV:
+            code.push_back(IsRegister(arg) && IsRegister(program[i + 2]) ? kCompactMov + arg * 4 + program[i + 2]
+                                                                         : kCompactBadRegister);
+            break;
+        default:
+            code.push_back(kOps[cmd]);
+            // Every operand but the jump target is an immediate
+            for (int k = 1; k < kCommandLength[cmd]; k++) {
+                if (k == JumpOperand(cmd)) {
+                    PutVarint(code, offset[program[i + k]]);
+                } else {
+                    PutSigned(code, program[i + k]);
+                }
+            }
+            break;
+    }
+}
+
+int CompactProgram::Pc(int offset) const {
+    auto it = std::upper_bound(offsets.begin(), offsets.end(), offset);
+    return it == offsets.begin() ? 0 : pcs[it - offsets.begin() - 1];
+}
+
+#endif //PROCESSOR_COMPACT_H
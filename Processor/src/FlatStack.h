@@ -0,0 +1,30 @@
+#ifndef PROCESSOR_FLATSTACK_H
+#define PROCESSOR_FLATSTACK_H
+
+#include <cstddef>
+
+// Preallocated operand stack without any checks. Used only for programs whose
+// stack depth is proven by StackVerifier, so it can neither underflow nor overflow.
+// The storage belongs to the caller, the first size elements are already on the stack.
+template <typename T>
+class FlatStack {
+public:
+    FlatStack(T* storage, size_t size) : base_(storage), top_(storage + size) {}
+    FlatStack(const FlatStack& other) = delete;
+    FlatStack& operator=(const FlatStack& other) = delete;
+
+    void Push(T element) { *top_++ = element; }
+    bool Pop() { --top_; return true; }
+    bool Pop(T& element) { element = *--top_; return true; }
+    bool Top(T& element) { element = top_[-1]; return true; }
+    bool IsEmpty() { return top_ == base_; }
+
+    T* Begin() { return base_; }
+    T* End() { return top_; }
+
+private:
+    T* base_;
+    T* top_;
+};
+
+#endif //PROCESSOR_FLATSTACK_H
@@ -0,0 +1,234 @@
+#ifndef PROCESSOR_IMAGE_H
+#define PROCESSOR_IMAGE_H
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <utility>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Binary image layout: ImageHeader, label table, int32 code segment.
+// Every label table entry is {int32 offset, uint32 name length, name padded to 4 bytes},
+// so the code segment stays 4-byte aligned and can be used in place after mmap.
+
+#define IMAGE_MAGIC 0x31434250 // "PBC1"
+#define IMAGE_VERSION 4
+#define IMAGE_EXTENSION ".pbc"
+
+struct ImageHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t source_hash;
+    uint32_t marks_count;
+    uint32_t marks_bytes;
+    uint32_t code_size;
+    uint32_t reserved;
+};
+
+// FNV-1a
+uint64_t HashBytes(const void *data, size_t size) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    const unsigned char *bytes = static_cast<const unsigned char *>(data);
+    for (size_t k = 0; k < size; k++) {
+        hash ^= bytes[k];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Key of the on-disk image cache
+uint64_t HashSource(const std::string &text) {
+    return HashBytes(text.data(), text.size());
+}
+
+std::string ImageCacheDir() {
+    const char *dir = getenv("PROCESSOR_CACHE_DIR");
+    if (dir != nullptr && *dir != '\0') {
+        return dir;
+    }
+    const char *home = getenv("HOME");
+    if (home == nullptr || *home == '\0') {
+        return "/tmp/processor-cache";
+    }
+    return std::string(home) + "/.cache/processor";
+}
+
+std::string CachedImagePath(uint64_t source_hash) {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(source_hash));
+    return ImageCacheDir() + "/" + name + IMAGE_EXTENSION;
+}
+
+class Image {
+public:
+    Image() : base(nullptr), length(0) {}
+    ~Image();
+    Image(const Image &other) = delete;
+    Image &operator=(const Image &other) = delete;
+    Image(Image &&other) noexcept;
+    Image &operator=(Image &&other) noexcept;
+
+    bool Map(const std::string &path);
+    void Unmap();
+    bool IsMapped() const { return base != nullptr; }
+
+    const ImageHeader &Header() const { return *reinterpret_cast<const ImageHeader *>(base); }
+    const int *Code() const;
+    void ReadMarks(std::map<std::string, int> &marks) const;
+
+    static bool Write(const std::string &path, uint64_t source_hash,
+                      const std::map<std::string, int> &marks, const int *program, int program_size);
+
+private:
+    // Every entry of the label table lies inside it and points into the code
+    bool MarksValid() const;
+
+    void *base;
+    size_t length;
+};
+
+Image::~Image() {
+    Unmap();
+}
+
+Image::Image(Image &&other) noexcept : base(other.base), length(other.length) {
+    other.base = nullptr;
+    other.length = 0;
+}
+
+Image &Image::operator=(Image &&other) noexcept {
+    if (this != &other) {
+        Unmap();
+        std::swap(base, other.base);
+        std::swap(length, other.length);
+    }
+    return *this;
+}
+
+bool Image::Map(const std::string &path) {
+    Unmap();
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(ImageHeader)) {
+        close(fd);
+        return false;
+    }
+    void *ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        return false;
+    }
+    base = ptr;
+    length = st.st_size;
+    const ImageHeader &header = Header();
+    size_t expected = sizeof(ImageHeader) + header.marks_bytes + sizeof(int32_t) * static_cast<size_t>(header.code_size);
+    if (header.magic != IMAGE_MAGIC || header.version != IMAGE_VERSION ||
+        header.marks_bytes % sizeof(int32_t) != 0 || expected != length || !MarksValid()) {
+        Unmap();
+        return false;
+    }
+    return true;
+}
+
+bool Image::MarksValid() const {
+    const char *ptr = static_cast<const char *>(base) + sizeof(ImageHeader);
+    const char *end = ptr + Header().marks_bytes;
+    for (uint32_t i = 0; i < Header().marks_count; i++) {
+        int32_t offset;
+        uint32_t name_length;
+        if (static_cast<size_t>(end - ptr) < sizeof(offset) + sizeof(name_length)) {
+            return false;
+        }
+        memcpy(&offset, ptr, sizeof(offset));
+        memcpy(&name_length, ptr + sizeof(offset), sizeof(name_length));
+        ptr += sizeof(offset) + sizeof(name_length);
+        if (offset < 0 || static_cast<uint32_t>(offset) > Header().code_size ||
+            static_cast<size_t>(end - ptr) < ((static_cast<size_t>(name_length) + 3) & ~static_cast<size_t>(3))) {
+            return false;
+        }
+        ptr += (static_cast<size_t>(name_length) + 3) & ~static_cast<size_t>(3);
+    }
+    return ptr == end;
+}
+
+void Image::Unmap() {
+    if (base != nullptr) {
+        munmap(base, length);
+        base = nullptr;
+        length = 0;
+    }
+}
+
+const int *Image::Code() const {
+    return reinterpret_cast<const int *>(static_cast<const char *>(base) + sizeof(ImageHeader) + Header().marks_bytes);
+}
+
+// The table was checked when the image was mapped
+void Image::ReadMarks(std::map<std::string, int> &marks) const {
+    const char *ptr = static_cast<const char *>(base) + sizeof(ImageHeader);
+    for (uint32_t i = 0; i < Header().marks_count; i++) {
+        int32_t offset;
+        uint32_t name_length;
+        memcpy(&offset, ptr, sizeof(offset));
+        memcpy(&name_length, ptr + sizeof(offset), sizeof(name_length));
+        ptr += sizeof(offset) + sizeof(name_length);
+        marks[std::string(ptr, name_length)] = offset;
+        ptr += (name_length + 3) & ~3u;
+    }
+}
+
+bool Image::Write(const std::string &path, uint64_t source_hash,
+                  const std::map<std::string, int> &marks, const int *program, int program_size) {
+    std::string table;
+    for (auto &mark : marks) {
+        int32_t offset = mark.second;
+        uint32_t name_length = mark.first.size();
+        table.append(reinterpret_cast<const char *>(&offset), sizeof(offset));
+        table.append(reinterpret_cast<const char *>(&name_length), sizeof(name_length));
+        table.append(mark.first);
+        table.append((4 - name_length % 4) % 4, '\0');
+    }
+    ImageHeader header = {IMAGE_MAGIC, IMAGE_VERSION, source_hash,
+                          static_cast<uint32_t>(marks.size()), static_cast<uint32_t>(table.size()),
+                          static_cast<uint32_t>(program_size), 0};
+
+    // Write to a temporary file first, so a concurrent reader never maps a half-written image
+    std::string tmp_path = path + ".tmp" + std::to_string(getpid());
+    FILE *file = fopen(tmp_path.c_str(), "wb");
+    if (file == nullptr) {
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(table.data(), 1, table.size(), file) == table.size() &&
+              fwrite(program, sizeof(int32_t), program_size, file) == static_cast<size_t>(program_size);
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool MakeDirs(const std::string &path) {
+    for (size_t i = 1; i <= path.size(); i++) {
+        if (i == path.size() || path[i] == '/') {
+            std::string prefix = path.substr(0, i);
+            if (mkdir(prefix.c_str(), 0755) != 0 && errno != EEXIST) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+#endif //PROCESSOR_IMAGE_H
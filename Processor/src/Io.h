@@ -0,0 +1,153 @@
+#ifndef PROCESSOR_IO_H
+#define PROCESSOR_IO_H
+
+#include <climits>
+#include <cstddef>
+#include <istream>
+#include <ostream>
+#include <vector>
+
+#define OUTPUT_BUFFER_SIZE (1 << 16)
+
+// Ports of a host that embeds the processor without streams: read gives the next IN value
+// and returns false at the end of the input, write takes every OUT value
+typedef bool (*ReadPort)(void *host, int &value);
+typedef void (*WritePort)(void *host, int value);
+
+// Collects OUT values as text and hands them to the stream in large blocks.
+// Interactive mode writes and flushes every line, like std::endl did.
+// Values for a vector or a port are handed over as they are, at once.
+class OutputBuffer {
+public:
+    OutputBuffer(std::ostream &out, bool interactive) : out(&out), interactive(interactive) {}
+    explicit OutputBuffer(std::vector<int> &values) : values(&values) {}
+    OutputBuffer(WritePort write, void *host) : write(write), host(host) {}
+    OutputBuffer(const OutputBuffer &other) = delete;
+    OutputBuffer &operator=(const OutputBuffer &other) = delete;
+    ~OutputBuffer() { Flush(); }
+
+    void Write(int value);
+    void Flush();
+
+private:
+    // Longest line is "-2147483648\n"
+    static const int kMaxLine = 12;
+
+    std::ostream *out = nullptr;
+    bool interactive = false;
+    std::vector<int> *values = nullptr;
+    WritePort write = nullptr;
+    void *host = nullptr;
+    int size = 0;
+    char buffer[OUTPUT_BUFFER_SIZE];
+};
+
+void OutputBuffer::Write(int value) {
+    if (out == nullptr) {
+        if (values != nullptr) {
+            values->push_back(value);
+        } else {
+            write(host, value);
+        }
+        return;
+    }
+    if (size > OUTPUT_BUFFER_SIZE - kMaxLine) {
+        Flush();
+    }
+    // Digits are produced backwards into a scratch area, unsigned keeps INT_MIN intact
+    char digits[kMaxLine];
+    char *end = digits + kMaxLine;
+    char *ptr = end;
+    unsigned magnitude = value < 0 ? 0u - static_cast<unsigned>(value) : static_cast<unsigned>(value);
+    *--ptr = '\n';
+    do {
+        *--ptr = static_cast<char>('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude != 0);
+    if (value < 0) {
+        *--ptr = '-';
+    }
+    while (ptr < end) {
+        buffer[size++] = *ptr++;
+    }
+    if (interactive) {
+        Flush();
+    }
+}
+
+void OutputBuffer::Flush() {
+    if (out == nullptr) {
+        return;
+    }
+    if (size > 0) {
+        out->write(buffer, size);
+        size = 0;
+    }
+    out->flush();
+}
+
+// Parses IN values straight from the read-ahead buffer of the stream, without
+// the locale and sentry work of operator>>. Characters after the last parsed
+// value stay in the stream, so it can be shared between runs.
+// An array or a port gives its values as they are.
+class InputBuffer {
+public:
+    explicit InputBuffer(std::istream *in) : in(in), buffer(in != nullptr ? in->rdbuf() : nullptr) {}
+    InputBuffer(const int *values, size_t count) : next(values), end(values + count) {}
+    InputBuffer(ReadPort read, void *host) : read(read), host(host) {}
+
+    // False on the end of input or on a malformed number, like a failed operator>>
+    bool Read(int &value);
+
+private:
+    std::istream *in = nullptr;
+    std::streambuf *buffer = nullptr;
+    // Values of the array not read yet
+    const int *next = nullptr;
+    const int *end = nullptr;
+    ReadPort read = nullptr;
+    void *host = nullptr;
+};
+
+bool InputBuffer::Read(int &value) {
+    if (next != end) {
+        value = *next++;
+        return true;
+    }
+    if (read != nullptr) {
+        return read(host, value);
+    }
+    if (buffer == nullptr || !*in) {
+        return false;
+    }
+    typedef std::char_traits<char> Traits;
+    int c = buffer->sgetc();
+    while (c != Traits::eof() && (c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f')) {
+        c = buffer->snextc();
+    }
+    bool negative = c == '-';
+    if (c == '-' || c == '+') {
+        c = buffer->snextc();
+    }
+    if (c == Traits::eof() || c < '0' || c > '9') {
+        in->setstate(c == Traits::eof() ? std::ios::eofbit | std::ios::failbit : std::ios::failbit);
+        return false;
+    }
+    unsigned long long magnitude = 0;
+    unsigned long long limit = negative ? 1ULL + INT_MAX : INT_MAX;
+    while (c != Traits::eof() && c >= '0' && c <= '9') {
+        magnitude = magnitude * 10 + (c - '0');
+        if (magnitude > limit) {
+            in->setstate(std::ios::failbit);
+            return false;
+        }
+        c = buffer->snextc();
+    }
+    if (c == Traits::eof()) {
+        in->setstate(std::ios::eofbit);
+    }
+    value = negative ? static_cast<int>(0ULL - magnitude) : static_cast<int>(magnitude);
+    return true;
+}
+
+#endif //PROCESSOR_IO_H
@@ -0,0 +1,424 @@
+#ifndef PROCESSOR_IR_H
+#define PROCESSOR_IR_H
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include "Commands.h"
+#include "Trap.h"
+
+// Three-address operations on virtual registers: dst = lhs op rhs. Imm forms take rhs as
+// a constant, kIrConst takes its constant in lhs. Everything up to kIrIn writes dst.
+// Memory operations take the address in lhs, an immediate one for the Imm forms, and stores
+// take the value in rhs. Only the Checked forms check the address, the others are proven.
+enum IrOp {
+    kIrConst, kIrMove, kIrAdd, kIrAddImm, kIrMul, kIrMulImm, kIrMod, kIrModImm,
+    kIrLoad, kIrLoadImm, kIrLoadChecked, kIrIn, kIrOut, kIrStore, kIrStoreImm, kIrStoreChecked,
+    kIrJump, kIrBranchEq, kIrBranchNe, kIrBranchEqImm, kIrBranchNeImm, kIrCall, kIrRet, kIrEnd, kIrTrap
+};
+
+// Jumps keep their target instruction in dst, CALL its return point in rhs and kIrTrap the
+// trap in lhs. pc is the offset of the command the instruction came from, depth the number
+// of stack slots that hold the stack when the run stops at this instruction.
+struct IrInstruction {
+    IrOp op;
+    int dst;
+    int lhs;
+    int rhs;
+    int pc;
+    int depth;
+};
+
+// Register form of a proven program. Virtual registers are the VM registers, then a register
+// for every stack slot the verifier allows, then temporaries. As the depth before every
+// command is known, stack slots are plain registers, and inside a basic block the stack is
+// tracked at translation time, so values go from one command to the next without a slot
+// in between. Slots are written only where a block ends, a trap leaves the stack as it was
+// when the block was entered.
+class IrProgram {
+public:
+    IrProgram(const int *program, int program_size, const std::vector<int> &depths, int max_depth,
+              const std::vector<bool> &proven);
+
+    const std::vector<IrInstruction> &Code() const { return code; }
+    // Registers, slots and temporaries together
+    int ValuesCount() const { return values_count; }
+    static int Slot(int position) { return REGISTERS_SIZE + position; }
+
+private:
+    std::vector<IrInstruction> code;
+    int values_count;
+};
+
+class IrTranslator {
+public:
+    IrTranslator(const int *program, int program_size, const std::vector<int> &depths, int max_depth,
+                 const std::vector<bool> &proven)
+            : program(program), program_size(program_size), depths(depths), proven(proven),
+              temp_base(IrProgram::Slot(max_depth)) {}
+
+    std::vector<IrInstruction> Translate();
+    int ValuesCount() const { return values_count; }
+
+private:
+    // Stack entry known at translation time, a constant or the register holding the value
+    struct Value {
+        bool constant;
+        int value;
+
+        bool operator==(const Value &other) const { return constant == other.constant && value == other.value; }
+    };
+
+    void Block(int start);
+    int Next(int i) const { return i + kCommandLength[program[i]]; }
+    void Emit(IrOp op, int dst, int lhs = 0, int rhs = 0, int depth = 0) {
+        code.push_back({op, dst, lhs, rhs, current, depth});
+    }
+    int Temp();
+    Value Pop();
+    static Value Register(int r) { return {false, r}; }
+    static Value Constant(int c) { return {true, c}; }
+    bool IsReferenced(int reg, int except) const;
+    // Register holding the value, constants are loaded into a temporary
+    int Materialize(const Value &value);
+    // Copies the stack entries that read reg elsewhere before reg changes
+    void Clobber(int reg);
+    void Assign(int reg, const Value &value, int except = -1);
+    // Stores the entries below limit to their slots
+    void Flush(int limit);
+    void Arithmetic(int cmd, const Value &lhs, const Value &rhs);
+
+    const int *program;
+    int program_size;
+    const std::vector<int> &depths;
+    const std::vector<bool> &proven;
+    int temp_base;
+    int next_temp = 0;
+    int values_count = 0;
+    std::vector<bool> leader;
+    std::vector<Value> stack;
+    std::vector<IrInstruction> code;
+    int current = 0;
+    int entry_depth = 0;
+};
+
+int IrTranslator::Temp() {
+    int temp = temp_base + next_temp++;
+    values_count = std::max(values_count, temp + 1);
+    return temp;
+}
+
+IrTranslator::Value IrTranslator::Pop() {
+    Value value = stack.back();
+    stack.pop_back();
+    return value;
+}
+
+bool IrTranslator::IsReferenced(int reg, int except) const {
+    for (size_t p = 0; p < stack.size(); p++) {
+        if (static_cast<int>(p) != except && stack[p] == Register(reg)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int IrTranslator::Materialize(const Value &value) {
+    if (!value.constant) {
+        return value.value;
+    }
+    int temp = Temp();
+    Emit(kIrConst, temp, value.value);
+    return temp;
+}
+
+void IrTranslator::Clobber(int reg) {
+    int copy = -1;
+    for (size_t p = 0; p < stack.size(); p++) {
+        if (stack[p] == Register(reg) && reg != IrProgram::Slot(p)) {
+            if (copy < 0) {
+                copy = Temp();
+                Emit(kIrMove, copy, reg);
+            }
+            stack[p] = Register(copy);
+        }
+    }
+}
+
+void IrTranslator::Assign(int reg, const Value &value, int except) {
+    if (value == Register(reg)) {
+        return;
+    }
+    Clobber(reg);
+    // A temporary nobody else reads is renamed, its instruction writes reg right away
+    if (!value.constant && value.value >= temp_base && !code.empty() && code.back().op <= kIrIn &&
+        code.back().dst == value.value && !IsReferenced(value.value, except)) {
+        code.back().dst = reg;
+        return;
+    }
+    if (value.constant) {
+        Emit(kIrConst, reg, value.value);
+    } else {
+        Emit(kIrMove, reg, value.value);
+    }
+}
+
+void IrTranslator::Flush(int limit) {
+    for (int p = 0; p < limit; p++) {
+        Value home = Register(IrProgram::Slot(p));
+        if (!(stack[p] == home)) {
+            Assign(IrProgram::Slot(p), stack[p], p);
+            stack[p] = home;
+        }
+    }
+}
+
+void IrTranslator::Arithmetic(int cmd, const Value &lhs, const Value &rhs) {
+    bool add = cmd == ADD;
+    // Wrap around as the hardware does, without UB at translation time
+    if (lhs.constant && rhs.constant) {
+        unsigned a = static_cast<unsigned>(lhs.value);
+        unsigned b = static_cast<unsigned>(rhs.value);
+        stack.push_back(Constant(static_cast<int>(add ? a + b : a * b)));
+        return;
+    }
+    const Value &reg = lhs.constant ? rhs : lhs;
+    const Value &other = lhs.constant ? lhs : rhs;
+    if (other.constant && other.value == (add ? 0 : 1)) {
+        stack.push_back(reg);
+        return;
+    }
+    int temp = Temp();
+    if (other.constant) {
+        Emit(add ? kIrAddImm : kIrMulImm, temp, reg.value, other.value);
+    } else {
+        Emit(add ? kIrAdd : kIrMul, temp, lhs.value, rhs.value);
+    }
+    stack.push_back(Register(temp));
+}
+
+void IrTranslator::Block(int start) {
+    entry_depth = depths[start];
+    stack.clear();
+    for (int p = 0; p < entry_depth; p++) {
+        stack.push_back(Register(IrProgram::Slot(p)));
+    }
+    next_temp = 0;
+    current = start;
+    if (start == program_size) {
+        Emit(kIrEnd, 0, 0, 0, entry_depth);
+        return;
+    }
+    for (int i = start;; i = Next(i)) {
+        current = i;
+        if (i == program_size || (i != start && leader[i])) {
+            Flush(stack.size());
+            return;
+        }
+        const int *op = program + i;
+        int cmd = op[0];
+        bool bad_register = ((cmd == PUSHR || cmd == POPR || cmd == MOVD || cmd == LOADR || cmd == STORER) &&
+                             !IsRegister(op[1])) || (cmd == MOV && (!IsRegister(op[1]) || !IsRegister(op[2])));
+        if (bad_register) {
+            Emit(kIrTrap, 0, kBadRegister, 0, entry_depth);
+            return;
+        }
+        Value lhs, rhs;
+        switch (cmd) {
+            case PUSH:
+                stack.push_back(Constant(op[1]));
+                break;
+            case PUSHR:
+                stack.push_back(Register(op[1]));
+                break;
+            case POP:
+                stack.pop_back();
+                break;
+            case POPR:
+                Assign(op[1], Pop());
+                break;
+            case MOV:
+                Assign(op[1], Register(op[2]));
+                break;
+            case MOVD:
+                Assign(op[1], Constant(op[2]));
+                break;
+            case DUP:
+            case DUP_POP: {
+                rhs = Pop();
+                lhs = Pop();
+                // The proof keeps the count within STACK_MAX_SIZE
+                int64_t pushed = 2 * static_cast<int64_t>(op[1]) - (cmd == DUP_POP ? 1 : 0);
+                for (int k = 0; k < pushed; k++) {
+                    stack.push_back(k % 2 == 0 ? lhs : rhs);
+                }
+                break;
+            }
+            case SWP:
+            case POP_SWP:
+                if (cmd == POP_SWP) {
+                    stack.pop_back();
+                }
+                std::swap(stack[stack.size() - 1], stack[stack.size() - 2]);
+                break;
+            case IN: {
+                int temp = Temp();
+                Emit(kIrIn, temp, 0, 0, entry_depth);
+                stack.push_back(Register(temp));
+                break;
+            }
+            case OUT:
+                lhs = Pop();
+                Emit(kIrOut, 0, Materialize(lhs));
+                break;
+            case LOAD:
+            case LOADR: {
+                int temp = Temp();
+                if (!proven[i]) {
+                    Emit(kIrLoadChecked, temp, Materialize(cmd == LOAD ? Constant(op[1]) : Register(op[1])), 0,
+                         entry_depth);
+                } else {
+                    Emit(cmd == LOAD ? kIrLoadImm : kIrLoad, temp, op[1]);
+                }
+                stack.push_back(Register(temp));
+                break;
+            }
+            case STORE:
+            case STORER: {
+                int value = Materialize(Pop());
+                if (!proven[i]) {
+                    int address = Materialize(cmd == STORE ? Constant(op[1]) : Register(op[1]));
+                    Emit(kIrStoreChecked, 0, address, value, entry_depth);
+                } else {
+                    Emit(cmd == STORE ? kIrStoreImm : kIrStore, 0, op[1], value);
+                }
+                break;
+            }
+            case ADD:
+            case MUL:
+            case PUSH_ADD:
+            case PUSH_MUL:
+                rhs = cmd == PUSH_ADD || cmd == PUSH_MUL ? Constant(op[1]) : Pop();
+                lhs = Pop();
+                Arithmetic(cmd == ADD || cmd == PUSH_ADD ? ADD : MUL, lhs, rhs);
+                break;
+            case MOD: {
+                rhs = Pop();
+                lhs = Pop();
+                if (rhs.constant && rhs.value == 0) {
+                    Emit(kIrTrap, 0, kDivisionByZero, 0, entry_depth);
+                    return;
+                }
+                if (rhs.constant && lhs.constant) {
+                    stack.push_back(Constant(Remainder(lhs.value, rhs.value)));
+                    break;
+                }
+                int temp = Temp();
+                if (rhs.constant) {
+                    Emit(kIrModImm, temp, lhs.value, rhs.value);
+                } else {
+                    Emit(kIrMod, temp, Materialize(lhs), rhs.value, entry_depth);
+                }
+                stack.push_back(Register(temp));
+                break;
+            }
+            case JMP:
+                Flush(stack.size());
+                Emit(kIrJump, op[1]);
+                return;
+            case JE:
+            case JNE:
+            case PUSH_JE:
+            case PUSH_JNE: {
+                bool immediate = cmd == PUSH_JE || cmd == PUSH_JNE;
+                bool equal = cmd == JE || cmd == PUSH_JE;
+                // The operands stay on the stack while it is flushed, so their registers survive it
+                int operands = immediate ? 1 : 2;
+                Flush(stack.size() - operands);
+                rhs = immediate ? Constant(op[1]) : Pop();
+                lhs = Pop();
+                int target = op[JumpOperand(cmd)];
+                if (lhs.constant && rhs.constant) {
+                    if ((lhs.value == rhs.value) == equal) {
+                        Emit(kIrJump, target);
+                    }
+                } else if (lhs.constant || rhs.constant) {
+                    const Value &reg = lhs.constant ? rhs : lhs;
+                    const Value &other = lhs.constant ? lhs : rhs;
+                    Emit(equal ? kIrBranchEqImm : kIrBranchNeImm, target, reg.value, other.value);
+                } else {
+                    Emit(equal ? kIrBranchEq : kIrBranchNe, target, lhs.value, rhs.value);
+                }
+                return;
+            }
+            case CALL:
+                Flush(stack.size());
+                Emit(kIrCall, op[1], 0, Next(i), stack.size());
+                return;
+            case RET:
+                Flush(stack.size());
+                Emit(kIrRet, 0, 0, 0, stack.size());
+                return;
+            case END:
+                Flush(stack.size());
+                Emit(kIrEnd, 0, 0, 0, stack.size());
+                return;
+            default:
+                break;
+        }
+    }
+}
+
+std::vector<IrInstruction> IrTranslator::Translate() {
+    values_count = temp_base;
+    leader.assign(program_size + 1, false);
+    leader[0] = true;
+    leader[program_size] = true;
+    for (int i = 0; i < program_size; i = Next(i)) {
+        int cmd = program[i];
+        int operand = JumpOperand(cmd);
+        if (operand != 0) {
+            leader[program[i + operand]] = true;
+        }
+        if (operand != 0 || cmd == RET || cmd == END) {
+            leader[Next(i)] = true;
+        }
+    }
+    // Blocks go in program order, so a block that falls through is followed by its successor
+    std::vector<int> start(program_size + 1, -1);
+    for (int i = 0; i <= program_size; i = i < program_size ? Next(i) : i + 1) {
+        if (leader[i] && depths[i] >= 0) {
+            start[i] = code.size();
+            Block(i);
+        }
+    }
+    for (IrInstruction &instruction : code) {
+        switch (instruction.op) {
+            case kIrJump:
+            case kIrBranchEq:
+            case kIrBranchNe:
+            case kIrBranchEqImm:
+            case kIrBranchNeImm:
+                instruction.dst = start[instruction.dst];
+                break;
+            case kIrCall:
+                instruction.dst = start[instruction.dst];
+                // A subroutine that never returns leaves its return point untranslated
+                instruction.rhs = start[instruction.rhs];
+                break;
+            default:
+                break;
+        }
+    }
+    return std::move(code);
+}
+
+IrProgram::IrProgram(const int *program, int program_size, const std::vector<int> &depths, int max_depth,
+                     const std::vector<bool> &proven) {
+    IrTranslator translator(program, program_size, depths, max_depth, proven);
+    code = translator.Translate();
+    values_count = translator.ValuesCount();
+}
+
+#endif //PROCESSOR_IR_H
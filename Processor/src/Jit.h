@@ -0,0 +1,635 @@
+#ifndef PROCESSOR_JIT_H
+#define PROCESSOR_JIT_H
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <utility>
+#include <vector>
+#include <sys/mman.h>
+#include "Commands.h"
+#include "Trap.h"
+
+#if defined(__x86_64__) && defined(__unix__)
+#define PROCESSOR_HAS_JIT 1
+#else
+#define PROCESSOR_HAS_JIT 0
+#endif
+
+// Everything the native code reads and writes. VM registers live in r12d-r15d while
+// the code runs and are stored back on exit, together with the operand stack top.
+// On a trap pc receives the offset of the failed command.
+struct JitState {
+    int registers[REGISTERS_SIZE];
+    int *stack_base;
+    int *stack_top;
+    int *stack_limit;
+    void *host;
+    // Returns 0 if there is no input, the value is stored to *value otherwise
+    int (*in)(void *host, int *value);
+    void (*out)(void *host, int value);
+    int input;
+    int pc;
+    // Native addresses to continue at after RET
+    const void **return_base;
+    const void **return_top;
+    const void **return_limit;
+    int *memory;
+    int memory_size;
+};
+
+// Translates the bytecode into x86-64 code placed into an executable mapping.
+// Host is called back only for IN and OUT.
+class JitProgram {
+public:
+    // Unchecked code trusts the caller that the stack bounds are proven. Memory commands at the
+    // proven offsets trust that the memory of the run covers their addresses.
+    JitProgram(const int *program, int program_size, bool checked = true,
+               const std::vector<bool> &proven = std::vector<bool>());
+    ~JitProgram();
+    JitProgram(const JitProgram &other) = delete;
+    JitProgram &operator=(const JitProgram &other) = delete;
+
+    bool IsCompiled() const { return code != nullptr; }
+    Trap Run(JitState &state) const;
+
+private:
+    void *code;
+    size_t code_size;
+};
+
+#if PROCESSOR_HAS_JIT
+
+class JitAssembler {
+public:
+    enum Reg {
+        rax, rcx, rdx, rbx, rsp, rbp, rsi, rdi, r8, r9, r10, r11, r12, r13, r14, r15
+    };
+    enum Condition {
+        kBelow = 0x2, kAboveEqual = 0x3, kEqual = 0x4, kNotEqual = 0x5, kBelowEqual = 0x6, kAbove = 0x7
+    };
+
+    explicit JitAssembler(int labels_count) : labels(labels_count, -1) {}
+
+    const std::vector<uint8_t> &Code() const { return code; }
+    int NewLabel() {
+        labels.push_back(-1);
+        return labels.size() - 1;
+    }
+    void Bind(int label) { labels[label] = code.size(); }
+    void Link();
+
+    void Jmp(int label) { Byte(0xE9); Fixup(label); }
+    void JmpM(Reg base, int32_t disp) { Mem(0xFF, static_cast<Reg>(4), base, disp, false); }
+    void Jcc(Condition cc, int label) { Byte(0x0F); Byte(0x80 | cc); Fixup(label); }
+
+    void Push(Reg r) { Rex(false, 0, r, true); Byte(0x50 | (r & 7)); }
+    void Pop(Reg r) { Rex(false, 0, r, true); Byte(0x58 | (r & 7)); }
+    void Ret() { Byte(0xC3); }
+    void Cdq() { Byte(0x99); }
+
+    // Register to register, dst = src or dst op= src. Wide means 64 bit operands.
+    void MovRR(Reg dst, Reg src, bool wide = false) { RR(0x89, src, dst, wide); }
+    void AddRR(Reg dst, Reg src) { RR(0x01, src, dst, false); }
+    void ShlRI(Reg dst, uint8_t imm) { RR(0xC1, static_cast<Reg>(4), dst, true); Byte(imm); }
+    void SubRR(Reg dst, Reg src, bool wide = false) { RR(0x29, src, dst, wide); }
+    void CmpRR(Reg lhs, Reg rhs, bool wide = false) { RR(0x39, rhs, lhs, wide); }
+    void TestRR(Reg lhs, Reg rhs) { RR(0x85, rhs, lhs, false); }
+    void ImulRR(Reg dst, Reg src) { Rex(false, dst, src, true); Byte(0x0F); RR(0xAF, dst, src, false, false); }
+    void IdivR(Reg src) { RR(0xF7, static_cast<Reg>(7), src, false); }
+    void DecR(Reg r) { RR(0xFF, static_cast<Reg>(1), r, false); }
+
+    // Memory operands are always [base + disp]
+    void Load(Reg dst, Reg base, int32_t disp, bool wide = false) { Mem(0x8B, dst, base, disp, wide); }
+    void Store(Reg base, int32_t disp, Reg src, bool wide = false) { Mem(0x89, src, base, disp, wide); }
+    void StoreImm(Reg base, int32_t disp, int32_t imm) { Mem(0xC7, rax, base, disp, false); Dword(imm); }
+    void Lea(Reg dst, Reg base, int32_t disp) { Mem(0x8D, dst, base, disp, true); }
+    // Address of a label, relative to the instruction pointer
+    void LeaLabel(Reg dst, int label) { Rex(true, dst, 0, false); Byte(0x8D); Byte(0x05 | ((dst & 7) << 3)); Fixup(label); }
+    void CmpRM(Reg lhs, Reg base, int32_t disp, bool wide = false) { Mem(0x3B, lhs, base, disp, wide); }
+    void CmpMI(Reg base, int32_t disp, int32_t imm) { Mem(0x81, static_cast<Reg>(7), base, disp, false); Dword(imm); }
+    void AddRM(Reg dst, Reg base, int32_t disp, bool wide = false) { Mem(0x03, dst, base, disp, wide); }
+    void AddMI(Reg base, int32_t disp, int32_t imm) { Mem(0x81, rax, base, disp, false); Dword(imm); }
+    void ImulRMI(Reg dst, Reg base, int32_t disp, int32_t imm) { Mem(0x69, dst, base, disp, false); Dword(imm); }
+    void CallM(Reg base, int32_t disp) { Mem(0xFF, static_cast<Reg>(2), base, disp, false); }
+
+    void MovRI(Reg dst, int32_t imm) { Rex(false, 0, dst, true); Byte(0xB8 | (dst & 7)); Dword(imm); }
+    void AddRI(Reg dst, int32_t imm, bool wide = true) { RI(0, dst, imm, wide); }
+    void SubRI(Reg dst, int32_t imm, bool wide = true) { RI(5, dst, imm, wide); }
+    void CmpRI(Reg dst, int32_t imm, bool wide = true) { RI(7, dst, imm, wide); }
+
+private:
+    void Byte(uint8_t value) { code.push_back(value); }
+    void Dword(int32_t value) {
+        uint8_t bytes[4];
+        memcpy(bytes, &value, sizeof(bytes));
+        code.insert(code.end(), bytes, bytes + 4);
+    }
+    void Rex(bool wide, int reg, int rm, bool optional) {
+        uint8_t rex = 0x40 | (wide ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0);
+        if (rex != 0x40 || !optional) {
+            Byte(rex);
+        }
+    }
+    void RR(uint8_t opcode, int reg, int rm, bool wide, bool rex = true) {
+        if (rex) {
+            Rex(wide, reg, rm, true);
+        }
+        Byte(opcode);
+        Byte(0xC0 | ((reg & 7) << 3) | (rm & 7));
+    }
+    void RI(int ext, Reg rm, int32_t imm, bool wide) {
+        Rex(wide, 0, rm, true);
+        bool small = imm >= -128 && imm <= 127;
+        Byte(small ? 0x83 : 0x81);
+        Byte(0xC0 | (ext << 3) | (rm & 7));
+        if (small) {
+            Byte(static_cast<uint8_t>(imm));
+        } else {
+            Dword(imm);
+        }
+    }
+    void Mem(uint8_t opcode, int reg, Reg base, int32_t disp, bool wide) {
+        Rex(wide, reg, base, true);
+        Byte(opcode);
+        bool small = disp >= -128 && disp <= 127;
+        Byte((small ? 0x40 : 0x80) | ((reg & 7) << 3) | (base & 7));
+        if ((base & 7) == rsp) {
+            Byte(0x24);
+        }
+        if (small) {
+            Byte(static_cast<uint8_t>(disp));
+        } else {
+            Dword(disp);
+        }
+    }
+    void Fixup(int label) {
+        fixups.push_back({static_cast<int>(code.size()), label});
+        Dword(0);
+    }
+
+    struct LabelFixup {
+        int offset;
+        int label;
+    };
+
+    std::vector<uint8_t> code;
+    std::vector<int> labels;
+    std::vector<LabelFixup> fixups;
+};
+
+void JitAssembler::Link() {
+    for (auto &fixup : fixups) {
+        int32_t rel = labels[fixup.label] - (fixup.offset + 4);
+        memcpy(&code[fixup.offset], &rel, sizeof(rel));
+    }
+}
+
+// Register assignment of the generated code:
+//   rbx - operand stack top, rbp - operand stack base, r11 - operand stack limit,
+//   r12d-r15d - VM registers RAX-RDX, [rsp] - JitState pointer.
+class JitCompiler {
+public:
+    typedef JitAssembler A;
+
+    JitCompiler(const int *program, int program_size, bool checked, const std::vector<bool> &proven)
+            : program(program), program_size(program_size), checked(checked), proven(proven),
+              a(program_size + 2) {}
+
+    std::vector<uint8_t> Compile();
+
+private:
+    // Labels 0..program_size are program offsets, the exit goes right after them
+    int ExitLabel() const { return program_size + 1; }
+    int TrapLabel(int pc, Trap trap);
+    int TargetLabel(int target);
+    static A::Reg VmRegister(int r) { return static_cast<A::Reg>(A::r12 + r); }
+
+    void Prologue();
+    void Epilogue();
+    bool ValidRegisters(int i) const;
+    void Command(int i);
+    void RequireDepth(int count);
+    void RequireSpace(int count);
+    void PushReg(A::Reg r);
+    void PushPairs(int times);
+    void ReloadAfterCall();
+    void MemoryAddress(int i);
+
+    const int *program;
+    int program_size;
+    bool checked;
+    const std::vector<bool> &proven;
+    A a;
+    // Offset of the command being compiled
+    int current = 0;
+    std::vector<bool> boundary;
+    // Trap stubs, one for each command and reason, keyed by {pc, trap}
+    std::map<std::pair<int, int>, int> traps;
+};
+
+void JitCompiler::Prologue() {
+    a.Push(A::rbx);
+    a.Push(A::rbp);
+    a.Push(A::r12);
+    a.Push(A::r13);
+    a.Push(A::r14);
+    a.Push(A::r15);
+    // The seventh push keeps rsp 16-byte aligned for the host calls
+    a.Push(A::rdi);
+    for (int r = 0; r < REGISTERS_SIZE; r++) {
+        a.Load(VmRegister(r), A::rdi, offsetof(JitState, registers) + r * sizeof(int));
+    }
+    a.Load(A::rbx, A::rdi, offsetof(JitState, stack_top), true);
+    a.Load(A::rbp, A::rdi, offsetof(JitState, stack_base), true);
+    a.Load(A::r11, A::rdi, offsetof(JitState, stack_limit), true);
+}
+
+int JitCompiler::TrapLabel(int pc, Trap trap) {
+    auto it = traps.find({pc, trap});
+    if (it != traps.end()) {
+        return it->second;
+    }
+    int label = a.NewLabel();
+    traps[{pc, trap}] = label;
+    return label;
+}
+
+// Jumps out of the program trap at the jump, jumps between command boundaries trap at the target
+int JitCompiler::TargetLabel(int target) {
+    if (target < 0 || target > program_size) {
+        return TrapLabel(current, kBadJump);
+    }
+    return boundary[target] ? target : TrapLabel(target, kBadOpcode);
+}
+
+// Trap code arrives in eax, the state is written back before returning
+void JitCompiler::Epilogue() {
+    a.Bind(program_size);
+    a.MovRI(A::rax, kNoTrap);
+    a.Bind(ExitLabel());
+    a.Load(A::rcx, A::rsp, 0, true);
+    for (int r = 0; r < REGISTERS_SIZE; r++) {
+        a.Store(A::rcx, offsetof(JitState, registers) + r * sizeof(int), VmRegister(r));
+    }
+    a.Store(A::rcx, offsetof(JitState, stack_top), A::rbx, true);
+    a.Pop(A::rdi);
+    a.Pop(A::r15);
+    a.Pop(A::r14);
+    a.Pop(A::r13);
+    a.Pop(A::r12);
+    a.Pop(A::rbp);
+    a.Pop(A::rbx);
+    a.Ret();
+
+    for (auto &trap : traps) {
+        a.Bind(trap.second);
+        a.Load(A::rcx, A::rsp, 0, true);
+        a.StoreImm(A::rcx, offsetof(JitState, pc), trap.first.first);
+        a.MovRI(A::rax, trap.first.second);
+        a.Jmp(ExitLabel());
+    }
+}
+
+std::vector<uint8_t> JitCompiler::Compile() {
+    boundary.assign(program_size + 1, false);
+    int end = 0;
+    while (end < program_size && IsCommand(program[end]) && end + kCommandLength[program[end]] <= program_size) {
+        boundary[end] = true;
+        end += kCommandLength[program[end]];
+    }
+    boundary[program_size] = true;
+
+    Prologue();
+    for (current = 0; current < end; current += kCommandLength[program[current]]) {
+        a.Bind(current);
+        Command(current);
+    }
+    if (end < program_size) {
+        // A call right before the bad opcode returns here
+        a.Bind(end);
+        a.Jmp(TrapLabel(end, kBadOpcode));
+    }
+    Epilogue();
+    a.Link();
+    return a.Code();
+}
+
+void JitCompiler::RequireDepth(int count) {
+    if (!checked) {
+        return;
+    }
+    a.MovRR(A::rax, A::rbx, true);
+    a.SubRR(A::rax, A::rbp, true);
+    a.CmpRI(A::rax, count * sizeof(int));
+    a.Jcc(A::kBelow, TrapLabel(current, kStackUnderflow));
+}
+
+void JitCompiler::RequireSpace(int count) {
+    if (!checked) {
+        return;
+    }
+    a.Lea(A::rdx, A::rbx, count * sizeof(int));
+    a.CmpRR(A::rdx, A::r11, true);
+    a.Jcc(A::kAbove, TrapLabel(current, kStackOverflow));
+}
+
+void JitCompiler::PushReg(A::Reg r) {
+    RequireSpace(1);
+    a.Store(A::rbx, 0, r);
+    a.AddRI(A::rbx, sizeof(int));
+}
+
+// Pushes the pair (ecx, eax) the given number of times
+void JitCompiler::PushPairs(int times) {
+    if (times <= 0) {
+        return;
+    }
+    RequireSpace(2 * times);
+    if (times <= 4) {
+        for (int k = 0; k < times; k++) {
+            a.Store(A::rbx, 8 * k, A::rcx);
+            a.Store(A::rbx, 8 * k + 4, A::rax);
+        }
+        a.AddRI(A::rbx, 8 * times);
+        return;
+    }
+    int loop = a.NewLabel();
+    a.MovRI(A::rdx, times);
+    a.Bind(loop);
+    a.Store(A::rbx, 0, A::rcx);
+    a.Store(A::rbx, 4, A::rax);
+    a.AddRI(A::rbx, 8);
+    a.DecR(A::rdx);
+    a.Jcc(A::kNotEqual, loop);
+}
+
+// r11 is caller-saved, so the stack limit is reloaded from the state after a host call
+void JitCompiler::ReloadAfterCall() {
+    a.Load(A::rcx, A::rsp, 0, true);
+    a.Load(A::r11, A::rcx, offsetof(JitState, stack_limit), true);
+}
+
+// Native address of the word a memory command uses goes to rax, rcx keeps the state pointer
+void JitCompiler::MemoryAddress(int i) {
+    const int *op = program + i;
+    bool check = proven.empty() || !proven[i];
+    a.Load(A::rcx, A::rsp, 0, true);
+    if (op[0] == LOAD || op[0] == STORE) {
+        if (static_cast<unsigned>(op[1]) >= MEMORY_MAX_SIZE) {
+            a.Jmp(TrapLabel(i, kBadAddress));
+            return;
+        }
+        if (check) {
+            a.CmpMI(A::rcx, offsetof(JitState, memory_size), op[1]);
+            a.Jcc(A::kBelowEqual, TrapLabel(i, kBadAddress));
+        }
+        a.MovRI(A::rax, op[1]);
+    } else {
+        // A 32 bit move clears the upper half, so a negative address compares as a huge one
+        a.MovRR(A::rax, VmRegister(op[1]));
+        if (check) {
+            a.CmpRM(A::rax, A::rcx, offsetof(JitState, memory_size));
+            a.Jcc(A::kAboveEqual, TrapLabel(i, kBadAddress));
+        }
+    }
+    a.ShlRI(A::rax, 2);
+    a.AddRM(A::rax, A::rcx, offsetof(JitState, memory), true);
+}
+
+bool JitCompiler::ValidRegisters(int i) const {
+    switch (program[i]) {
+        case PUSHR:
+        case POPR:
+        case MOVD:
+        case LOADR:
+        case STORER:
+            return IsRegister(program[i + 1]);
+        case MOV:
+            return IsRegister(program[i + 1]) && IsRegister(program[i + 2]);
+        default:
+            return true;
+    }
+}
+
+void JitCompiler::Command(int i) {
+    const int *op = program + i;
+    if (!ValidRegisters(i)) {
+        a.Jmp(TrapLabel(i, kBadRegister));
+        return;
+    }
+    switch (op[0]) {
+        case PUSH:
+            RequireSpace(1);
+            a.StoreImm(A::rbx, 0, op[1]);
+            a.AddRI(A::rbx, sizeof(int));
+            break;
+        case PUSHR:
+            PushReg(VmRegister(op[1]));
+            break;
+        case POP:
+            RequireDepth(1);
+            a.SubRI(A::rbx, sizeof(int));
+            break;
+        case POPR:
+            RequireDepth(1);
+            a.SubRI(A::rbx, sizeof(int));
+            a.Load(VmRegister(op[1]), A::rbx, 0);
+            break;
+        case DUP:
+        case DUP_POP:
+            RequireDepth(2);
+            a.Load(A::rax, A::rbx, -4);
+            a.Load(A::rcx, A::rbx, -8);
+            a.SubRI(A::rbx, 8);
+            if (op[1] > STACK_MAX_SIZE / 2) {
+                a.Jmp(TrapLabel(i, kStackOverflow));
+            } else if (op[0] == DUP) {
+                PushPairs(op[1]);
+            } else if (op[1] > 0) {
+                PushPairs(op[1] - 1);
+                PushReg(A::rcx);
+            }
+            break;
+        case SWP:
+        case POP_SWP:
+            RequireDepth(op[0] == SWP ? 2 : 3);
+            if (op[0] == POP_SWP) {
+                a.SubRI(A::rbx, sizeof(int));
+            }
+            a.Load(A::rax, A::rbx, -4);
+            a.Load(A::rcx, A::rbx, -8);
+            a.Store(A::rbx, -4, A::rcx);
+            a.Store(A::rbx, -8, A::rax);
+            break;
+        case MOV:
+            a.MovRR(VmRegister(op[1]), VmRegister(op[2]));
+            break;
+        case MOVD:
+            a.MovRI(VmRegister(op[1]), op[2]);
+            break;
+        case IN:
+            a.Load(A::rax, A::rsp, 0, true);
+            a.Lea(A::rsi, A::rax, offsetof(JitState, input));
+            a.Load(A::rdi, A::rax, offsetof(JitState, host), true);
+            a.CallM(A::rax, offsetof(JitState, in));
+            a.TestRR(A::rax, A::rax);
+            a.Jcc(A::kEqual, TrapLabel(i, kNoInput));
+            ReloadAfterCall();
+            a.Load(A::rax, A::rcx, offsetof(JitState, input));
+            PushReg(A::rax);
+            break;
+        case OUT:
+            RequireDepth(1);
+            a.SubRI(A::rbx, sizeof(int));
+            a.Load(A::rsi, A::rbx, 0);
+            a.Load(A::rax, A::rsp, 0, true);
+            a.Load(A::rdi, A::rax, offsetof(JitState, host), true);
+            a.CallM(A::rax, offsetof(JitState, out));
+            ReloadAfterCall();
+            break;
+        case MUL:
+        case ADD:
+            RequireDepth(2);
+            a.Load(A::rax, A::rbx, -4);
+            a.Load(A::rcx, A::rbx, -8);
+            if (op[0] == ADD) {
+                a.AddRR(A::rcx, A::rax);
+            } else {
+                a.ImulRR(A::rcx, A::rax);
+            }
+            a.Store(A::rbx, -8, A::rcx);
+            a.SubRI(A::rbx, sizeof(int));
+            break;
+        case MOD: {
+            RequireDepth(2);
+            a.Load(A::rcx, A::rbx, -4);
+            a.Load(A::rax, A::rbx, -8);
+            a.TestRR(A::rcx, A::rcx);
+            a.Jcc(A::kEqual, TrapLabel(i, kDivisionByZero));
+            // idiv faults on INT_MIN % -1, while the remainder by -1 is always 0
+            int done = a.NewLabel();
+            a.MovRI(A::rdx, 0);
+            a.CmpRI(A::rcx, -1, false);
+            a.Jcc(A::kEqual, done);
+            a.Cdq();
+            a.IdivR(A::rcx);
+            a.Bind(done);
+            a.Store(A::rbx, -8, A::rdx);
+            a.SubRI(A::rbx, sizeof(int));
+            break;
+        }
+        case LOAD:
+        case LOADR:
+            MemoryAddress(i);
+            a.Load(A::rax, A::rax, 0);
+            PushReg(A::rax);
+            break;
+        case STORE:
+        case STORER:
+            // The value is popped even if the address traps, like the interpreters do
+            RequireDepth(1);
+            a.SubRI(A::rbx, sizeof(int));
+            a.Load(A::rdx, A::rbx, 0);
+            MemoryAddress(i);
+            a.Store(A::rax, 0, A::rdx);
+            break;
+        case JMP:
+            a.Jmp(TargetLabel(op[1]));
+            break;
+        case JE:
+        case JNE:
+            RequireDepth(2);
+            a.Load(A::rax, A::rbx, -4);
+            a.CmpRM(A::rax, A::rbx, -8);
+            // lea keeps the flags of the comparison
+            a.Lea(A::rbx, A::rbx, -8);
+            a.Jcc(op[0] == JE ? A::kEqual : A::kNotEqual, TargetLabel(op[1]));
+            break;
+        case PUSH_JE:
+        case PUSH_JNE:
+            RequireDepth(1);
+            a.SubRI(A::rbx, sizeof(int));
+            a.CmpMI(A::rbx, 0, op[1]);
+            a.Jcc(op[0] == PUSH_JE ? A::kEqual : A::kNotEqual, TargetLabel(op[2]));
+            break;
+        case PUSH_ADD:
+            RequireDepth(1);
+            a.AddMI(A::rbx, -4, op[1]);
+            break;
+        case PUSH_MUL:
+            RequireDepth(1);
+            a.ImulRMI(A::rax, A::rbx, -4, op[1]);
+            a.Store(A::rbx, -4, A::rax);
+            break;
+        case CALL: {
+            // The return stack keeps native addresses, so RET is a single indirect jump
+            a.Load(A::rcx, A::rsp, 0, true);
+            a.Load(A::rax, A::rcx, offsetof(JitState, return_top), true);
+            a.CmpRM(A::rax, A::rcx, offsetof(JitState, return_limit), true);
+            a.Jcc(A::kAboveEqual, TrapLabel(i, kCallOverflow));
+            a.LeaLabel(A::rdx, i + kCommandLength[CALL]);
+            a.Store(A::rax, 0, A::rdx, true);
+            a.AddRI(A::rax, sizeof(void*));
+            a.Store(A::rcx, offsetof(JitState, return_top), A::rax, true);
+            a.Jmp(TargetLabel(op[1]));
+            break;
+        }
+        case RET:
+            a.Load(A::rcx, A::rsp, 0, true);
+            a.Load(A::rax, A::rcx, offsetof(JitState, return_top), true);
+            a.CmpRM(A::rax, A::rcx, offsetof(JitState, return_base), true);
+            a.Jcc(A::kEqual, TrapLabel(i, kReturnWithoutCall));
+            a.SubRI(A::rax, sizeof(void*));
+            a.Store(A::rcx, offsetof(JitState, return_top), A::rax, true);
+            a.JmpM(A::rax, 0);
+            break;
+        case END:
+            // Stops like a trap does, so the result points at the END as on the interpreters
+            a.Jmp(TrapLabel(i, kNoTrap));
+            break;
+        default:
+            break;
+    }
+}
+
+#endif // PROCESSOR_HAS_JIT
+
+JitProgram::JitProgram(const int *program, int program_size, bool checked, const std::vector<bool> &proven)
+        : code(nullptr), code_size(0) {
+#if PROCESSOR_HAS_JIT
+    std::vector<uint8_t> bytes = JitCompiler(program, program_size, checked, proven).Compile();
+    void *ptr = mmap(nullptr, bytes.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        return;
+    }
+    memcpy(ptr, bytes.data(), bytes.size());
+    // Never writable and executable at the same time
+    if (mprotect(ptr, bytes.size(), PROT_READ | PROT_EXEC) != 0) {
+        munmap(ptr, bytes.size());
+        return;
+    }
+    code = ptr;
+    code_size = bytes.size();
+#else
+    (void) program;
+    (void) program_size;
+    (void) checked;
+    (void) proven;
+#endif
+}
+
+JitProgram::~JitProgram() {
+    if (code != nullptr) {
+        munmap(code, code_size);
+    }
+}
+
+Trap JitProgram::Run(JitState &state) const {
+    assert(IsCompiled() && "program is not compiled");
+    return static_cast<Trap>(reinterpret_cast<int (*)(JitState *)>(code)(&state));
+}
+
+#endif //PROCESSOR_JIT_H
@@ -0,0 +1,233 @@
+#ifndef PROCESSOR_LAYOUT_H
+#define PROCESSOR_LAYOUT_H
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "Commands.h"
+#include "Optimizer.h"
+#include "Profiler.h"
+#include "Program.h"
+
+// Profile guided order of the basic blocks. Edges between blocks are weighted with the
+// counters of a training run, and the heaviest ones become fall-throughs: blocks are joined
+// into chains greedily, the chain of the entry goes first and the others follow, hottest
+// first. A conditional jump whose likely successor is its target is inverted, a JMP to the
+// block placed after it is dropped, and a block whose successor went elsewhere gets a JMP to
+// it. On a tie the edge that saves a JMP wins, which rotates loops so that their test is at
+// the bottom. Blocks stay whole, so CALL still returns to the command after it.
+class BlockLayout {
+public:
+    BlockLayout(std::vector<int> &program, std::map<std::string, int> &marks, std::vector<int> *lines,
+                const Profile &profile)
+            : program(program), marks(marks), lines(lines), profile(profile) {}
+
+    // False if the code decodes badly or something points into a command, it stays as it is then
+    bool Run();
+
+private:
+    struct Block {
+        int start;
+        int end;
+        int last;
+    };
+
+    struct Edge {
+        int from;
+        int to;
+        uint64_t weight;
+        // The edge is a JMP, which disappears when it falls through
+        bool jump;
+    };
+
+    int Next(int i) const { return i + kCommandLength[program[i]]; }
+    bool FindBlocks();
+    std::vector<int> Order() const;
+    void Emit(const std::vector<int> &order);
+
+    std::vector<int> &program;
+    std::map<std::string, int> &marks;
+    std::vector<int> *lines;
+    const Profile &profile;
+    std::vector<Block> blocks;
+    // Block that starts at every offset, -1 inside blocks
+    std::vector<int> block_at;
+};
+
+bool BlockLayout::FindBlocks() {
+    int size = program.size();
+    std::vector<bool> boundary(size + 1, false);
+    for (int i = 0; i < size; i = Next(i)) {
+        if (!IsCommand(program[i]) || i + kCommandLength[program[i]] > size) {
+            return false;
+        }
+        boundary[i] = true;
+    }
+    boundary[size] = true;
+
+    std::vector<bool> leader(size + 1, false);
+    leader[0] = true;
+    for (int i = 0; i < size; i = Next(i)) {
+        int operand = JumpOperand(program[i]);
+        if (operand != 0) {
+            int target = program[i + operand];
+            if (target < 0 || target > size || !boundary[target]) {
+                return false;
+            }
+            leader[target] = true;
+        }
+        if ((operand != 0 && program[i] != CALL) || program[i] == RET || program[i] == END) {
+            leader[Next(i)] = true;
+        }
+    }
+    for (auto &mark : marks) {
+        if (mark.second >= 0 && mark.second <= size) {
+            if (!boundary[mark.second]) {
+                return false;
+            }
+            leader[mark.second] = true;
+        }
+    }
+
+    blocks.clear();
+    block_at.assign(size + 1, -1);
+    for (int i = 0; i < size; i = Next(i)) {
+        if (leader[i]) {
+            block_at[i] = blocks.size();
+            blocks.push_back({i, size, i});
+        }
+        blocks.back().last = i;
+        blocks.back().end = Next(i);
+    }
+    return !blocks.empty();
+}
+
+std::vector<int> BlockLayout::Order() const {
+    int size = program.size();
+    std::vector<Edge> edges;
+    for (size_t b = 0; b < blocks.size(); b++) {
+        const Block &block = blocks[b];
+        int cmd = program[block.last];
+        int next = block.end < size ? block_at[block.end] : -1;
+        if (IsConditionalJump(cmd)) {
+            int target = program[block.last + JumpOperand(cmd)];
+            if (next >= 0) {
+                edges.push_back({static_cast<int>(b), next, profile.NotTaken(block.last), false});
+            }
+            if (target < size) {
+                edges.push_back({static_cast<int>(b), block_at[target], profile.Taken(block.last), false});
+            }
+        } else if (cmd == JMP) {
+            if (program[block.last + 1] < size) {
+                edges.push_back({static_cast<int>(b), block_at[program[block.last + 1]], profile.Count(block.last),
+                                 true});
+            }
+        } else if (cmd != RET && cmd != END && next >= 0) {
+            // The return site of a CALL has to stay right after it
+            edges.push_back({static_cast<int>(b), next, cmd == CALL ? UINT64_MAX : profile.Count(block.last),
+                             false});
+        }
+    }
+    std::stable_sort(edges.begin(), edges.end(), [](const Edge &lhs, const Edge &rhs) {
+        return lhs.weight != rhs.weight ? lhs.weight > rhs.weight : lhs.jump && !rhs.jump;
+    });
+
+    // Chains are lists of blocks linked by successor, every block starts out as a chain of its own
+    int count = blocks.size();
+    std::vector<int> succ(count, -1), pred(count, -1), head(count);
+    for (int b = 0; b < count; b++) {
+        head[b] = b;
+    }
+    for (const Edge &edge : edges) {
+        // Nothing goes in front of the entry
+        if (succ[edge.from] >= 0 || pred[edge.to] >= 0 || edge.to == 0 || head[edge.from] == edge.to) {
+            continue;
+        }
+        succ[edge.from] = edge.to;
+        pred[edge.to] = edge.from;
+        for (int b = edge.to; b >= 0; b = succ[b]) {
+            head[b] = head[edge.from];
+        }
+    }
+
+    std::vector<int> heads;
+    for (int b = 1; b < count; b++) {
+        if (pred[b] < 0) {
+            heads.push_back(b);
+        }
+    }
+    std::stable_sort(heads.begin(), heads.end(), [this](int lhs, int rhs) {
+        return profile.Count(blocks[lhs].start) > profile.Count(blocks[rhs].start);
+    });
+    heads.insert(heads.begin(), 0);
+    std::vector<int> order;
+    for (int first : heads) {
+        for (int b = first; b >= 0; b = succ[b]) {
+            order.push_back(b);
+        }
+    }
+    return order;
+}
+
+void BlockLayout::Emit(const std::vector<int> &order) {
+    int size = program.size();
+    std::vector<int> code;
+    code.reserve(program.size() + order.size() * kCommandLength[JMP]);
+    std::vector<int> new_offset(size + 1, 0);
+    for (size_t k = 0; k < order.size(); k++) {
+        const Block &block = blocks[order[k]];
+        // Offset the code reaches by falling through, the end of the code after the last block
+        int follower = k + 1 < order.size() ? blocks[order[k + 1]].start : size;
+        for (int i = block.start; i < block.last; i = Next(i)) {
+            new_offset[i] = code.size();
+            code.insert(code.end(), program.begin() + i, program.begin() + Next(i));
+        }
+        int cmd = program[block.last];
+        new_offset[block.last] = code.size();
+        if (cmd == JMP && program[block.last + 1] == follower) {
+            continue;
+        }
+        code.insert(code.end(), program.begin() + block.last, program.begin() + block.end);
+        if (IsConditionalJump(cmd)) {
+            int operand = block.last + JumpOperand(cmd);
+            int at = code.size() - kCommandLength[cmd];
+            if (block.end != follower && program[operand] == follower) {
+                code[at] = cmd == JE ? JNE : cmd == JNE ? JE : cmd == PUSH_JE ? PUSH_JNE : PUSH_JE;
+                code[at + JumpOperand(cmd)] = block.end;
+                continue;
+            }
+        } else if (cmd == JMP || cmd == RET || cmd == END) {
+            continue;
+        }
+        if (block.end != follower) {
+            code.push_back(JMP);
+            code.push_back(block.end);
+        }
+    }
+    new_offset[size] = code.size();
+    Relocate(code, new_offset, size, marks, lines);
+    program.swap(code);
+}
+
+bool BlockLayout::Run() {
+    if (!FindBlocks()) {
+        return false;
+    }
+    Emit(Order());
+    return true;
+}
+
+// Copy of program with the blocks laid out for the runs profile has seen
+std::shared_ptr<const Program> LayOut(const Program &program, const Profile &profile) {
+    std::vector<int> code(program.Code(), program.Code() + program.Size());
+    std::map<std::string, int> marks = program.Marks();
+    std::vector<int> lines = program.Lines();
+    BlockLayout layout(code, marks, &lines, profile);
+    layout.Run();
+    return std::make_shared<Program>(std::move(code), std::move(marks), std::move(lines));
+}
+
+#endif //PROCESSOR_LAYOUT_H
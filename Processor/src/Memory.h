@@ -0,0 +1,113 @@
+#ifndef PROCESSOR_MEMORY_H
+#define PROCESSOR_MEMORY_H
+
+#include <algorithm>
+#include <cstddef>
+#include <string>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "Commands.h"
+
+// Words of memory a run gets unless it is told otherwise
+#define DEFAULT_MEMORY_SIZE (1 << 16)
+
+// Data memory of a run, addressed by word. Either owned and zero filled, or a file mapped
+// in place, so a large dataset is read by LOAD instead of going through IN.
+class Memory {
+public:
+    Memory() : words(nullptr), size(0), length(0) {}
+    explicit Memory(int size);
+    ~Memory();
+    Memory(const Memory &other) = delete;
+    Memory &operator=(const Memory &other) = delete;
+    Memory(Memory &&other) noexcept;
+    Memory &operator=(Memory &&other) noexcept;
+
+    // Every whole word of the file becomes a word of memory. Shared mappings write the stores
+    // through to the file, private ones keep them to this memory.
+    bool Map(const std::string &path, bool shared = true);
+    void Unmap();
+    bool IsMapped() const { return length != 0; }
+
+    int *Data() const { return words; }
+    int Size() const { return size; }
+    bool Contains(int address) const { return static_cast<unsigned>(address) < static_cast<unsigned>(size); }
+
+private:
+    std::vector<int> owned;
+    int *words;
+    int size;
+    // Length of the mapping, 0 for owned memory
+    size_t length;
+};
+
+Memory::Memory(int size) : owned(std::min(std::max(size, 0), MEMORY_MAX_SIZE)), length(0) {
+    words = owned.data();
+    this->size = owned.size();
+}
+
+Memory::~Memory() {
+    Unmap();
+}
+
+Memory::Memory(Memory &&other) noexcept
+        : owned(std::move(other.owned)), words(other.words), size(other.size), length(other.length) {
+    other.words = nullptr;
+    other.size = 0;
+    other.length = 0;
+}
+
+Memory &Memory::operator=(Memory &&other) noexcept {
+    if (this != &other) {
+        Unmap();
+        owned = std::move(other.owned);
+        words = other.words;
+        size = other.size;
+        length = other.length;
+        other.words = nullptr;
+        other.size = 0;
+        other.length = 0;
+    }
+    return *this;
+}
+
+bool Memory::Map(const std::string &path, bool shared) {
+    Unmap();
+    owned.clear();
+    words = nullptr;
+    size = 0;
+    int fd = open(path.c_str(), shared ? O_RDWR : O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(int)) ||
+        st.st_size / sizeof(int) > static_cast<size_t>(MEMORY_MAX_SIZE)) {
+        close(fd);
+        return false;
+    }
+    void *ptr = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, shared ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        return false;
+    }
+    words = static_cast<int *>(ptr);
+    size = st.st_size / sizeof(int);
+    length = st.st_size;
+    return true;
+}
+
+void Memory::Unmap() {
+    if (length != 0) {
+        munmap(words, length);
+        words = nullptr;
+        size = 0;
+        length = 0;
+    }
+}
+
+#endif //PROCESSOR_MEMORY_H
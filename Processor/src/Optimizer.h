@@ -0,0 +1,284 @@
+#ifndef PROCESSOR_OPTIMIZER_H
+#define PROCESSOR_OPTIMIZER_H
+
+#include <algorithm>
+#include <climits>
+#include <map>
+#include <string>
+#include <vector>
+#include "Commands.h"
+#include "Verifier.h"
+
+// Moves jump targets, marks and source lines to the offsets the rewritten code gives them
+void Relocate(std::vector<int> &code, const std::vector<int> &new_offset, int old_size,
+              std::map<std::string, int> &marks, std::vector<int> *lines) {
+    for (size_t j = 0; j < code.size(); j += kCommandLength[code[j]]) {
+        int operand = JumpOperand(code[j]);
+        if (operand != 0 && code[j + operand] >= 0 && code[j + operand] <= old_size) {
+            code[j + operand] = new_offset[code[j + operand]];
+        }
+    }
+    for (auto &mark : marks) {
+        if (mark.second >= 0 && mark.second <= old_size) {
+            mark.second = new_offset[mark.second];
+        }
+    }
+    if (lines != nullptr) {
+        for (int &line : *lines) {
+            if (line >= 0 && line <= old_size) {
+                line = new_offset[line];
+            }
+        }
+    }
+}
+
+// Replaces calls of small subroutines with a copy of their body, and turns calls right
+// before RET into jumps, so neither of them touches the return stack. A small subroutine
+// is straight code up to its RET, which also makes it a leaf.
+class CallOptimizer {
+public:
+    CallOptimizer(std::vector<int> &program, std::map<std::string, int> &marks, std::vector<int> *lines = nullptr)
+            : program(program), marks(marks), lines(lines) {}
+
+    void Run();
+
+private:
+    // Longest body worth a copy at every call site, in code words
+    static const int kMaxInlineSize = 16;
+
+    int Next(int i) const { return i + kCommandLength[program[i]]; }
+    // Length of the body without marks and RET, -1 if the subroutine is not small
+    int InlineSize(int target) const;
+
+    std::vector<int> &program;
+    std::map<std::string, int> &marks;
+    std::vector<int> *lines;
+    std::vector<bool> boundary;
+};
+
+int CallOptimizer::InlineSize(int target) const {
+    int size = program.size();
+    if (target < 0 || target >= size || !boundary[target]) {
+        return -1;
+    }
+    int length = 0;
+    for (int i = target; i < size && length <= kMaxInlineSize; i = Next(i)) {
+        int cmd = program[i];
+        if (cmd == RET) {
+            return length;
+        }
+        if (JumpOperand(cmd) != 0 || cmd == END) {
+            return -1;
+        }
+        if (cmd != HLT) {
+            length += kCommandLength[cmd];
+        }
+    }
+    return -1;
+}
+
+void CallOptimizer::Run() {
+    int size = program.size();
+    boundary.assign(size + 1, false);
+    for (int i = 0; i < size; i = Next(i)) {
+        boundary[i] = true;
+    }
+    std::vector<int> code;
+    code.reserve(program.capacity());
+    std::vector<int> new_offset(size + 1, 0);
+    for (int i = 0; i < size; i = Next(i)) {
+        new_offset[i] = code.size();
+        int next = Next(i);
+        if (program[i] == CALL && InlineSize(program[i + 1]) >= 0) {
+            for (int j = program[i + 1]; program[j] != RET; j = Next(j)) {
+                if (program[j] != HLT) {
+                    code.insert(code.end(), program.begin() + j, program.begin() + Next(j));
+                }
+            }
+            continue;
+        }
+        int after = next;
+        while (after < size && program[after] == HLT) {
+            after = Next(after);
+        }
+        if (program[i] == CALL && after < size && program[after] == RET) {
+            code.push_back(JMP);
+            code.push_back(program[i + 1]);
+            continue;
+        }
+        code.insert(code.end(), program.begin() + i, program.begin() + next);
+    }
+    new_offset[size] = code.size();
+    Relocate(code, new_offset, size, marks, lines);
+    program.swap(code);
+}
+
+// Peephole pass over the parsed program. It folds constant arithmetic, fuses frequent
+// sequences into superinstructions and drops no-op commands, then fixes up every jump
+// and mark. Commands that are jump targets are never absorbed into the middle of a group.
+// Offsets of source lines, if given, follow the code too, without pinning anything.
+// Pairs that cancel out are dropped only where the stack verifier has proven the depth and
+// the registers are valid, so that a program traps the same with and without the pass.
+class PeepholeOptimizer {
+public:
+    PeepholeOptimizer(int *program, int program_size, std::map<std::string, int> &marks,
+                      std::vector<int> *lines = nullptr)
+            : program(program), program_size(program_size), marks(marks), lines(lines) {}
+
+    // Returns new program size, the code is rewritten in place
+    int Run();
+
+private:
+    static const int kMaxPasses = 8;
+
+    bool Pass();
+    int Next(int i) const { return i + kCommandLength[program[i]]; }
+    bool Is(int i, int cmd) const { return i < program_size && program[i] == cmd && !target[i]; }
+    // True if every run reaches offset i with at least needs elements on the stack
+    bool Proven(int i, int needs) const { return !depths.empty() && depths[i] >= needs; }
+    bool Fold(int cmd, int lhs, int rhs, int &result) const;
+    void Skip(int from, int to);
+
+    int *program;
+    int program_size;
+    std::map<std::string, int> &marks;
+    std::vector<int> *lines;
+    std::vector<bool> target;
+    std::vector<int> depths;
+    std::vector<int> new_offset;
+    std::vector<int> code;
+};
+
+int PeepholeOptimizer::Run() {
+    for (int pass = 0; pass < kMaxPasses && Pass(); pass++) {}
+    return program_size;
+}
+
+bool PeepholeOptimizer::Fold(int cmd, int lhs, int rhs, int &result) const {
+    // Unsigned arithmetic gives the same wrap around as the hardware without UB at compile time
+    switch (cmd) {
+        case ADD:
+            result = static_cast<int>(static_cast<unsigned>(lhs) + static_cast<unsigned>(rhs));
+            return true;
+        case MUL:
+            result = static_cast<int>(static_cast<unsigned>(lhs) * static_cast<unsigned>(rhs));
+            return true;
+        case MOD:
+            // Leave failing division for the run time
+            if (rhs == 0 || (lhs == INT_MIN && rhs == -1)) {
+                return false;
+            }
+            result = lhs % rhs;
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Commands swallowed by a group keep an offset too, nothing may jump there anyway
+void PeepholeOptimizer::Skip(int from, int to) {
+    for (int i = from; i < to; i = Next(i)) {
+        new_offset[i] = code.size();
+    }
+}
+
+bool PeepholeOptimizer::Pass() {
+    target.assign(program_size + 1, false);
+    for (int i = 0; i < program_size; i = Next(i)) {
+        int operand = JumpOperand(program[i]);
+        if (operand != 0 && program[i + operand] >= 0 && program[i + operand] <= program_size) {
+            target[program[i + operand]] = true;
+        }
+        // RET comes back right after the call
+        if (program[i] == CALL) {
+            target[Next(i)] = true;
+        }
+    }
+    for (auto &mark : marks) {
+        if (mark.second >= 0 && mark.second <= program_size) {
+            target[mark.second] = true;
+        }
+    }
+    StackVerifier verifier(program, program_size);
+    depths.clear();
+    if (verifier.Verify()) {
+        depths = verifier.Depths();
+    }
+    new_offset.assign(program_size + 1, 0);
+    code.clear();
+
+    int i = 0;
+    while (i < program_size) {
+        new_offset[i] = code.size();
+        int cmd = program[i];
+        int next = Next(i);
+        int after = next < program_size ? Next(next) : next;
+        int folded;
+
+        if (cmd == HLT || (cmd == MOV && program[i + 1] == program[i + 2] && IsRegister(program[i + 1])) ||
+            (cmd == JMP && program[i + 1] == next)) {
+            // Mark placeholders, self moves and jumps to the next command do nothing
+            i = next;
+            continue;
+        }
+        if ((cmd == SWP && Is(next, SWP) && Proven(i, 2)) || (cmd == PUSH && Is(next, POP) && Proven(i, 0)) ||
+            (cmd == PUSHR && Is(next, POPR) && program[next + 1] == program[i + 1] && IsRegister(program[i + 1]) &&
+             Proven(i, 0))) {
+            Skip(next, after);
+            i = after;
+            continue;
+        }
+        if (cmd == PUSH && Is(next, PUSH) && after < program_size && !target[after] &&
+            Fold(program[after], program[i + 1], program[next + 1], folded)) {
+            Skip(next, Next(after));
+            code.push_back(PUSH);
+            code.push_back(folded);
+            i = Next(after);
+            continue;
+        }
+        if (cmd == PUSH && (Is(next, PUSH_ADD) || Is(next, PUSH_MUL))) {
+            Fold(program[next] == PUSH_ADD ? ADD : MUL, program[i + 1], program[next + 1], folded);
+            Skip(next, after);
+            code.push_back(PUSH);
+            code.push_back(folded);
+            i = after;
+            continue;
+        }
+        if (cmd == PUSH && (Is(next, JE) || Is(next, JNE) || Is(next, ADD) || Is(next, MUL))) {
+            static const std::map<int, int> kFused = {
+                    {JE, PUSH_JE}, {JNE, PUSH_JNE}, {ADD, PUSH_ADD}, {MUL, PUSH_MUL}
+            };
+            Skip(next, after);
+            code.push_back(kFused.at(program[next]));
+            code.push_back(program[i + 1]);
+            if (JumpOperand(program[next]) != 0) {
+                code.push_back(program[next + 1]);
+            }
+            i = after;
+            continue;
+        }
+        if (cmd == DUP && program[i + 1] >= 1 && Is(next, POP)) {
+            Skip(next, after);
+            code.push_back(DUP_POP);
+            code.push_back(program[i + 1]);
+            i = after;
+            continue;
+        }
+        if (cmd == POP && Is(next, SWP)) {
+            Skip(next, after);
+            code.push_back(POP_SWP);
+            i = after;
+            continue;
+        }
+        code.insert(code.end(), program + i, program + next);
+        i = next;
+    }
+    new_offset[program_size] = code.size();
+    Relocate(code, new_offset, program_size, marks, lines);
+    bool changed = static_cast<int>(code.size()) != program_size;
+    std::copy(code.begin(), code.end(), program);
+    program_size = code.size();
+    return changed;
+}
+
+#endif //PROCESSOR_OPTIMIZER_H
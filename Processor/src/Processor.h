@@ -1,253 +1,1859 @@
 #ifndef PROCESSOR_PROCESSOR_H
 #define PROCESSOR_PROCESSOR_H
 
-#include <map>
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <memory>
+#include <thread>
+#include <vector>
 #include "../../ProtectedStack/src/stack.h"
+#include "Commands.h"
+#include "FlatStack.h"
+#include "Image.h"
+#include "Io.h"
+#include "Jit.h"
+#include "Layout.h"
+#include "Memory.h"
+#include "Profiler.h"
+#include "Program.h"
+#include "Scheduler.h"
+#include "Simt.h"
+#include "Snapshot.h"
+#include "Trap.h"
 
-#define REGISTERS_SIZE 4
+#if defined(__GNUC__)
+#define PROCESSOR_HAS_COMPUTED_GOTO 1
+#else
+#define PROCESSOR_HAS_COMPUTED_GOTO 0
+#endif
 
-enum Command {
-    PUSH, PUSHR, POP, POPR, DUP, SWP, MOV, MOVD, IN, OUT, MUL, ADD, MOD, JMP, JE, JNE, END, HLT
+// Switch engine is the portable one, threaded engine needs GCC labels-as-values,
+// JIT engine needs x86-64 and falls back to the interpreter elsewhere. IR engine runs
+// the register form of proven programs and interprets the others. Compact engine runs the
+// byte encoding of the program and needs labels-as-values too. Cached engine is the threaded
+// one with the top of the stack kept in locals.
+enum Engine {
+    kSwitchEngine, kThreadedEngine, kJitEngine, kIrEngine, kCompactEngine, kCachedEngine
 };
 
-enum Register {
-    RAX, RBX, RCX, RDX
-};
+#define JIT_STACK_SIZE (1 << 20)
+// Taken jumps between two safepoints of a checkpointed run
+#define SAFEPOINT_JUMPS (1 << 16)
 
-std::map<std::string, Command> kStringToCommands {
-        {"push", PUSH},
-        {"pop", POP},
-        {"dup", DUP},
-        {"swp", SWP},
-        {"mov", MOV},
-        {"in", IN},
-        {"out", OUT},
-        {"mul", MUL},
-        {"add", ADD},
-        {"mod", MOD},
-        {"jmp", JMP},
-        {"je", JE},
-        {"jne", JNE},
-        {"end", END},
-        {"hlt", HLT}
-};
+// Gas of runs that are not metered
+const uint64_t kUnlimitedGas = UINT64_MAX;
+
+const Engine kDefaultEngine = PROCESSOR_HAS_COMPUTED_GOTO ? kThreadedEngine : kSwitchEngine;
+
+// Registers, operand stack and memory, everything a run changes. Processor keeps one for its
+// own runs, batch runs get a fresh context per input. Memory is attached by the first run of
+// a program that uses it.
+struct ExecutionContext {
+    ExecutionContext() : registers() {}
 
-std::map<std::string, Register > kStringToRegisters {
-        {"RAX", RAX},
-        {"RBX", RBX},
-        {"RCX", RCX},
-        {"RDX", RDX}
+    int registers[REGISTERS_SIZE];
+    Stack<int> stack;
+    Memory memory;
+    // Where the next run starts, and the calls it is inside of. Only a restored snapshot of a
+    // run in progress sets them, every run leaves them at the start.
+    int pc = 0;
+    std::vector<int> returns;
+    // Gas left for the runs, see Processor::SetGas
+    uint64_t gas = kUnlimitedGas;
+    // Flat stack, native stack or IR values of a run, kept so that the next run reuses them
+    std::vector<int> scratch;
 };
 
 class Processor {
 public:
-    Processor(std::istream &input, int size);
-    ~Processor();
-    void Run(std::istream *in, std::ostream &out);
+    Processor(std::istream &input, int size, Engine engine = kDefaultEngine, bool optimize = true);
+    explicit Processor(Image image, Engine engine = kDefaultEngine);
+    explicit Processor(std::shared_ptr<const Program> program, Engine engine = kDefaultEngine);
+    RunResult Run(std::istream *in, std::ostream &out);
+    RunResult Run(ExecutionContext &context, std::istream *in, std::ostream &out) const;
+    // Same as Run without streams: IN takes the input values in turn, OUT appends to output.
+    // A context that has run before runs again without allocations, so does output once it
+    // has the capacity.
+    RunResult Run(const int *input, size_t input_size, std::vector<int> &output);
+    RunResult Run(ExecutionContext &context, const int *input, size_t input_size, std::vector<int> &output) const;
+    // Same with the ports of the host, read gives IN its values and write takes every OUT value
+    RunResult Run(ReadPort read, WritePort write, void *host);
+    RunResult Run(ExecutionContext &context, ReadPort read, WritePort write, void *host) const;
+    // Same as Run, with the counters and timings collected into profile. A JIT processor
+    // runs on the threaded engine then, native code has no hooks.
+    RunResult Run(std::istream *in, std::ostream &out, Profile &profile);
+    // Same as Run, the interpreter stops at a safepoint every SAFEPOINT_JUMPS taken jumps and
+    // hands a snapshot to the checkpointer whenever it is due. Checkpointed runs are interpreted.
+    RunResult Run(std::istream *in, std::ostream &out, Checkpointer &checkpointer);
+    // State of the own context between runs, the next run starts from it
+    Snapshot TakeSnapshot();
+    // Makes a snapshot of this program the state of the own context, a snapshot taken at a
+    // safepoint continues its run on the next Run. Input is not part of a snapshot, the run
+    // reads on from whatever input it gets. False if the snapshot does not fit the program.
+    bool Restore(const Snapshot &snapshot);
+    // Runs the program once for every input, outputs[k] receives the output of inputs[k].
+    // Inputs are spread over threads (all cores if 0), each of them starts from a clean context.
+    std::vector<RunResult> RunBatch(const std::vector<std::istream*> &inputs,
+                                    const std::vector<std::ostream*> &outputs, int threads = 0) const;
+    // Runs the inputs in groups of 8 or 16 lanes that share every step, see SimtEngine.
+    // Programs without a stack proof fall back to RunBatch on one thread.
+    std::vector<RunResult> RunLanes(const std::vector<std::istream*> &inputs,
+                                    const std::vector<std::ostream*> &outputs, int lanes = 8) const;
+    // Meters the own runs: every command costs a unit of gas, paid for its whole block when a
+    // run enters the block. A run that cannot pay for the next block stops with kOutOfGas in
+    // front of it, and the next run goes on from there, with whatever gas is set by then. Gas
+    // left over carries on to the next runs. Metered runs are interpreted, kUnlimitedGas stops metering.
+    void SetGas(uint64_t gas) { context.gas = gas; }
+    uint64_t Gas() const { return context.gas; }
+    // Interactive runs write every OUT value through at once instead of buffering the output
+    void SetInteractive(bool value) { interactive = value; }
+    // Words of zero filled memory for the runs, the own context drops the memory it has
+    void SetMemorySize(int size);
+    // Memory of the own runs becomes the file, stores go to the file. Batch runs and lanes
+    // get private copies of it.
+    bool MapMemory(const std::string &path);
+    bool SaveImage(const std::string &path, uint64_t source_hash) const { return program->SaveImage(path, source_hash); }
+    int Size() const { return program->Size(); }
+    bool IsVerified() const { return program->IsVerified(); }
+    const std::shared_ptr<const Program> &GetProgram() const { return program; }
 private:
-    void Parse(std::istream &input);
-    void Duplicate(int num);
-    void GetMarks(std::istream& input);
+    template <typename ProfilerT>
+    RunResult Execute(ExecutionContext &context, InputBuffer &in, OutputBuffer &out, ProfilerT &profiler,
+                      Checkpointer *checkpointer = nullptr) const;
+    void AttachMemory(ExecutionContext &context) const;
+    // Moves the protected stack of the context into values, bottom first
+    static void TakeStack(ExecutionContext &context, std::vector<int> &values);
+    static void RestoreStack(ExecutionContext &context, const int *begin, const int *end);
+    static std::vector<int> CopyStack(Stack<int> &operands);
+    static std::vector<int> CopyStack(FlatStack<int> &operands);
+    template <typename StackT>
+    Snapshot Capture(const ExecutionContext &context, StackT &operands) const;
+    template <typename StackT, typename ProfilerT>
+    RunResult Interpret(ExecutionContext &context, StackT &operands, InputBuffer &in, OutputBuffer &out,
+                        ProfilerT &profiler, Checkpointer *checkpointer) const;
+    // Engines start at context.pc inside context.returns. They stop with kSafepoint after every
+    // safepoint taken jumps (0 stands for UINT_MAX), and with kOutOfGas in front of a block
+    // context.gas does not cover, leaving pc and returns in the context.
+    template <typename StackT, typename ProfilerT>
+    RunResult RunSwitch(ExecutionContext &context, StackT &operands, InputBuffer &in, OutputBuffer &out,
+                        ProfilerT &profiler, unsigned safepoint) const;
+    template <typename StackT, typename ProfilerT>
+    RunResult RunThreaded(ExecutionContext &context, StackT &operands, InputBuffer &in, OutputBuffer &out,
+                          ProfilerT &profiler, unsigned safepoint) const;
+    // Runs from the start, without safepoints and profiler
+    template <typename StackT>
+    RunResult RunCompact(const CompactProgram &compact, ExecutionContext &context, StackT &operands,
+                         InputBuffer &in, OutputBuffer &out) const;
+    // Runs from the start, without safepoints and profiler
+    template <typename StackT>
+    RunResult RunCached(ExecutionContext &context, StackT &operands, InputBuffer &in, OutputBuffer &out) const;
+    RunResult RunJit(const JitProgram &jit, ExecutionContext &context, InputBuffer &in, OutputBuffer &out) const;
+    RunResult RunIr(const IrProgram &ir, ExecutionContext &context, InputBuffer &in, OutputBuffer &out) const;
+    template <int kLanes>
+    void RunLanes(const std::vector<std::istream*> &inputs, const std::vector<std::ostream*> &outputs,
+                  std::vector<RunResult> &results) const;
+    template <typename StackT>
+    static Trap Duplicate(StackT &operands, int num, bool drop_top = false);
+    // Pays for the block a run enters at offset i, false if the gas does not cover it.
+    // Runs that are not metered have no costs.
+    static bool Pay(const int *gas_cost, uint64_t &gas, int i);
+    static RunResult OutOfGas(ExecutionContext &context, int i, const int *returns, int return_depth);
 
-    Stack<int> stack;
-    int* program;
-    std::map<std::string, int> marks;
-    int registers[REGISTERS_SIZE];
-    int max_program_size;
-    int program_size;
+    std::shared_ptr<const Program> program;
+    ExecutionContext context;
+    Engine engine;
+    bool interactive = false;
+    int memory_size = DEFAULT_MEMORY_SIZE;
+    std::string memory_path;
 };
 
+Processor::Processor(std::istream &input, int size, Engine engine, bool optimize)
+        : program(std::make_shared<Program>(input, size, optimize)), engine(engine) {}
 
-Processor::Processor(std::istream &input, int size) {
-    max_program_size = size;
-    program = new int[max_program_size];
-    Parse(input);
-}
-
-void Processor::Parse(std::istream &input) {
-    GetMarks(input);
-    input.clear();
-    input.seekg(0, input.beg);
-    std::string temp;
-    Command cmd;
-    int j = 0;
-    while (getline(input, temp, '\n')) {
-        size_t offset = temp.find(' ');
-        std::string cmd_str = temp.substr(0, offset);
-        std::string value_str = offset != std::string::npos ? temp.substr(offset + 1) : "";
-        if (kStringToCommands.find(cmd_str) != kStringToCommands.end()) {
-            cmd = kStringToCommands[cmd_str];
-            if (cmd == PUSH || cmd == JMP || cmd == JE || cmd == JNE || cmd == DUP || cmd == MOV) {
-                assert(!value_str.empty() && "expected: operand");
-            } else if (cmd != POP) {
-                assert(value_str.empty() && "unexpected operand");
-            }
-            program[j++] = cmd;
-            if (cmd == PUSH || cmd == DUP) {
-                if (cmd == PUSH && kStringToRegisters.find(value_str) != kStringToRegisters.end()) {
-                    Register r = kStringToRegisters[value_str];
-                    program[j - 1] = PUSHR;
-                    program[j++] = r;
-                } else {
-                    program[j++] = std::stoi(value_str);
-                }
-            } else if (cmd == JMP || cmd == JE || cmd == JNE) {
-                program[j++] = marks[value_str];
-            } else if (cmd == MOV) {
-                size_t offset1 = temp.find(' ', offset + 1);
-                assert(offset != std::string::npos && "expected: operand");
-                std::string value_str1 = temp.substr(offset + 1, offset1 - offset - 1);
-                std::string value_str2 = temp.substr(offset1 + 1);
-                assert(kStringToRegisters.find(value_str1) != kStringToRegisters.end());
-                Register r1 = kStringToRegisters[value_str1];
-                program[j++] = r1;
-                if (kStringToRegisters.find(value_str2) != kStringToRegisters.end()) {
-                    Register r2 = kStringToRegisters[value_str2];
-                    program[j++] = r2;
-                } else {
-                    program[j - 2] = MOVD;
-                    program[j++] = std::stoi(value_str2);
-                }
-            } else if (cmd == POP && !value_str.empty()) {
-                program[j - 1] = POPR;
-                assert(kStringToRegisters.find(value_str) != kStringToRegisters.end());
-                Register r = kStringToRegisters[value_str];
-                program[j++] = r;
+Processor::Processor(Image image, Engine engine)
+        : program(std::make_shared<Program>(std::move(image))), engine(engine) {}
+
+Processor::Processor(std::shared_ptr<const Program> program, Engine engine)
+        : program(std::move(program)), engine(engine) {}
+
+void Processor::SetMemorySize(int size) {
+    memory_size = size;
+    memory_path.clear();
+    context.memory = Memory();
+}
+
+bool Processor::MapMemory(const std::string &path) {
+    if (!context.memory.Map(path)) {
+        return false;
+    }
+    memory_path = path;
+    return true;
+}
+
+void Processor::AttachMemory(ExecutionContext &context) const {
+    if (!program->UsesMemory() || context.memory.Size() != 0) {
+        return;
+    }
+    if (memory_path.empty() || !context.memory.Map(memory_path, false)) {
+        context.memory = Memory(memory_size);
+    }
+}
+
+// Output is written out when the run stops, whether on END, at the end of the code or on a trap
+RunResult Processor::Run(std::istream *in, std::ostream &out) {
+    return Run(context, in, out);
+}
+
+RunResult Processor::Run(ExecutionContext &context, std::istream *in, std::ostream &out) const {
+    InputBuffer input(in);
+    OutputBuffer output(out, interactive);
+    NoProfile profiler;
+    RunResult result = Execute(context, input, output, profiler);
+    output.Flush();
+    return result;
+}
+
+RunResult Processor::Run(const int *input, size_t input_size, std::vector<int> &output) {
+    return Run(context, input, input_size, output);
+}
+
+RunResult Processor::Run(ExecutionContext &context, const int *input, size_t input_size,
+                         std::vector<int> &output) const {
+    InputBuffer in(input, input_size);
+    OutputBuffer out(output);
+    NoProfile profiler;
+    return Execute(context, in, out, profiler);
+}
+
+RunResult Processor::Run(ReadPort read, WritePort write, void *host) {
+    return Run(context, read, write, host);
+}
+
+RunResult Processor::Run(ExecutionContext &context, ReadPort read, WritePort write, void *host) const {
+    InputBuffer in(read, host);
+    OutputBuffer out(write, host);
+    NoProfile profiler;
+    return Execute(context, in, out, profiler);
+}
+
+RunResult Processor::Run(std::istream *in, std::ostream &out, Profile &profile) {
+    InputBuffer input(in);
+    OutputBuffer output(out, interactive);
+    RunResult result = Execute(context, input, output, profile);
+    profile.Finish();
+    output.Flush();
+    return result;
+}
+
+RunResult Processor::Run(std::istream *in, std::ostream &out, Checkpointer &checkpointer) {
+    InputBuffer input(in);
+    OutputBuffer output(out, interactive);
+    NoProfile profiler;
+    RunResult result = Execute(context, input, output, profiler, &checkpointer);
+    output.Flush();
+    return result;
+}
+
+Snapshot Processor::TakeSnapshot() {
+    return Capture(context, context.stack);
+}
+
+bool Processor::Restore(const Snapshot &snapshot) {
+    int size = program->Size();
+    if (snapshot.program_hash != program->Hash() || snapshot.pc < 0 || snapshot.pc > size ||
+        !program->IsBoundary(snapshot.pc) || snapshot.returns.size() > RETURN_STACK_SIZE) {
+        return false;
+    }
+    // Returns lead back behind a call, so a resumed run never lands inside a command
+    for (int address : snapshot.returns) {
+        int call = address - kCommandLength[CALL];
+        if (call < 0 || address > size || !program->IsBoundary(call) || program->Code()[call] != CALL) {
+            return false;
+        }
+    }
+    // The flat stack of a proven program has no checks, the proof has to hold from pc on
+    if (IsVerified()) {
+        int depth = program->Depths()[snapshot.pc];
+        if (depth < 0 || snapshot.stack.size() < static_cast<size_t>(depth)) {
+            return false;
+        }
+        for (int address : snapshot.returns) {
+            if (program->Depths()[address] < 0) {
+                return false;
             }
+        }
+    }
+    std::copy(snapshot.registers, snapshot.registers + REGISTERS_SIZE, context.registers);
+    TakeStack(context, context.scratch);
+    RestoreStack(context, snapshot.stack.data(), snapshot.stack.data() + snapshot.stack.size());
+    context.pc = snapshot.pc;
+    context.returns = snapshot.returns;
+    if (!snapshot.memory.empty()) {
+        memory_path.clear();
+        memory_size = snapshot.memory.size();
+        context.memory = Memory(memory_size);
+        std::copy(snapshot.memory.begin(), snapshot.memory.end(), context.memory.Data());
+    }
+    return true;
+}
+
+std::vector<RunResult> Processor::RunBatch(const std::vector<std::istream*> &inputs,
+                                           const std::vector<std::ostream*> &outputs, int threads) const {
+    assert(inputs.size() == outputs.size() && "every input needs an output");
+    if (threads <= 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = std::min<size_t>(threads, inputs.size());
+    std::vector<RunResult> results(inputs.size());
+    // Workers take the next input until none is left, so long runs don't hold up a whole share
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t k = next++; k < inputs.size(); k = next++) {
+            ExecutionContext context;
+            results[k] = Run(context, inputs[k], *outputs[k]);
+        }
+    };
+    std::vector<std::thread> pool;
+    for (int t = 1; t < threads; t++) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (std::thread &thread : pool) {
+        thread.join();
+    }
+    return results;
+}
+
+std::vector<RunResult> Processor::RunLanes(const std::vector<std::istream*> &inputs,
+                                           const std::vector<std::ostream*> &outputs, int lanes) const {
+    assert(inputs.size() == outputs.size() && "every input needs an output");
+    assert((lanes == 8 || lanes == 16) && "lanes are either 8 or 16");
+    if (!IsVerified() || program->UsesMemory()) {
+        return RunBatch(inputs, outputs, 1);
+    }
+    std::vector<RunResult> results(inputs.size());
+    if (lanes == 16) {
+        RunLanes<16>(inputs, outputs, results);
+    } else {
+        RunLanes<8>(inputs, outputs, results);
+    }
+    return results;
+}
+
+template <int kLanes>
+void Processor::RunLanes(const std::vector<std::istream*> &inputs, const std::vector<std::ostream*> &outputs,
+                         std::vector<RunResult> &results) const {
+    SimtEngine<kLanes> simt(*program);
+    for (size_t k = 0; k < inputs.size(); k += kLanes) {
+        int count = std::min<size_t>(kLanes, inputs.size() - k);
+        simt.Run(inputs.data() + k, outputs.data() + k, count, results.data() + k);
+    }
+}
+
+template <typename ProfilerT>
+RunResult Processor::Execute(ExecutionContext &context, InputBuffer &in, OutputBuffer &out, ProfilerT &profiler,
+                             Checkpointer *checkpointer) const {
+    AttachMemory(context);
+    // Native code and IR leave the checks of proven addresses out, the memory has to cover them.
+    // They have no safepoints and no meter, and always start at the beginning.
+    bool covered = context.memory.Size() >= program->MemoryExtent();
+    bool fresh = context.pc == 0 && context.returns.empty() && checkpointer == nullptr &&
+                 context.gas == kUnlimitedGas;
+    if (engine == kJitEngine && !ProfilerT::kEnabled && covered && fresh) {
+        const JitProgram *jit = program->Jit();
+        if (jit != nullptr) {
+            return RunJit(*jit, context, in, out);
+        }
+    }
+    if (engine == kIrEngine && !ProfilerT::kEnabled && covered && fresh) {
+        const IrProgram *ir = program->Ir();
+        if (ir != nullptr) {
+            return RunIr(*ir, context, in, out);
+        }
+    }
+    if (!IsVerified()) {
+        return Interpret(context, context.stack, in, out, profiler, checkpointer);
+    }
+    // Proven programs run on a flat stack, the protected one only keeps the state between runs
+    std::vector<int> &buffer = context.scratch;
+    TakeStack(context, buffer);
+    size_t depth = buffer.size();
+    buffer.resize(depth + program->MaxDepth());
+    FlatStack<int> operands(buffer.data(), depth);
+    RunResult result = Interpret(context, operands, in, out, profiler, checkpointer);
+    RestoreStack(context, operands.Begin(), operands.End());
+    return result;
+}
+
+template <typename StackT, typename ProfilerT>
+RunResult Processor::Interpret(ExecutionContext &context, StackT &operands, InputBuffer &in, OutputBuffer &out,
+                               ProfilerT &profiler, Checkpointer *checkpointer) const {
+    bool fresh = context.pc == 0 && context.returns.empty() && checkpointer == nullptr &&
+                 context.gas == kUnlimitedGas;
+    if (engine == kCompactEngine && PROCESSOR_HAS_COMPUTED_GOTO && !ProfilerT::kEnabled && fresh) {
+        const CompactProgram *compact = program->Compact();
+        if (compact != nullptr) {
+            return RunCompact(*compact, context, operands, in, out);
+        }
+    }
+    if (engine == kCachedEngine && PROCESSOR_HAS_COMPUTED_GOTO && !ProfilerT::kEnabled && fresh) {
+        return RunCached(context, operands, in, out);
+    }
+    unsigned safepoint = checkpointer != nullptr ? SAFEPOINT_JUMPS : 0;
+    RunResult result;
+    for (;;) {
+        if (engine != kSwitchEngine && PROCESSOR_HAS_COMPUTED_GOTO) {
+            result = RunThreaded(context, operands, in, out, profiler, safepoint);
         } else {
-            assert(cmd_str[cmd_str.length() - 1] == ':' && "unknown command");
-            program[j++] = HLT;
+            result = RunSwitch(context, operands, in, out, profiler, safepoint);
+        }
+        if (result.trap != kSafepoint) {
+            break;
         }
+        // Output so far goes out first, a run resumed from the snapshot does not repeat it
+        if (checkpointer != nullptr && checkpointer->Due()) {
+            out.Flush();
+            checkpointer->Submit(Capture(context, operands));
+        }
+    }
+    // A run out of gas goes on from where it stopped
+    if (result.trap != kOutOfGas) {
+        context.pc = 0;
+        context.returns.clear();
+    }
+    return result;
+}
+
+void Processor::TakeStack(ExecutionContext &context, std::vector<int> &values) {
+    values.clear();
+    int value;
+    while (context.stack.Pop(value)) {
+        values.push_back(value);
+    }
+    std::reverse(values.begin(), values.end());
+}
+
+void Processor::RestoreStack(ExecutionContext &context, const int *begin, const int *end) {
+    for (const int *ptr = begin; ptr < end; ptr++) {
+        context.stack.Push(*ptr);
     }
-    program_size = j;
 }
 
-void Processor::Run(std::istream *in, std::ostream &out) {
+// Protected stack can only be read by popping it, so it is emptied and filled again
+std::vector<int> Processor::CopyStack(Stack<int> &operands) {
+    std::vector<int> values;
+    int value;
+    while (operands.Pop(value)) {
+        values.push_back(value);
+    }
+    for (auto it = values.rbegin(); it != values.rend(); ++it) {
+        operands.Push(*it);
+    }
+    std::reverse(values.begin(), values.end());
+    return values;
+}
+
+std::vector<int> Processor::CopyStack(FlatStack<int> &operands) {
+    return std::vector<int>(operands.Begin(), operands.End());
+}
+
+// Mapped memory is left out, it lives in its file
+template <typename StackT>
+Snapshot Processor::Capture(const ExecutionContext &context, StackT &operands) const {
+    Snapshot snapshot;
+    snapshot.program_hash = program->Hash();
+    snapshot.pc = context.pc;
+    std::copy(context.registers, context.registers + REGISTERS_SIZE, snapshot.registers);
+    snapshot.returns = context.returns;
+    snapshot.stack = CopyStack(operands);
+    if (!context.memory.IsMapped()) {
+        const int *words = context.memory.Data();
+        snapshot.memory.assign(words, words + context.memory.Size());
+    }
+    return snapshot;
+}
+
+template <typename StackT, typename ProfilerT>
+RunResult Processor::RunSwitch(ExecutionContext &context, StackT &operands, InputBuffer &in, OutputBuffer &out,
+                               ProfilerT &profiler, unsigned safepoint) const {
+    int *registers = context.registers;
+    const Memory &memory = context.memory;
+    const int *code = program->Code();
+    int size = program->Size();
+    int decoded_size = program->DecodedSize();
     int tmp1;
     int tmp2;
-    int i = 0;
-    while (i < program_size) {
-        switch (program[i]) {
+    int target;
+    bool taken;
+    // Return addresses of the calls in progress
+    int returns[RETURN_STACK_SIZE];
+    int return_depth = context.returns.size();
+    std::copy(context.returns.begin(), context.returns.end(), returns);
+    unsigned countdown = safepoint != 0 ? safepoint : UINT_MAX;
+    const int *gas_cost = context.gas != kUnlimitedGas ? program->GasCosts().data() : nullptr;
+    int i = context.pc;
+    if (!Pay(gas_cost, context.gas, i)) [[unlikely]] {
+        return OutOfGas(context, i, returns, return_depth);
+    }
+    // Running past decoded_size means a bad opcode or a truncated command
+    while (i < decoded_size) {
+        int cmd = code[i];
+        profiler.Step(i);
+        switch (cmd) {
             case PUSH:
-                stack.Push(program[++i]);
+                operands.Push(code[i + 1]);
                 break;
             case PUSHR:
-                stack.Push(registers[program[++i]]);
+                if (!IsRegister(code[i + 1])) [[unlikely]] {
+                    goto bad_register;
+                }
+                operands.Push(registers[code[i + 1]]);
                 break;
             case POP:
-                assert(stack.Pop());
+                if (!operands.Pop()) [[unlikely]] {
+                    goto underflow;
+                }
                 break;
             case POPR:
-                assert(stack.Pop(tmp1));
-                registers[program[++i]] = tmp1;
+                if (!IsRegister(code[i + 1])) [[unlikely]] {
+                    goto bad_register;
+                }
+                if (!operands.Pop(tmp1)) [[unlikely]] {
+                    goto underflow;
+                }
+                registers[code[i + 1]] = tmp1;
                 break;
             case DUP:
-                tmp1 = program[++i];
-                Duplicate(tmp1);
+            case DUP_POP: {
+                Trap trap = Duplicate(operands, code[i + 1], cmd == DUP_POP);
+                if (trap != kNoTrap) [[unlikely]] {
+                    return {trap, i};
+                }
                 break;
+            }
             case SWP:
-                assert(stack.Pop(tmp1));
-                assert(stack.Pop(tmp2));
-                stack.Push(tmp1);
-                stack.Push(tmp2);
+            case POP_SWP:
+                if ((cmd == POP_SWP && !operands.Pop()) || !operands.Pop(tmp1) || !operands.Pop(tmp2)) [[unlikely]] {
+                    goto underflow;
+                }
+                operands.Push(tmp1);
+                operands.Push(tmp2);
                 break;
             case MOV:
-                registers[program[i + 1]] = registers[program[i + 2]];
-                i += 2;
+                if (!IsRegister(code[i + 1]) || !IsRegister(code[i + 2])) [[unlikely]] {
+                    goto bad_register;
+                }
+                registers[code[i + 1]] = registers[code[i + 2]];
                 break;
             case MOVD:
-                registers[program[i + 1]] = program[i + 2];
-                i += 2;
+                if (!IsRegister(code[i + 1])) [[unlikely]] {
+                    goto bad_register;
+                }
+                registers[code[i + 1]] = code[i + 2];
                 break;
             case IN:
-                assert(in && "input stream should be specified!");
-                *in >> tmp1;
-                stack.Push(tmp1);
+                if (!in.Read(tmp1)) [[unlikely]] {
+                    return {kNoInput, i};
+                }
+                operands.Push(tmp1);
                 break;
             case OUT:
-                assert(stack.Pop(tmp1));
-                out << tmp1 << std::endl;
+                if (!operands.Pop(tmp1)) [[unlikely]] {
+                    goto underflow;
+                }
+                out.Write(tmp1);
                 break;
             case MUL:
-                assert(stack.Pop(tmp1));
-                assert(stack.Pop(tmp2));
-                stack.Push(tmp1 * tmp2);
-                break;
             case ADD:
-                assert(stack.Pop(tmp1));
-                assert(stack.Pop(tmp2));
-                stack.Push(tmp1 + tmp2);
-                break;
             case MOD:
-                assert(stack.Pop(tmp1));
-                assert(stack.Pop(tmp2));
-                stack.Push(tmp2 % tmp1);
+                if (!operands.Pop(tmp1) || !operands.Pop(tmp2)) [[unlikely]] {
+                    goto underflow;
+                }
+                if (cmd == MOD && tmp1 == 0) [[unlikely]] {
+                    return {kDivisionByZero, i};
+                }
+                operands.Push(cmd == MUL ? tmp1 * tmp2 : cmd == ADD ? tmp1 + tmp2 : Remainder(tmp2, tmp1));
                 break;
-            case JMP:
-                i = program[i + 1];
-                continue;
-            case JE:
-                assert(stack.Pop(tmp1));
-                assert(stack.Pop(tmp2));
-                if (tmp1 == tmp2) {
-                    i = program[i + 1];
-                    continue;
-                } else {
-                    i++;
+            case LOAD:
+            case LOADR:
+                if (cmd == LOADR && !IsRegister(code[i + 1])) [[unlikely]] {
+                    goto bad_register;
+                }
+                tmp1 = cmd == LOAD ? code[i + 1] : registers[code[i + 1]];
+                if (!memory.Contains(tmp1)) [[unlikely]] {
+                    goto bad_address;
                 }
+                operands.Push(memory.Data()[tmp1]);
                 break;
+            case STORE:
+            case STORER:
+                if (cmd == STORER && !IsRegister(code[i + 1])) [[unlikely]] {
+                    goto bad_register;
+                }
+                if (!operands.Pop(tmp2)) [[unlikely]] {
+                    goto underflow;
+                }
+                tmp1 = cmd == STORE ? code[i + 1] : registers[code[i + 1]];
+                if (!memory.Contains(tmp1)) [[unlikely]] {
+                    goto bad_address;
+                }
+                memory.Data()[tmp1] = tmp2;
+                break;
+            case JMP:
+                target = code[i + 1];
+                goto jump;
+            case JE:
             case JNE:
-                assert(stack.Pop(tmp1));
-                assert(stack.Pop(tmp2));
-                if (tmp1 != tmp2) {
-                    i = program[i + 1];
-                    continue;
-                } else {
-                    i++;
+                if (!operands.Pop(tmp1) || !operands.Pop(tmp2)) [[unlikely]] {
+                    goto underflow;
+                }
+                taken = (tmp1 == tmp2) == (cmd == JE);
+                profiler.Branch(i, taken);
+                if (taken) {
+                    target = code[i + 1];
+                    goto jump;
+                }
+                i += kCommandLength[cmd];
+                goto enter;
+            case PUSH_JE:
+            case PUSH_JNE:
+                if (!operands.Pop(tmp1)) [[unlikely]] {
+                    goto underflow;
+                }
+                taken = (tmp1 == code[i + 1]) == (cmd == PUSH_JE);
+                profiler.Branch(i, taken);
+                if (taken) {
+                    target = code[i + 2];
+                    goto jump;
+                }
+                i += kCommandLength[cmd];
+                goto enter;
+            case PUSH_ADD:
+            case PUSH_MUL:
+                if (!operands.Pop(tmp1)) [[unlikely]] {
+                    goto underflow;
                 }
+                operands.Push(cmd == PUSH_ADD ? tmp1 + code[i + 1] : tmp1 * code[i + 1]);
                 break;
+            case CALL:
+                if (return_depth == RETURN_STACK_SIZE) [[unlikely]] {
+                    return {kCallOverflow, i};
+                }
+                returns[return_depth++] = i + kCommandLength[CALL];
+                target = code[i + 1];
+                goto jump;
+            case RET:
+                if (return_depth == 0) [[unlikely]] {
+                    return {kReturnWithoutCall, i};
+                }
+                i = returns[--return_depth];
+                goto enter;
             case END:
-                return;
+                return {kNoTrap, i};
+            case HLT:
+                break;
             default:
+                return {kBadOpcode, i};
+        }
+        i += kCommandLength[cmd];
+        continue;
+    jump:
+        if (static_cast<unsigned>(target) > static_cast<unsigned>(size)) [[unlikely]] {
+            return {kBadJump, i};
+        }
+        if (!program->IsBoundary(target)) [[unlikely]] {
+            return {kBadOpcode, target};
+        }
+        i = target;
+        if (--countdown == 0) [[unlikely]] {
+            context.pc = i;
+            context.returns.assign(returns, returns + return_depth);
+            return {kSafepoint, i};
+        }
+    enter:
+        if (!Pay(gas_cost, context.gas, i)) [[unlikely]] {
+            return OutOfGas(context, i, returns, return_depth);
+        }
+    }
+    return {i < size ? kBadOpcode : kNoTrap, i};
+
+underflow:
+    return {kStackUnderflow, i};
+bad_register:
+    return {kBadRegister, i};
+bad_address:
+    return {kBadAddress, i};
+}
+
+// Direct threaded code: every command ends with a jump to the handler of the next one,
+// so each of them gets its own indirect branch instead of the shared one of the switch.
+template <typename StackT, typename ProfilerT>
+RunResult Processor::RunThreaded(ExecutionContext &context, StackT &operands, InputBuffer &in, OutputBuffer &out,
+                                 ProfilerT &profiler, unsigned safepoint) const {
+#if PROCESSOR_HAS_COMPUTED_GOTO
+    int *registers = context.registers;
+    const Memory &memory = context.memory;
+    static const void *const kHandlers[COMMANDS_COUNT] = {
+            &&op_push, &&op_pushr, &&op_pop, &&op_popr, &&op_dup, &&op_swp, &&op_mov, &&op_movd, &&op_in, &&op_out,
+            &&op_mul, &&op_add, &&op_mod, &&op_jmp, &&op_je, &&op_jne, &&op_end, &&op_hlt, &&op_call, &&op_ret,
+            &&op_load, &&op_store, &&op_loadr, &&op_storer,
+            &&op_push_je, &&op_push_jne, &&op_push_add, &&op_push_mul, &&op_dup_pop, &&op_pop_swp
+    };
+    // Memory commands with a proven address, only the entries of these commands are used
+    static const void *const kProvenHandlers[COMMANDS_COUNT] = {
+            &&op_bad, &&op_bad, &&op_bad, &&op_bad, &&op_bad, &&op_bad, &&op_bad, &&op_bad, &&op_bad, &&op_bad,
+            &&op_bad, &&op_bad, &&op_bad, &&op_bad, &&op_bad, &&op_bad, &&op_bad, &&op_bad, &&op_bad, &&op_bad,
+            &&op_load_proven, &&op_store_proven, &&op_loadr_proven, &&op_storer_proven,
+            &&op_bad, &&op_bad, &&op_bad, &&op_bad, &&op_bad, &&op_bad
+    };
+    // Every instantiation of the engine has its own handler addresses. The bounds checks of
+    // proven addresses are made once here, for the whole run.
+    const void *const *code = program->ThreadedCode(
+            kHandlers, memory.Size() >= program->MemoryExtent() ? kProvenHandlers : nullptr, &&op_bad, &&op_end);
+    const int *prog = program->Code();
+    int *words = memory.Data();
+    int program_size = program->Size();
+    int tmp1;
+    int tmp2;
+    int target;
+    Trap trap;
+    int returns[RETURN_STACK_SIZE];
+    int return_depth = context.returns.size();
+    std::copy(context.returns.begin(), context.returns.end(), returns);
+    unsigned countdown = safepoint != 0 ? safepoint : UINT_MAX;
+    const int *gas_cost = context.gas != kUnlimitedGas ? program->GasCosts().data() : nullptr;
+    int i = context.pc;
+
+#define DISPATCH(length) i += (length); profiler.Step(i); goto *code[i]
+// Dispatch to a command that starts a block
+#define ENTER(length) \
+    i += (length); \
+    if (!Pay(gas_cost, context.gas, i)) [[unlikely]] { goto out_of_gas; } \
+    profiler.Step(i); \
+    goto *code[i]
+#define BRANCH(condition, operand) \
+    if (condition) { profiler.Branch(i, true); target = prog[i + (operand)]; goto jump; } \
+    profiler.Branch(i, false)
+#define POP(value) if (!operands.Pop(value)) [[unlikely]] { goto underflow; }
+#define CHECK_REGISTER(r) if (!IsRegister(r)) [[unlikely]] { goto bad_register; }
+
+    ENTER(0);
+op_push:
+    operands.Push(prog[i + 1]);
+    DISPATCH(2);
+op_pushr:
+    CHECK_REGISTER(prog[i + 1]);
+    operands.Push(registers[prog[i + 1]]);
+    DISPATCH(2);
+op_pop:
+    POP(tmp1);
+    DISPATCH(1);
+op_popr:
+    CHECK_REGISTER(prog[i + 1]);
+    POP(registers[prog[i + 1]]);
+    DISPATCH(2);
+op_dup:
+    trap = Duplicate(operands, prog[i + 1]);
+    if (trap != kNoTrap) [[unlikely]] {
+        return {trap, i};
+    }
+    DISPATCH(2);
+op_swp:
+    POP(tmp1);
+    POP(tmp2);
+    operands.Push(tmp1);
+    operands.Push(tmp2);
+    DISPATCH(1);
+op_mov:
+    CHECK_REGISTER(prog[i + 1]);
+    CHECK_REGISTER(prog[i + 2]);
+    registers[prog[i + 1]] = registers[prog[i + 2]];
+    DISPATCH(3);
+op_movd:
+    CHECK_REGISTER(prog[i + 1]);
+    registers[prog[i + 1]] = prog[i + 2];
+    DISPATCH(3);
+op_in:
+    if (!in.Read(tmp1)) [[unlikely]] {
+        return {kNoInput, i};
+    }
+    operands.Push(tmp1);
+    DISPATCH(1);
+op_out:
+    POP(tmp1);
+    out.Write(tmp1);
+    DISPATCH(1);
+op_mul:
+    POP(tmp1);
+    POP(tmp2);
+    operands.Push(tmp1 * tmp2);
+    DISPATCH(1);
+op_add:
+    POP(tmp1);
+    POP(tmp2);
+    operands.Push(tmp1 + tmp2);
+    DISPATCH(1);
+op_mod:
+    POP(tmp1);
+    POP(tmp2);
+    if (tmp1 == 0) [[unlikely]] {
+        return {kDivisionByZero, i};
+    }
+    operands.Push(Remainder(tmp2, tmp1));
+    DISPATCH(1);
+op_jmp:
+    target = prog[i + 1];
+    goto jump;
+op_je:
+    POP(tmp1);
+    POP(tmp2);
+    BRANCH(tmp1 == tmp2, 1);
+    ENTER(2);
+op_jne:
+    POP(tmp1);
+    POP(tmp2);
+    BRANCH(tmp1 != tmp2, 1);
+    ENTER(2);
+op_push_je:
+    POP(tmp1);
+    BRANCH(tmp1 == prog[i + 1], 2);
+    ENTER(3);
+op_push_jne:
+    POP(tmp1);
+    BRANCH(tmp1 != prog[i + 1], 2);
+    ENTER(3);
+op_push_add:
+    POP(tmp1);
+    operands.Push(tmp1 + prog[i + 1]);
+    DISPATCH(2);
+op_push_mul:
+    POP(tmp1);
+    operands.Push(tmp1 * prog[i + 1]);
+    DISPATCH(2);
+op_dup_pop:
+    trap = Duplicate(operands, prog[i + 1], true);
+    if (trap != kNoTrap) [[unlikely]] {
+        return {trap, i};
+    }
+    DISPATCH(2);
+op_pop_swp:
+    POP(tmp1);
+    POP(tmp1);
+    POP(tmp2);
+    operands.Push(tmp1);
+    operands.Push(tmp2);
+    DISPATCH(1);
+op_load:
+    tmp1 = prog[i + 1];
+    goto load;
+op_loadr:
+    CHECK_REGISTER(prog[i + 1]);
+    tmp1 = registers[prog[i + 1]];
+load:
+    if (!memory.Contains(tmp1)) [[unlikely]] {
+        return {kBadAddress, i};
+    }
+    operands.Push(words[tmp1]);
+    DISPATCH(2);
+op_load_proven:
+    operands.Push(words[prog[i + 1]]);
+    DISPATCH(2);
+op_loadr_proven:
+    operands.Push(words[registers[prog[i + 1]]]);
+    DISPATCH(2);
+op_store:
+    tmp1 = prog[i + 1];
+    goto store;
+op_storer:
+    CHECK_REGISTER(prog[i + 1]);
+    tmp1 = registers[prog[i + 1]];
+store:
+    POP(tmp2);
+    if (!memory.Contains(tmp1)) [[unlikely]] {
+        return {kBadAddress, i};
+    }
+    words[tmp1] = tmp2;
+    DISPATCH(2);
+op_store_proven:
+    POP(words[prog[i + 1]]);
+    DISPATCH(2);
+op_storer_proven:
+    POP(words[registers[prog[i + 1]]]);
+    DISPATCH(2);
+op_hlt:
+    DISPATCH(1);
+op_call:
+    if (return_depth == RETURN_STACK_SIZE) [[unlikely]] {
+        return {kCallOverflow, i};
+    }
+    returns[return_depth++] = i + 2;
+    target = prog[i + 1];
+    goto jump;
+op_ret:
+    if (return_depth == 0) [[unlikely]] {
+        return {kReturnWithoutCall, i};
+    }
+    i = returns[--return_depth];
+    ENTER(0);
+op_end:
+    return {kNoTrap, i};
+
+jump:
+    if (static_cast<unsigned>(target) > static_cast<unsigned>(program_size)) [[unlikely]] {
+        return {kBadJump, i};
+    }
+    i = target;
+    // A target inside a command traps on dispatch, it is no place to resume from
+    if (--countdown == 0 && program->IsBoundary(i)) [[unlikely]] {
+        context.pc = i;
+        context.returns.assign(returns, returns + return_depth);
+        return {kSafepoint, i};
+    }
+    ENTER(0);
+op_bad:
+    return {kBadOpcode, i};
+out_of_gas:
+    return OutOfGas(context, i, returns, return_depth);
+underflow:
+    return {kStackUnderflow, i};
+bad_register:
+    return {kBadRegister, i};
+
+#undef BRANCH
+#undef CHECK_REGISTER
+#undef POP
+#undef ENTER
+#undef DISPATCH
+#else
+    return RunSwitch(context, operands, in, out, profiler, safepoint);
+#endif
+}
+
+// Threaded like RunThreaded, over bytes. Operands are decoded as the handler goes, at is the
+// first byte of the command for the trap to report.
+template <typename StackT>
+RunResult Processor::RunCompact(const CompactProgram &compact, ExecutionContext &context, StackT &operands,
+                                InputBuffer &in, OutputBuffer &out) const {
+#if PROCESSOR_HAS_COMPUTED_GOTO
+    static const void *const kHandlers[kCompactOpsCount] = {
+            &&op_push, &&op_pop, &&op_dup, &&op_swp, &&op_in, &&op_out, &&op_mul, &&op_add,
+            &&op_mod, &&op_jmp, &&op_je, &&op_jne, &&op_end, &&op_call, &&op_ret, &&op_load,
+            &&op_store, &&op_push_je, &&op_push_jne, &&op_push_add, &&op_push_mul, &&op_dup_pop,
+            &&op_pop_swp, &&bad_register,
+            &&op_pushr, &&op_pushr, &&op_pushr, &&op_pushr, &&op_popr, &&op_popr, &&op_popr, &&op_popr,
+            &&op_movd, &&op_movd, &&op_movd, &&op_movd, &&op_loadr, &&op_loadr, &&op_loadr, &&op_loadr,
+            &&op_storer, &&op_storer, &&op_storer, &&op_storer, &&op_bad, &&op_bad, &&op_bad, &&op_bad,
+            &&op_mov, &&op_mov, &&op_mov, &&op_mov, &&op_mov, &&op_mov, &&op_mov, &&op_mov,
+            &&op_mov, &&op_mov, &&op_mov, &&op_mov, &&op_mov, &&op_mov, &&op_mov, &&op_mov
+    };
+    int *registers = context.registers;
+    const Memory &memory = context.memory;
+    int *words = memory.Data();
+    const uint8_t *base = compact.Code();
+    const uint8_t *ip = base;
+    const uint8_t *at = base;
+    int op;
+    int tmp1;
+    int tmp2;
+    uint32_t target;
+    uint32_t returns[RETURN_STACK_SIZE];
+    int return_depth = 0;
+    Trap trap;
+
+#define DISPATCH() at = ip; op = *ip++; goto *kHandlers[op]
+#define JUMP(condition) target = ReadVarint(ip); if (condition) { ip = base + target; } DISPATCH()
+#define POP(value) if (!operands.Pop(value)) [[unlikely]] { goto underflow; }
+
+    DISPATCH();
+op_push:
+    operands.Push(ReadSigned(ip));
+    DISPATCH();
+op_pushr:
+    operands.Push(registers[op & 3]);
+    DISPATCH();
+op_pop:
+    POP(tmp1);
+    DISPATCH();
+op_popr:
+    POP(registers[op & 3]);
+    DISPATCH();
+op_dup:
+    trap = Duplicate(operands, ReadSigned(ip));
+    if (trap != kNoTrap) [[unlikely]] {
+        goto stop;
+    }
+    DISPATCH();
+op_dup_pop:
+    trap = Duplicate(operands, ReadSigned(ip), true);
+    if (trap != kNoTrap) [[unlikely]] {
+        goto stop;
+    }
+    DISPATCH();
+op_pop_swp:
+    POP(tmp1);
+op_swp:
+    POP(tmp1);
+    POP(tmp2);
+    operands.Push(tmp1);
+    operands.Push(tmp2);
+    DISPATCH();
+op_mov:
+    registers[(op >> 2) & 3] = registers[op & 3];
+    DISPATCH();
+op_movd:
+    registers[op & 3] = ReadSigned(ip);
+    DISPATCH();
+op_in:
+    if (!in.Read(tmp1)) [[unlikely]] {
+        trap = kNoInput;
+        goto stop;
+    }
+    operands.Push(tmp1);
+    DISPATCH();
+op_out:
+    POP(tmp1);
+    out.Write(tmp1);
+    DISPATCH();
+op_mul:
+    POP(tmp1);
+    POP(tmp2);
+    operands.Push(tmp1 * tmp2);
+    DISPATCH();
+op_add:
+    POP(tmp1);
+    POP(tmp2);
+    operands.Push(tmp1 + tmp2);
+    DISPATCH();
+op_mod:
+    POP(tmp1);
+    POP(tmp2);
+    if (tmp1 == 0) [[unlikely]] {
+        trap = kDivisionByZero;
+        goto stop;
+    }
+    operands.Push(Remainder(tmp2, tmp1));
+    DISPATCH();
+op_push_add:
+    POP(tmp1);
+    operands.Push(tmp1 + ReadSigned(ip));
+    DISPATCH();
+op_push_mul:
+    POP(tmp1);
+    operands.Push(tmp1 * ReadSigned(ip));
+    DISPATCH();
+op_jmp:
+    ip = base + ReadVarint(ip);
+    DISPATCH();
+op_je:
+    POP(tmp1);
+    POP(tmp2);
+    JUMP(tmp1 == tmp2);
+op_jne:
+    POP(tmp1);
+    POP(tmp2);
+    JUMP(tmp1 != tmp2);
+op_push_je:
+    POP(tmp1);
+    tmp2 = ReadSigned(ip);
+    JUMP(tmp1 == tmp2);
+op_push_jne:
+    POP(tmp1);
+    tmp2 = ReadSigned(ip);
+    JUMP(tmp1 != tmp2);
+op_load:
+    tmp1 = ReadSigned(ip);
+    goto load;
+op_loadr:
+    tmp1 = registers[op & 3];
+load:
+    if (!memory.Contains(tmp1)) [[unlikely]] {
+        trap = kBadAddress;
+        goto stop;
+    }
+    operands.Push(words[tmp1]);
+    DISPATCH();
+op_store:
+    tmp1 = ReadSigned(ip);
+    goto store;
+op_storer:
+    tmp1 = registers[op & 3];
+store:
+    POP(tmp2);
+    if (!memory.Contains(tmp1)) [[unlikely]] {
+        trap = kBadAddress;
+        goto stop;
+    }
+    words[tmp1] = tmp2;
+    DISPATCH();
+op_call:
+    if (return_depth == RETURN_STACK_SIZE) [[unlikely]] {
+        trap = kCallOverflow;
+        goto stop;
+    }
+    target = ReadVarint(ip);
+    returns[return_depth++] = ip - base;
+    ip = base + target;
+    DISPATCH();
+op_ret:
+    if (return_depth == 0) [[unlikely]] {
+        trap = kReturnWithoutCall;
+        goto stop;
+    }
+    ip = base + returns[--return_depth];
+    DISPATCH();
+op_end:
+    trap = kNoTrap;
+    goto stop;
+op_bad:
+    trap = kBadOpcode;
+    goto stop;
+underflow:
+    trap = kStackUnderflow;
+    goto stop;
+bad_register:
+    trap = kBadRegister;
+stop:
+    return {trap, compact.Pc(at - base)};
+
+#undef POP
+#undef JUMP
+#undef DISPATCH
+#else
+    (void) compact;
+    NoProfile profiler;
+    return RunSwitch(context, operands, in, out, profiler, 0);
+#endif
+}
+
+// Threaded like RunThreaded, with the top two values of the stack in t0 (the top) and t1.
+// Every command that works on the stack has a handler for each number of cached values,
+// 0, 1 or 2, and goes on through the table of the state it leaves, so values reach the stack
+// only when a third one comes or a command needs them there. Other commands, jumps and calls
+// among them, spill the cache and run in state 0. A trap spills whatever the command has not
+// consumed, the stack is left as the other engines leave it.
+template <typename StackT>
+RunResult Processor::RunCached(ExecutionContext &context, StackT &operands, InputBuffer &in,
+                               OutputBuffer &out) const {
+#if PROCESSOR_HAS_COMPUTED_GOTO
+    int *registers = context.registers;
+    const Memory &memory = context.memory;
+    static const void *const kHandlers0[COMMANDS_COUNT] = {
+            &&push0, &&pushr0, &&pop0, &&popr0, &&dup0, &&swp0, &&mov0, &&movd0, &&in0, &&out0,
+            &&mul0, &&add0, &&mod0, &&jmp0, &&je0, &&jne0, &&end0, &&hlt0, &&call0, &&ret0,
+            &&load0, &&store0, &&loadr0, &&storer0,
+            &&push_je0, &&push_jne0, &&push_add0, &&push_mul0, &&dup_pop0, &&pop_swp0
+    };
+    static const void *const kHandlers1[COMMANDS_COUNT] = {
+            &&push1, &&pushr1, &&pop1, &&popr1, &&spill1, &&swp1, &&mov1, &&movd1, &&in1, &&out1,
+            &&mul1, &&add1, &&mod1, &&spill1, &&je1, &&jne1, &&end1, &&hlt1, &&spill1, &&spill1,
+            &&load1, &&store1, &&loadr1, &&storer1,
+            &&push_je1, &&push_jne1, &&push_add1, &&push_mul1, &&spill1, &&spill1
+    };
+    static const void *const kHandlers2[COMMANDS_COUNT] = {
+            &&push2, &&pushr2, &&pop2, &&popr2, &&spill2, &&swp2, &&mov2, &&movd2, &&in2, &&out2,
+            &&mul2, &&add2, &&mod2, &&spill2, &&je2, &&jne2, &&end2, &&hlt2, &&spill2, &&spill2,
+            &&load2, &&store2, &&loadr2, &&storer2,
+            &&push_je2, &&push_jne2, &&push_add2, &&push_mul2, &&spill2, &&spill2
+    };
+    const void *const *code0 = program->ThreadedCode(kHandlers0, nullptr, &&bad0, &&end0);
+    const void *const *code1 = program->ThreadedCode(kHandlers1, nullptr, &&bad1, &&end1);
+    const void *const *code2 = program->ThreadedCode(kHandlers2, nullptr, &&bad2, &&end2);
+    const int *prog = program->Code();
+    int *words = memory.Data();
+    int program_size = program->Size();
+    int t0 = 0;
+    int t1 = 0;
+    int tmp1;
+    int tmp2;
+    int target;
+    Trap trap;
+    int returns[RETURN_STACK_SIZE];
+    int return_depth = 0;
+    int i = 0;
+
+#define NEXT0(length) i += (length); goto *code0[i]
+#define NEXT1(length) i += (length); goto *code1[i]
+#define NEXT2(length) i += (length); goto *code2[i]
+#define JUMP(condition, operand) if (condition) { target = prog[i + (operand)]; goto jump; }
+#define POP(value) if (!operands.Pop(value)) [[unlikely]] { goto underflow; }
+#define CHECK_REGISTER(r, trap) if (!IsRegister(r)) [[unlikely]] { goto trap; }
+
+    goto *code0[i];
+
+// Nothing cached
+push0:
+    t0 = prog[i + 1];
+    NEXT1(2);
+pushr0:
+    CHECK_REGISTER(prog[i + 1], bad_register);
+    t0 = registers[prog[i + 1]];
+    NEXT1(2);
+pop0:
+    POP(tmp1);
+    NEXT0(1);
+popr0:
+    CHECK_REGISTER(prog[i + 1], bad_register);
+    POP(registers[prog[i + 1]]);
+    NEXT0(2);
+swp0:
+    POP(t1);
+    POP(t0);
+    NEXT2(1);
+in0:
+    if (!in.Read(t0)) [[unlikely]] {
+        goto no_input;
+    }
+    NEXT1(1);
+out0:
+    POP(tmp1);
+    out.Write(tmp1);
+    NEXT0(1);
+mul0:
+    POP(tmp1);
+    POP(tmp2);
+    t0 = tmp1 * tmp2;
+    NEXT1(1);
+add0:
+    POP(tmp1);
+    POP(tmp2);
+    t0 = tmp1 + tmp2;
+    NEXT1(1);
+mod0:
+    POP(tmp1);
+    POP(tmp2);
+    if (tmp1 == 0) [[unlikely]] {
+        return {kDivisionByZero, i};
+    }
+    t0 = Remainder(tmp2, tmp1);
+    NEXT1(1);
+je0:
+    POP(tmp1);
+    POP(tmp2);
+    JUMP(tmp1 == tmp2, 1);
+    NEXT0(2);
+jne0:
+    POP(tmp1);
+    POP(tmp2);
+    JUMP(tmp1 != tmp2, 1);
+    NEXT0(2);
+push_je0:
+    POP(tmp1);
+    JUMP(tmp1 == prog[i + 1], 2);
+    NEXT0(3);
+push_jne0:
+    POP(tmp1);
+    JUMP(tmp1 != prog[i + 1], 2);
+    NEXT0(3);
+push_add0:
+    POP(t0);
+    t0 += prog[i + 1];
+    NEXT1(2);
+push_mul0:
+    POP(t0);
+    t0 *= prog[i + 1];
+    NEXT1(2);
+load0:
+    tmp1 = prog[i + 1];
+    goto load0_at;
+loadr0:
+    CHECK_REGISTER(prog[i + 1], bad_register);
+    tmp1 = registers[prog[i + 1]];
+load0_at:
+    if (!memory.Contains(tmp1)) [[unlikely]] {
+        goto bad_address;
+    }
+    t0 = words[tmp1];
+    NEXT1(2);
+store0:
+    tmp1 = prog[i + 1];
+    goto store0_at;
+storer0:
+    CHECK_REGISTER(prog[i + 1], bad_register);
+    tmp1 = registers[prog[i + 1]];
+store0_at:
+    POP(tmp2);
+    if (!memory.Contains(tmp1)) [[unlikely]] {
+        goto bad_address;
+    }
+    words[tmp1] = tmp2;
+    NEXT0(2);
+mov0:
+    CHECK_REGISTER(prog[i + 1], bad_register);
+    CHECK_REGISTER(prog[i + 2], bad_register);
+    registers[prog[i + 1]] = registers[prog[i + 2]];
+    NEXT0(3);
+movd0:
+    CHECK_REGISTER(prog[i + 1], bad_register);
+    registers[prog[i + 1]] = prog[i + 2];
+    NEXT0(3);
+hlt0:
+    NEXT0(1);
+dup0:
+dup_pop0:
+    trap = Duplicate(operands, prog[i + 1], prog[i] == DUP_POP);
+    if (trap != kNoTrap) [[unlikely]] {
+        return {trap, i};
+    }
+    NEXT0(2);
+pop_swp0:
+    POP(tmp1);
+    POP(tmp1);
+    POP(tmp2);
+    operands.Push(tmp1);
+    operands.Push(tmp2);
+    NEXT0(1);
+jmp0:
+    target = prog[i + 1];
+    goto jump;
+call0:
+    if (return_depth == RETURN_STACK_SIZE) [[unlikely]] {
+        return {kCallOverflow, i};
+    }
+    returns[return_depth++] = i + 2;
+    target = prog[i + 1];
+    goto jump;
+ret0:
+    if (return_depth == 0) [[unlikely]] {
+        return {kReturnWithoutCall, i};
+    }
+    i = returns[--return_depth];
+    goto *code0[i];
+
+// t0 cached
+push1:
+    t1 = t0;
+    t0 = prog[i + 1];
+    NEXT2(2);
+pushr1:
+    CHECK_REGISTER(prog[i + 1], bad_register1);
+    t1 = t0;
+    t0 = registers[prog[i + 1]];
+    NEXT2(2);
+pop1:
+    NEXT0(1);
+popr1:
+    CHECK_REGISTER(prog[i + 1], bad_register1);
+    registers[prog[i + 1]] = t0;
+    NEXT0(2);
+swp1:
+    POP(tmp1);
+    t1 = t0;
+    t0 = tmp1;
+    NEXT2(1);
+in1:
+    if (!in.Read(tmp1)) [[unlikely]] {
+        goto no_input1;
+    }
+    t1 = t0;
+    t0 = tmp1;
+    NEXT2(1);
+out1:
+    out.Write(t0);
+    NEXT0(1);
+mul1:
+    POP(tmp2);
+    t0 = t0 * tmp2;
+    NEXT1(1);
+add1:
+    POP(tmp2);
+    t0 = t0 + tmp2;
+    NEXT1(1);
+mod1:
+    POP(tmp2);
+    if (t0 == 0) [[unlikely]] {
+        return {kDivisionByZero, i};
+    }
+    t0 = Remainder(tmp2, t0);
+    NEXT1(1);
+je1:
+    POP(tmp2);
+    JUMP(t0 == tmp2, 1);
+    NEXT0(2);
+jne1:
+    POP(tmp2);
+    JUMP(t0 != tmp2, 1);
+    NEXT0(2);
+push_je1:
+    JUMP(t0 == prog[i + 1], 2);
+    NEXT0(3);
+push_jne1:
+    JUMP(t0 != prog[i + 1], 2);
+    NEXT0(3);
+push_add1:
+    t0 += prog[i + 1];
+    NEXT1(2);
+push_mul1:
+    t0 *= prog[i + 1];
+    NEXT1(2);
+load1:
+    tmp1 = prog[i + 1];
+    goto load1_at;
+loadr1:
+    CHECK_REGISTER(prog[i + 1], bad_register1);
+    tmp1 = registers[prog[i + 1]];
+load1_at:
+    if (!memory.Contains(tmp1)) [[unlikely]] {
+        goto bad_address1;
+    }
+    t1 = t0;
+    t0 = words[tmp1];
+    NEXT2(2);
+store1:
+    tmp1 = prog[i + 1];
+    goto store1_at;
+storer1:
+    CHECK_REGISTER(prog[i + 1], bad_register1);
+    tmp1 = registers[prog[i + 1]];
+store1_at:
+    if (!memory.Contains(tmp1)) [[unlikely]] {
+        goto bad_address;
+    }
+    words[tmp1] = t0;
+    NEXT0(2);
+mov1:
+    CHECK_REGISTER(prog[i + 1], bad_register1);
+    CHECK_REGISTER(prog[i + 2], bad_register1);
+    registers[prog[i + 1]] = registers[prog[i + 2]];
+    NEXT1(3);
+movd1:
+    CHECK_REGISTER(prog[i + 1], bad_register1);
+    registers[prog[i + 1]] = prog[i + 2];
+    NEXT1(3);
+hlt1:
+    NEXT1(1);
+spill1:
+    operands.Push(t0);
+    goto *code0[i];
+
+// t0 and t1 cached
+push2:
+    operands.Push(t1);
+    t1 = t0;
+    t0 = prog[i + 1];
+    NEXT2(2);
+pushr2:
+    CHECK_REGISTER(prog[i + 1], bad_register2);
+    operands.Push(t1);
+    t1 = t0;
+    t0 = registers[prog[i + 1]];
+    NEXT2(2);
+pop2:
+    t0 = t1;
+    NEXT1(1);
+popr2:
+    CHECK_REGISTER(prog[i + 1], bad_register2);
+    registers[prog[i + 1]] = t0;
+    t0 = t1;
+    NEXT1(2);
+swp2:
+    std::swap(t0, t1);
+    NEXT2(1);
+in2:
+    if (!in.Read(tmp1)) [[unlikely]] {
+        goto no_input2;
+    }
+    operands.Push(t1);
+    t1 = t0;
+    t0 = tmp1;
+    NEXT2(1);
+out2:
+    out.Write(t0);
+    t0 = t1;
+    NEXT1(1);
+mul2:
+    t0 = t0 * t1;
+    NEXT1(1);
+add2:
+    t0 = t0 + t1;
+    NEXT1(1);
+mod2:
+    if (t0 == 0) [[unlikely]] {
+        return {kDivisionByZero, i};
+    }
+    t0 = Remainder(t1, t0);
+    NEXT1(1);
+je2:
+    JUMP(t0 == t1, 1);
+    NEXT0(2);
+jne2:
+    JUMP(t0 != t1, 1);
+    NEXT0(2);
+push_je2:
+    tmp1 = t0;
+    t0 = t1;
+    if (tmp1 == prog[i + 1]) {
+        target = prog[i + 2];
+        goto jump1;
+    }
+    NEXT1(3);
+push_jne2:
+    tmp1 = t0;
+    t0 = t1;
+    if (tmp1 != prog[i + 1]) {
+        target = prog[i + 2];
+        goto jump1;
+    }
+    NEXT1(3);
+push_add2:
+    t0 += prog[i + 1];
+    NEXT2(2);
+push_mul2:
+    t0 *= prog[i + 1];
+    NEXT2(2);
+load2:
+    tmp1 = prog[i + 1];
+    goto load2_at;
+loadr2:
+    CHECK_REGISTER(prog[i + 1], bad_register2);
+    tmp1 = registers[prog[i + 1]];
+load2_at:
+    if (!memory.Contains(tmp1)) [[unlikely]] {
+        goto bad_address2;
+    }
+    operands.Push(t1);
+    t1 = t0;
+    t0 = words[tmp1];
+    NEXT2(2);
+store2:
+    tmp1 = prog[i + 1];
+    goto store2_at;
+storer2:
+    CHECK_REGISTER(prog[i + 1], bad_register2);
+    tmp1 = registers[prog[i + 1]];
+store2_at:
+    tmp2 = t0;
+    t0 = t1;
+    if (!memory.Contains(tmp1)) [[unlikely]] {
+        goto bad_address1;
+    }
+    words[tmp1] = tmp2;
+    NEXT1(2);
+mov2:
+    CHECK_REGISTER(prog[i + 1], bad_register2);
+    CHECK_REGISTER(prog[i + 2], bad_register2);
+    registers[prog[i + 1]] = registers[prog[i + 2]];
+    NEXT2(3);
+movd2:
+    CHECK_REGISTER(prog[i + 1], bad_register2);
+    registers[prog[i + 1]] = prog[i + 2];
+    NEXT2(3);
+hlt2:
+    NEXT2(1);
+spill2:
+    operands.Push(t1);
+    operands.Push(t0);
+    goto *code0[i];
+
+jump1:
+    operands.Push(t0);
+jump:
+    if (static_cast<unsigned>(target) > static_cast<unsigned>(program_size)) [[unlikely]] {
+        return {kBadJump, i};
+    }
+    i = target;
+    goto *code0[i];
+
+// Every way out spills the values still cached, the deeper one first
+end2:
+    operands.Push(t1);
+end1:
+    operands.Push(t0);
+end0:
+    return {kNoTrap, i};
+bad2:
+    operands.Push(t1);
+bad1:
+    operands.Push(t0);
+bad0:
+    return {kBadOpcode, i};
+bad_register2:
+    operands.Push(t1);
+bad_register1:
+    operands.Push(t0);
+bad_register:
+    return {kBadRegister, i};
+no_input2:
+    operands.Push(t1);
+no_input1:
+    operands.Push(t0);
+no_input:
+    return {kNoInput, i};
+bad_address2:
+    operands.Push(t1);
+bad_address1:
+    operands.Push(t0);
+bad_address:
+    return {kBadAddress, i};
+underflow:
+    return {kStackUnderflow, i};
+
+#undef CHECK_REGISTER
+#undef POP
+#undef JUMP
+#undef NEXT2
+#undef NEXT1
+#undef NEXT0
+#else
+    NoProfile profiler;
+    return RunSwitch(context, operands, in, out, profiler, 0);
+#endif
+}
+
+struct JitStreams {
+    InputBuffer *in;
+    OutputBuffer *out;
+};
+
+int JitReadValue(void *host, int *value) {
+    auto *streams = static_cast<JitStreams*>(host);
+    return streams->in->Read(*value);
+}
+
+void JitWriteValue(void *host, int value) {
+    static_cast<JitStreams*>(host)->out->Write(value);
+}
+
+RunResult Processor::RunJit(const JitProgram &jit, ExecutionContext &context, InputBuffer &in, OutputBuffer &out) const {
+    // Operand stack is kept between runs, so it moves to the native buffer and back
+    std::vector<int> &buffer = context.scratch;
+    TakeStack(context, buffer);
+    size_t depth = buffer.size();
+    buffer.resize(std::max<size_t>(JIT_STACK_SIZE, depth + std::max(program->MaxDepth(), 0)));
+    const void *returns[RETURN_STACK_SIZE];
+
+    JitStreams streams = {&in, &out};
+    JitState state;
+    std::copy(context.registers, context.registers + REGISTERS_SIZE, state.registers);
+    state.stack_base = buffer.data();
+    state.stack_top = buffer.data() + depth;
+    state.stack_limit = buffer.data() + buffer.size();
+    state.return_base = returns;
+    state.return_top = returns;
+    state.return_limit = returns + RETURN_STACK_SIZE;
+    state.host = &streams;
+    state.in = JitReadValue;
+    state.out = JitWriteValue;
+    state.memory = context.memory.Data();
+    state.memory_size = context.memory.Size();
+    state.pc = program->Size();
+    Trap trap = jit.Run(state);
+
+    std::copy(state.registers, state.registers + REGISTERS_SIZE, context.registers);
+    RestoreStack(context, state.stack_base, state.stack_top);
+    return {trap, state.pc};
+}
+
+RunResult Processor::RunIr(const IrProgram &ir, ExecutionContext &context, InputBuffer &in, OutputBuffer &out) const {
+    // The stack left by earlier runs stays out of the way, the program never reaches below it
+    std::vector<int> &buffer = context.scratch;
+    TakeStack(context, buffer);
+    size_t depth = buffer.size();
+    buffer.resize(depth + ir.ValuesCount());
+    int *v = buffer.data() + depth;
+    std::fill(v, v + ir.ValuesCount(), 0);
+    std::copy(context.registers, context.registers + REGISTERS_SIZE, v);
+    const Memory &memory = context.memory;
+    int *words = memory.Data();
+    int returns[RETURN_STACK_SIZE];
+    int return_depth = 0;
+    const IrInstruction *code = ir.Code().data();
+    const IrInstruction *stop;
+    Trap trap = kNoTrap;
+    int ip = 0;
+    for (;;) {
+        const IrInstruction &op = code[ip++];
+        switch (op.op) {
+            case kIrConst:
+                v[op.dst] = op.lhs;
+                break;
+            case kIrMove:
+                v[op.dst] = v[op.lhs];
+                break;
+            case kIrAdd:
+                v[op.dst] = static_cast<int>(static_cast<unsigned>(v[op.lhs]) + static_cast<unsigned>(v[op.rhs]));
+                break;
+            case kIrAddImm:
+                v[op.dst] = static_cast<int>(static_cast<unsigned>(v[op.lhs]) + static_cast<unsigned>(op.rhs));
+                break;
+            case kIrMul:
+                v[op.dst] = static_cast<int>(static_cast<unsigned>(v[op.lhs]) * static_cast<unsigned>(v[op.rhs]));
+                break;
+            case kIrMulImm:
+                v[op.dst] = static_cast<int>(static_cast<unsigned>(v[op.lhs]) * static_cast<unsigned>(op.rhs));
+                break;
+            case kIrMod:
+                if (v[op.rhs] == 0) [[unlikely]] {
+                    trap = kDivisionByZero;
+                    stop = &op;
+                    goto done;
+                }
+                v[op.dst] = Remainder(v[op.lhs], v[op.rhs]);
+                break;
+            case kIrModImm:
+                v[op.dst] = Remainder(v[op.lhs], op.rhs);
+                break;
+            case kIrLoad:
+                v[op.dst] = words[v[op.lhs]];
+                break;
+            case kIrLoadImm:
+                v[op.dst] = words[op.lhs];
+                break;
+            case kIrLoadChecked:
+                if (!memory.Contains(v[op.lhs])) [[unlikely]] {
+                    trap = kBadAddress;
+                    stop = &op;
+                    goto done;
+                }
+                v[op.dst] = words[v[op.lhs]];
+                break;
+            case kIrStore:
+                words[v[op.lhs]] = v[op.rhs];
+                break;
+            case kIrStoreImm:
+                words[op.lhs] = v[op.rhs];
                 break;
+            case kIrStoreChecked:
+                if (!memory.Contains(v[op.lhs])) [[unlikely]] {
+                    trap = kBadAddress;
+                    stop = &op;
+                    goto done;
+                }
+                words[v[op.lhs]] = v[op.rhs];
+                break;
+            case kIrIn:
+                if (!in.Read(v[op.dst])) [[unlikely]] {
+                    trap = kNoInput;
+                    stop = &op;
+                    goto done;
+                }
+                break;
+            case kIrOut:
+                out.Write(v[op.lhs]);
+                break;
+            case kIrJump:
+                ip = op.dst;
+                break;
+            case kIrBranchEq:
+            case kIrBranchNe:
+                if ((v[op.lhs] == v[op.rhs]) == (op.op == kIrBranchEq)) {
+                    ip = op.dst;
+                }
+                break;
+            case kIrBranchEqImm:
+            case kIrBranchNeImm:
+                if ((v[op.lhs] == op.rhs) == (op.op == kIrBranchEqImm)) {
+                    ip = op.dst;
+                }
+                break;
+            case kIrCall:
+                if (return_depth == RETURN_STACK_SIZE) [[unlikely]] {
+                    trap = kCallOverflow;
+                    stop = &op;
+                    goto done;
+                }
+                returns[return_depth++] = op.rhs;
+                ip = op.dst;
+                break;
+            case kIrRet:
+                if (return_depth == 0) [[unlikely]] {
+                    trap = kReturnWithoutCall;
+                    stop = &op;
+                    goto done;
+                }
+                ip = returns[--return_depth];
+                break;
+            case kIrEnd:
+                stop = &op;
+                goto done;
+            case kIrTrap:
+                trap = static_cast<Trap>(op.lhs);
+                stop = &op;
+                goto done;
         }
-        i++;
     }
+
+done:
+    std::copy(v, v + REGISTERS_SIZE, context.registers);
+    RestoreStack(context, buffer.data(), buffer.data() + depth);
+    RestoreStack(context, v + IrProgram::Slot(0), v + IrProgram::Slot(stop->depth));
+    return {trap, stop->pc};
 }
 
-Processor::~Processor() {
-    delete[] program;
+// Takes the cost of the block at i from gas, false if the gas does not cover it
+bool Processor::Pay(const int *gas_cost, uint64_t &gas, int i) {
+    if (gas_cost == nullptr) {
+        return true;
+    }
+    if (gas < static_cast<uint64_t>(gas_cost[i])) {
+        return false;
+    }
+    gas -= gas_cost[i];
+    return true;
+}
+
+// Stops the run in front of the block at i, so that a run with more gas resumes there
+RunResult Processor::OutOfGas(ExecutionContext &context, int i, const int *returns, int return_depth) {
+    context.pc = i;
+    context.returns.assign(returns, returns + return_depth);
+    return {kOutOfGas, i};
 }
 
-void Processor::Duplicate(int num) {
+// Pushes the top pair num times, drop_top leaves out the very last element (DUP_POP).
+// The pair is popped even if the count is too large for the stack.
+template <typename StackT>
+Trap Processor::Duplicate(StackT &operands, int num, bool drop_top) {
     int tmp1, tmp2;
-    assert(stack.Pop(tmp1));
-    assert(stack.Pop(tmp2));
+    if (!operands.Pop(tmp1) || !operands.Pop(tmp2)) {
+        return kStackUnderflow;
+    }
+    if (num > STACK_MAX_SIZE / 2) {
+        return kStackOverflow;
+    }
     while (--num >= 0) {
-        stack.Push(tmp2);
-        stack.Push(tmp1);
-    }
-}
-
-void Processor::GetMarks(std::istream &input) {
-    std::string temp;
-    int j = 0;
-    while (getline(input, temp, '\n')) {
-        j++;
-        size_t offset = temp.find(':');
-        if (offset == std::string::npos) {
-            offset = temp.find(' ');
-            while (offset != std::string::npos) {
-                j++;
-                offset = temp.find(' ', offset + 1);
-            }
-            continue;
+        operands.Push(tmp2);
+        if (num > 0 || !drop_top) {
+            operands.Push(tmp1);
         }
-        std::string value_str = temp.substr(offset);
-        assert(value_str == ":" && "unexpected operand for mark");
-        std::string cmd_str = temp.substr(0, offset);
-        marks[cmd_str] = j;
     }
+    return kNoTrap;
+}
+
+// Accepts either a precompiled image or a text program. A text program is assembled once,
+// its image is put into the cache keyed by the source hash and mapped on the next starts.
+// Null if the file can't be opened.
+std::shared_ptr<const Program> LoadProgram(const std::string &file_name, int size) {
+    Image image;
+    if (image.Map(file_name)) {
+        return std::make_shared<Program>(std::move(image));
+    }
+    std::ifstream file(file_name, std::ios::binary);
+    if (!file) {
+        return nullptr;
+    }
+    std::stringstream text;
+    text << file.rdbuf();
+    file.close();
+    std::string source = text.str();
+    uint64_t hash = HashSource(source);
+    std::string cached_path = CachedImagePath(hash);
+    if (image.Map(cached_path) && image.Header().source_hash == hash) {
+        return std::make_shared<Program>(std::move(image));
+    }
+    std::shared_ptr<Program> program = std::make_shared<Program>(std::string_view(source), size);
+    if (MakeDirs(ImageCacheDir())) {
+        program->SaveImage(cached_path, hash);
+    }
+    return program;
+}
+
+// Null if the file can't be opened
+std::unique_ptr<Processor> LoadProcessor(const std::string &file_name, int size, Engine engine = kDefaultEngine) {
+    std::shared_ptr<const Program> program = LoadProgram(file_name, size);
+    if (program == nullptr) {
+        return nullptr;
+    }
+    return std::unique_ptr<Processor>(new Processor(program, engine));
 }
 
 #endif //PROCESSOR_PROCESSOR_H
@@ -0,0 +1,170 @@
+#ifndef PROCESSOR_PROFILER_H
+#define PROCESSOR_PROFILER_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <istream>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "Commands.h"
+#include "Program.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PROCESSOR_HAS_RDTSC 1
+#else
+#define PROCESSOR_HAS_RDTSC 0
+#endif
+
+// Profilers are a template parameter of the engines, so a plain run instantiates them
+// with NoProfile and every hook compiles to nothing.
+struct NoProfile {
+    static const bool kEnabled = false;
+
+    void Step(int pc) { (void) pc; }
+    void Branch(int pc, bool taken) { (void) pc; (void) taken; }
+    void Finish() {}
+};
+
+// Counts executions of every offset and the outcomes of every conditional jump, and
+// charges the time between label changes to the label the program was in.
+// Profiles of several runs of the same program add up.
+class Profile {
+public:
+    static const bool kEnabled = true;
+
+    explicit Profile(const Program &program);
+
+    void Step(int pc);
+    void Branch(int pc, bool taken) { (taken ? taken_count : not_taken_count)[pc]++; }
+    // Charges the time since the last label change, called when a run stops
+    void Finish();
+
+    uint64_t Count(int pc) const { return counts[pc]; }
+    uint64_t Taken(int pc) const { return taken_count[pc]; }
+    uint64_t NotTaken(int pc) const { return not_taken_count[pc]; }
+    // Cycles (nanoseconds where there is no rdtsc) spent under the label, "(start)" is
+    // the code before the first one
+    uint64_t LabelCycles(const std::string &label) const;
+
+    // Source of the program with the execution count, taken/not taken jumps and label
+    // cycles next to every line. A group fused by the optimizer is reported on its last line.
+    void WriteListing(std::istream &source, std::ostream &out) const;
+    // One "name;label cycles" line per label, the folded stack format of flame graph tools
+    void WriteFolded(std::ostream &out, const std::string &name) const;
+
+private:
+    static uint64_t Now();
+
+    const Program &program;
+    std::vector<uint64_t> counts;
+    std::vector<uint64_t> taken_count;
+    std::vector<uint64_t> not_taken_count;
+    // Label names, label index of every offset, and the time charged to every label
+    std::vector<std::string> labels;
+    std::vector<int> label_of;
+    std::vector<uint64_t> cycles;
+    int current_label = -1;
+    uint64_t since = 0;
+};
+
+Profile::Profile(const Program &program)
+        : program(program), counts(program.Size() + 1), taken_count(program.Size() + 1),
+          not_taken_count(program.Size() + 1), label_of(program.Size() + 1, 0) {
+    labels.push_back("(start)");
+    std::vector<std::pair<int, std::string>> starts;
+    for (auto &mark : program.Marks()) {
+        starts.emplace_back(mark.second, mark.first);
+    }
+    std::sort(starts.begin(), starts.end());
+    for (auto &start : starts) {
+        if (start.first < 0 || start.first > program.Size()) {
+            continue;
+        }
+        labels.push_back(start.second);
+        std::fill(label_of.begin() + start.first, label_of.end(), static_cast<int>(labels.size()) - 1);
+    }
+    cycles.assign(labels.size(), 0);
+}
+
+uint64_t Profile::Now() {
+#if PROCESSOR_HAS_RDTSC
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+void Profile::Step(int pc) {
+    counts[pc]++;
+    int label = label_of[pc];
+    if (label != current_label) {
+        uint64_t now = Now();
+        if (current_label >= 0) {
+            cycles[current_label] += now - since;
+        }
+        current_label = label;
+        since = now;
+    }
+}
+
+void Profile::Finish() {
+    if (current_label >= 0) {
+        cycles[current_label] += Now() - since;
+    }
+    current_label = -1;
+}
+
+uint64_t Profile::LabelCycles(const std::string &label) const {
+    for (size_t k = 0; k < labels.size(); k++) {
+        if (labels[k] == label) {
+            return cycles[k];
+        }
+    }
+    return 0;
+}
+
+void Profile::WriteListing(std::istream &source, std::ostream &out) const {
+    const std::vector<int> &lines = program.Lines();
+    std::vector<std::string> text;
+    for (std::string line; getline(source, line, '\n');) {
+        text.push_back(line);
+    }
+    // Commands dropped or fused by the optimizer share the offset of the command after them,
+    // so the counters go to the last line of every offset
+    std::vector<int> owner(program.Size() + 1, -1);
+    for (size_t line = 0; line < text.size() && line < lines.size(); line++) {
+        bool label = !text[line].empty() && text[line].back() == ':';
+        if (!label && lines[line] >= 0 && lines[line] < program.Size()) {
+            owner[lines[line]] = line;
+        }
+    }
+    for (size_t line = 0; line < text.size(); line++) {
+        std::ostringstream count, branch;
+        if (!text[line].empty() && text[line].back() == ':') {
+            branch << LabelCycles(text[line].substr(0, text[line].size() - 1)) << " cyc";
+        } else if (line < lines.size() && lines[line] >= 0 && owner[lines[line]] == static_cast<int>(line)) {
+            int pc = lines[line];
+            count << counts[pc];
+            if (IsConditionalJump(program.Code()[pc])) {
+                branch << taken_count[pc] << "/" << not_taken_count[pc];
+            }
+        }
+        out << std::setw(12) << count.str() << " " << std::setw(20) << branch.str() << " | " << text[line] << "\n";
+    }
+}
+
+void Profile::WriteFolded(std::ostream &out, const std::string &name) const {
+    for (size_t k = 0; k < labels.size(); k++) {
+        if (cycles[k] != 0) {
+            out << name << ";" << labels[k] << " " << cycles[k] << "\n";
+        }
+    }
+}
+
+#endif //PROCESSOR_PROFILER_H
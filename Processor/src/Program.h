@@ -0,0 +1,230 @@
+#ifndef PROCESSOR_PROGRAM_H
+#define PROCESSOR_PROGRAM_H
+
+#include <algorithm>
+#include <cassert>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "Assembler.h"
+#include "Commands.h"
+#include "Compact.h"
+#include "Image.h"
+#include "Ir.h"
+#include "Jit.h"
+#include "Ssa.h"
+#include "Verifier.h"
+
+// Assembled code with its labels. It never changes after construction, so a single
+// Program is shared by any number of runs, including runs on different threads.
+class Program {
+public:
+    // Size is the expected number of code words, longer programs are fine
+    Program(std::istream &input, int size, bool optimize = true);
+    // Text that is in memory already, assembled on all cores
+    Program(std::string_view text, int size, bool optimize = true);
+    explicit Program(Image image);
+    // Code that is assembled already, it is not optimized again
+    Program(std::vector<int> code, std::map<std::string, int> marks, std::vector<int> lines);
+    Program(const Program &other) = delete;
+    Program &operator=(const Program &other) = delete;
+
+    const int *Code() const { return program; }
+    int Size() const { return program_size; }
+    const std::map<std::string, int> &Marks() const { return marks; }
+    // Offset of the code of every source line, empty for programs loaded from an image
+    const std::vector<int> &Lines() const { return lines; }
+    bool SaveImage(const std::string &path, uint64_t source_hash) const;
+    // Hash of the code words, ties snapshots to the code they were taken from
+    uint64_t Hash() const { return HashBytes(program, program_size * sizeof(int)); }
+
+    // Peak stack depth proven by StackVerifier, -1 if the proof failed
+    int MaxDepth() const { return max_depth; }
+    bool IsVerified() const { return max_depth >= 0; }
+    // Stack depth before every offset of a proven program, -1 for unreachable ones
+    const std::vector<int> &Depths() const { return depth_at; }
+    // Offsets where linear decoding finds a command, and where that decoding stops
+    // on a bad opcode or a truncated command
+    bool IsBoundary(int offset) const { return boundary[offset]; }
+    int DecodedSize() const { return decoded_size; }
+    bool UsesMemory() const { return uses_memory; }
+    // Memory commands whose address RangeAnalysis proved to be below MemoryExtent(). Runs
+    // with at least that much memory skip their bounds checks.
+    bool IsProvenAccess(int offset) const { return !proven_access.empty() && proven_access[offset]; }
+    int MemoryExtent() const { return memory_extent; }
+    // Gas a run pays when it enters the code at an offset: a unit for every command up to the
+    // next jump, RET or END, HLT is free. Offsets inside commands and past the decoded code cost nothing.
+    const std::vector<int> &GasCosts() const { return gas_cost; }
+
+    // Native code, compiled on the first call. Null if there is no JIT for this platform.
+    const JitProgram *Jit() const;
+    // Register form, translated on the first call. Null if the program has no stack proof.
+    const IrProgram *Ir() const;
+    // Byte encoding, made on the first call. Null if the code jumps to no command or ends
+    // in a bad one.
+    const CompactProgram *Compact() const;
+    // Handler addresses of the threaded engine indexed by program offset, built once per
+    // handler table. Offsets that are not command boundaries get bad, the end of the code gets end.
+    // Proven memory accesses get their handler from the proven table if there is one.
+    const void *const *ThreadedCode(const void *const *handlers, const void *const *proven,
+                                    const void *bad, const void *end) const;
+
+private:
+    void Verify();
+
+    // Assembled code, or the code of the mapped image
+    std::vector<int> code;
+    const int *program;
+    std::map<std::string, int> marks;
+    std::vector<int> lines;
+    int program_size;
+    Image image;
+    int max_depth;
+    std::vector<int> depth_at;
+    std::vector<bool> boundary;
+    int decoded_size;
+    bool uses_memory;
+    std::vector<bool> proven_access;
+    int memory_extent = 0;
+    std::vector<int> gas_cost;
+
+    // Caches filled on demand by concurrent runs
+    mutable std::mutex mutex;
+    mutable std::map<std::pair<const void *const *, const void *const *>, std::vector<const void*>> threaded_code;
+    mutable std::unique_ptr<JitProgram> jit;
+    mutable std::unique_ptr<IrProgram> ir;
+    mutable std::unique_ptr<CompactProgram> compact;
+};
+
+Program::Program(std::istream &input, int size, bool optimize) {
+    // At least one word, so that even an empty program has an address
+    Assembler assembler(std::max(size, 1));
+    assembler.Assemble(input);
+    code.swap(assembler.Code());
+    marks.swap(assembler.Marks());
+    lines.swap(assembler.Lines());
+    if (optimize) {
+        Optimize(code, marks, &lines);
+    }
+    program = code.data();
+    program_size = code.size();
+    Verify();
+}
+
+Program::Program(std::string_view text, int size, bool optimize) {
+    ParallelAssembler assembler(std::max(size, 1));
+    assembler.Assemble(text);
+    code.swap(assembler.Code());
+    marks.swap(assembler.Marks());
+    lines.swap(assembler.Lines());
+    if (optimize) {
+        Optimize(code, marks, &lines);
+    }
+    program = code.data();
+    program_size = code.size();
+    Verify();
+}
+
+Program::Program(std::vector<int> code, std::map<std::string, int> marks, std::vector<int> lines)
+        : code(std::move(code)), marks(std::move(marks)), lines(std::move(lines)) {
+    // At least one word, so that even an empty program has an address
+    this->code.reserve(1);
+    program = this->code.data();
+    program_size = this->code.size();
+    Verify();
+}
+
+Program::Program(Image image) : image(std::move(image)) {
+    assert(this->image.IsMapped() && "image should be mapped");
+    program = this->image.Code();
+    program_size = this->image.Header().code_size;
+    this->image.ReadMarks(marks);
+    Verify();
+}
+
+void Program::Verify() {
+    StackVerifier verifier(program, program_size);
+    max_depth = verifier.Verify() ? verifier.MaxDepth() : -1;
+    if (IsVerified()) {
+        depth_at = verifier.Depths();
+        RangeAnalysis ranges(program, program_size, depth_at, verifier.ReturnSites());
+        ranges.Run();
+        proven_access = ranges.Proven();
+        memory_extent = ranges.Extent();
+    }
+
+    boundary.assign(program_size + 1, false);
+    decoded_size = 0;
+    uses_memory = false;
+    while (decoded_size < program_size && IsCommand(program[decoded_size]) &&
+           decoded_size + kCommandLength[program[decoded_size]] <= program_size) {
+        boundary[decoded_size] = true;
+        uses_memory = uses_memory || IsMemoryAccess(program[decoded_size]);
+        decoded_size += kCommandLength[program[decoded_size]];
+    }
+    boundary[program_size] = true;
+
+    // Every block ends in a jump, RET or END, so the costs add up from the back
+    gas_cost.assign(program_size + 1, 0);
+    std::vector<int> starts;
+    for (int i = 0; i < decoded_size; i += kCommandLength[program[i]]) {
+        starts.push_back(i);
+    }
+    for (auto it = starts.rbegin(); it != starts.rend(); ++it) {
+        int cmd = program[*it];
+        bool last = JumpOperand(cmd) != 0 || cmd == RET || cmd == END;
+        gas_cost[*it] = (cmd == HLT ? 0 : 1) + (last ? 0 : gas_cost[*it + kCommandLength[cmd]]);
+    }
+}
+
+bool Program::SaveImage(const std::string &path, uint64_t source_hash) const {
+    return Image::Write(path, source_hash, marks, program, program_size);
+}
+
+const JitProgram *Program::Jit() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!jit) {
+        // Checks of the stack bounds are left out of the native code when they are proven
+        jit.reset(new JitProgram(program, program_size, !IsVerified(), proven_access));
+    }
+    return jit->IsCompiled() ? jit.get() : nullptr;
+}
+
+const IrProgram *Program::Ir() const {
+    if (!IsVerified()) {
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!ir) {
+        ir.reset(new IrProgram(program, program_size, depth_at, max_depth, proven_access));
+    }
+    return ir.get();
+}
+
+const CompactProgram *Program::Compact() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!compact) {
+        compact.reset(new CompactProgram(program, program_size));
+    }
+    return compact->IsEncoded() ? compact.get() : nullptr;
+}
+
+const void *const *Program::ThreadedCode(const void *const *handlers, const void *const *proven,
+                                         const void *bad, const void *end) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<const void*> &code = threaded_code[{handlers, proven}];
+    if (code.empty()) {
+        code.assign(program_size + 1, bad);
+        for (int j = 0; j < decoded_size; j += kCommandLength[program[j]]) {
+            code[j] = proven != nullptr && IsProvenAccess(j) ? proven[program[j]] : handlers[program[j]];
+        }
+        // Falling off the end of the program or jumping to a trailing mark stops it
+        code[program_size] = end;
+    }
+    return code.data();
+}
+
+#endif //PROCESSOR_PROGRAM_H
@@ -0,0 +1,461 @@
+#ifndef PROCESSOR_SCHEDULER_H
+#define PROCESSOR_SCHEDULER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "Commands.h"
+#include "Memory.h"
+#include "Program.h"
+#include "Trap.h"
+
+// Deepest operand stack of a fiber
+#define FIBER_STACK_SIZE (1 << 20)
+
+// Green thread: a run of a shared program that can stop after any command and go on later,
+// possibly on another worker. Everything but the vectors is inline, so an idle fiber costs
+// a few hundred bytes.
+struct Fiber {
+    explicit Fiber(std::shared_ptr<const Program> program) : program(std::move(program)), registers() {}
+
+    std::shared_ptr<const Program> program;
+    int registers[REGISTERS_SIZE];
+    int pc = 0;
+    std::vector<int> stack;
+    std::vector<int> returns;
+    Memory memory;
+    // Input being read, owned by the worker that runs the fiber
+    std::vector<int> input;
+    size_t input_position = 0;
+
+    // Shared with the threads that feed and watch the fiber
+    std::mutex mutex;
+    std::vector<int> pending;
+    std::vector<int> output;
+    bool closed = false;
+    bool blocked = false;
+    std::atomic<bool> finished{false};
+    RunResult result = {kNoTrap, 0};
+};
+
+// Runs any number of fibers on a fixed pool of worker threads. A fiber runs until its
+// quantum of commands is used up, then goes to the back of the queue of its worker. IN
+// without input parks the fiber until Feed brings some. A worker without fibers steals
+// from the back of the other queues before it goes to sleep.
+class Scheduler {
+public:
+    // All cores if workers is 0
+    explicit Scheduler(int workers = 0, int quantum = 1 << 12, int memory_size = DEFAULT_MEMORY_SIZE);
+    ~Scheduler();
+    Scheduler(const Scheduler &other) = delete;
+    Scheduler &operator=(const Scheduler &other) = delete;
+
+    // Starts a fiber with clean registers and stack, returns its id
+    int Spawn(std::shared_ptr<const Program> program);
+    void Feed(int id, int value) { Feed(id, std::vector<int>(1, value)); }
+    void Feed(int id, const std::vector<int> &values);
+    // No more input, IN traps with kNoInput once the fed values are read
+    void CloseInput(int id);
+    // Blocks until the fiber ends. A fiber that waits for input never ends while its input is open.
+    RunResult Wait(int id);
+    // Values written so far, each of them is taken once
+    std::vector<int> TakeOutput(int id);
+
+private:
+    enum Status {
+        kYield, kBlocked, kDone
+    };
+
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<Fiber*> fibers;
+    };
+
+    Fiber &Get(int id);
+    void Enqueue(Fiber *fiber, int queue);
+    Fiber *Take(int worker);
+    void Work(int worker);
+    Status Slice(Fiber &fiber, std::vector<int> &output) const;
+    // Hands the output over and refills the input, false if there is none. A parked fiber may
+    // be resumed by another worker as soon as the lock is released.
+    static bool Refill(Fiber &fiber, std::vector<int> &output, bool &parked);
+    static Status Finish(Fiber &fiber, Trap trap, int pc);
+
+    int quantum;
+    int memory_size;
+    std::vector<std::unique_ptr<WorkQueue>> queues;
+    std::vector<std::thread> workers;
+    // Fibers never move, so workers keep plain pointers to them
+    std::deque<Fiber> fibers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    std::atomic<int> runnable{0};
+    std::atomic<unsigned> next_queue{0};
+    bool stopping = false;
+};
+
+Scheduler::Scheduler(int workers, int quantum, int memory_size) : quantum(std::max(quantum, 1)), memory_size(memory_size) {
+    if (workers <= 0) {
+        workers = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (int w = 0; w < workers; w++) {
+        queues.emplace_back(new WorkQueue());
+    }
+    for (int w = 0; w < workers; w++) {
+        this->workers.emplace_back(&Scheduler::Work, this, w);
+    }
+}
+
+// Fibers that did not end are dropped
+Scheduler::~Scheduler() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+}
+
+Fiber &Scheduler::Get(int id) {
+    std::lock_guard<std::mutex> lock(mutex);
+    assert(id >= 0 && static_cast<size_t>(id) < fibers.size() && "unknown fiber");
+    return fibers[id];
+}
+
+int Scheduler::Spawn(std::shared_ptr<const Program> program) {
+    Fiber *fiber;
+    int id;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        id = fibers.size();
+        fibers.emplace_back(std::move(program));
+        fiber = &fibers.back();
+    }
+    if (fiber->program->IsVerified()) {
+        fiber->stack.reserve(fiber->program->MaxDepth());
+    }
+    if (fiber->program->UsesMemory()) {
+        fiber->memory = Memory(memory_size);
+    }
+    Enqueue(fiber, next_queue++ % queues.size());
+    return id;
+}
+
+void Scheduler::Feed(int id, const std::vector<int> &values) {
+    Fiber &fiber = Get(id);
+    bool resume;
+    {
+        std::lock_guard<std::mutex> lock(fiber.mutex);
+        assert(!fiber.closed && "input is closed");
+        fiber.pending.insert(fiber.pending.end(), values.begin(), values.end());
+        resume = fiber.blocked;
+        fiber.blocked = false;
+    }
+    if (resume) {
+        Enqueue(&fiber, next_queue++ % queues.size());
+    }
+}
+
+void Scheduler::CloseInput(int id) {
+    Fiber &fiber = Get(id);
+    bool resume;
+    {
+        std::lock_guard<std::mutex> lock(fiber.mutex);
+        fiber.closed = true;
+        resume = fiber.blocked;
+        fiber.blocked = false;
+    }
+    if (resume) {
+        Enqueue(&fiber, next_queue++ % queues.size());
+    }
+}
+
+RunResult Scheduler::Wait(int id) {
+    Fiber &fiber = Get(id);
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [&]() { return fiber.finished.load(); });
+    return fiber.result;
+}
+
+std::vector<int> Scheduler::TakeOutput(int id) {
+    Fiber &fiber = Get(id);
+    std::lock_guard<std::mutex> lock(fiber.mutex);
+    std::vector<int> output;
+    output.swap(fiber.output);
+    return output;
+}
+
+void Scheduler::Enqueue(Fiber *fiber, int queue) {
+    {
+        std::lock_guard<std::mutex> lock(queues[queue]->mutex);
+        queues[queue]->fibers.push_back(fiber);
+    }
+    runnable++;
+    // Taking the lock orders the wake up after the check of a worker going to sleep
+    std::lock_guard<std::mutex> lock(mutex);
+    wake.notify_one();
+}
+
+Fiber *Scheduler::Take(int worker) {
+    for (size_t k = 0; k < queues.size(); k++) {
+        WorkQueue &queue = *queues[(worker + k) % queues.size()];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.fibers.empty()) {
+            continue;
+        }
+        Fiber *fiber;
+        // The owner goes round robin from the front, thieves take the most recent fiber
+        if (k == 0) {
+            fiber = queue.fibers.front();
+            queue.fibers.pop_front();
+        } else {
+            fiber = queue.fibers.back();
+            queue.fibers.pop_back();
+        }
+        runnable--;
+        return fiber;
+    }
+    return nullptr;
+}
+
+void Scheduler::Work(int worker) {
+    std::vector<int> output;
+    for (;;) {
+        Fiber *fiber = Take(worker);
+        if (fiber == nullptr) {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&]() { return stopping || runnable > 0; });
+            if (stopping) {
+                return;
+            }
+            continue;
+        }
+        Status status = Slice(*fiber, output);
+        if (!output.empty()) {
+            std::lock_guard<std::mutex> lock(fiber->mutex);
+            fiber->output.insert(fiber->output.end(), output.begin(), output.end());
+            output.clear();
+        }
+        if (status == kYield) {
+            // Wakes a sleeping worker too, which steals the fiber if this one has others to run
+            Enqueue(fiber, worker);
+        } else if (status == kDone) {
+            std::lock_guard<std::mutex> lock(mutex);
+            fiber->finished = true;
+            done.notify_all();
+        }
+    }
+}
+
+bool Scheduler::Refill(Fiber &fiber, std::vector<int> &output, bool &parked) {
+    std::lock_guard<std::mutex> lock(fiber.mutex);
+    fiber.output.insert(fiber.output.end(), output.begin(), output.end());
+    output.clear();
+    if (fiber.pending.empty()) {
+        parked = fiber.blocked = !fiber.closed;
+        return false;
+    }
+    fiber.input.clear();
+    fiber.input.swap(fiber.pending);
+    fiber.input_position = 0;
+    return true;
+}
+
+Scheduler::Status Scheduler::Finish(Fiber &fiber, Trap trap, int pc) {
+    fiber.pc = pc;
+    fiber.result = {trap, pc};
+    return kDone;
+}
+
+// The checked switch engine, stopping after the quantum with everything it needs to go on
+// in the fiber. Code is shared, every fiber reads the same words.
+Scheduler::Status Scheduler::Slice(Fiber &fiber, std::vector<int> &output) const {
+    const Program &program = *fiber.program;
+    const int *code = program.Code();
+    int size = program.Size();
+    int decoded_size = program.DecodedSize();
+    int *registers = fiber.registers;
+    std::vector<int> &stack = fiber.stack;
+    std::vector<int> &returns = fiber.returns;
+    const Memory &memory = fiber.memory;
+    int tmp1;
+    int tmp2;
+    int target;
+    int i = fiber.pc;
+    for (int budget = quantum; budget > 0; budget--) {
+        if (i >= decoded_size) {
+            return Finish(fiber, i < size ? kBadOpcode : kNoTrap, i);
+        }
+        int cmd = code[i];
+        int operand = kCommandLength[cmd] > 1 ? code[i + 1] : 0;
+        bool register_operand = cmd == PUSHR || cmd == POPR || cmd == MOV || cmd == MOVD || cmd == LOADR ||
+                                cmd == STORER;
+        if (register_operand && (!IsRegister(operand) || (cmd == MOV && !IsRegister(code[i + 2])))) {
+            return Finish(fiber, kBadRegister, i);
+        }
+        // Everything that pops checks its operands up front
+        size_t needs = cmd == POP || cmd == POPR || cmd == OUT || cmd == STORE || cmd == STORER ||
+                       cmd == PUSH_JE || cmd == PUSH_JNE || cmd == PUSH_ADD || cmd == PUSH_MUL ? 1 :
+                       cmd == DUP || cmd == DUP_POP || cmd == SWP || cmd == MUL || cmd == ADD || cmd == MOD ||
+                       cmd == JE || cmd == JNE ? 2 : cmd == POP_SWP ? 3 : 0;
+        if (stack.size() < needs) {
+            return Finish(fiber, kStackUnderflow, i);
+        }
+        int64_t grows = cmd == PUSH || cmd == PUSHR || cmd == IN || cmd == LOAD || cmd == LOADR ? 1 :
+                        cmd == DUP || cmd == DUP_POP ? 2 * static_cast<int64_t>(operand) - 2 : 0;
+        if (static_cast<int64_t>(stack.size()) + grows > FIBER_STACK_SIZE) {
+            return Finish(fiber, kStackOverflow, i);
+        }
+        switch (cmd) {
+            case PUSH:
+                stack.push_back(operand);
+                break;
+            case PUSHR:
+                stack.push_back(registers[operand]);
+                break;
+            case POP:
+                stack.pop_back();
+                break;
+            case POPR:
+                registers[operand] = stack.back();
+                stack.pop_back();
+                break;
+            case DUP:
+            case DUP_POP: {
+                tmp1 = stack.back();
+                tmp2 = stack[stack.size() - 2];
+                stack.resize(stack.size() - 2);
+                for (int k = operand; --k >= 0;) {
+                    stack.push_back(tmp2);
+                    if (k > 0 || cmd == DUP) {
+                        stack.push_back(tmp1);
+                    }
+                }
+                break;
+            }
+            case SWP:
+            case POP_SWP:
+                if (cmd == POP_SWP) {
+                    stack.pop_back();
+                }
+                std::swap(stack.back(), stack[stack.size() - 2]);
+                break;
+            case MOV:
+                registers[operand] = registers[code[i + 2]];
+                break;
+            case MOVD:
+                registers[operand] = code[i + 2];
+                break;
+            case IN:
+                if (fiber.input_position == fiber.input.size()) {
+                    bool parked;
+                    fiber.pc = i;
+                    if (!Refill(fiber, output, parked)) {
+                        return parked ? kBlocked : Finish(fiber, kNoInput, i);
+                    }
+                }
+                stack.push_back(fiber.input[fiber.input_position++]);
+                break;
+            case OUT:
+                output.push_back(stack.back());
+                stack.pop_back();
+                break;
+            case MUL:
+            case ADD:
+            case MOD:
+                tmp1 = stack.back();
+                stack.pop_back();
+                tmp2 = stack.back();
+                if (cmd == MOD && tmp1 == 0) {
+                    return Finish(fiber, kDivisionByZero, i);
+                }
+                stack.back() = cmd == MOD ? Remainder(tmp2, tmp1) : static_cast<int>(
+                        cmd == MUL ? static_cast<unsigned>(tmp1) * static_cast<unsigned>(tmp2)
+                                   : static_cast<unsigned>(tmp1) + static_cast<unsigned>(tmp2));
+                break;
+            case PUSH_ADD:
+            case PUSH_MUL:
+                tmp1 = stack.back();
+                stack.back() = static_cast<int>(
+                        cmd == PUSH_MUL ? static_cast<unsigned>(tmp1) * static_cast<unsigned>(operand)
+                                        : static_cast<unsigned>(tmp1) + static_cast<unsigned>(operand));
+                break;
+            case LOAD:
+            case LOADR:
+            case STORE:
+            case STORER:
+                tmp1 = cmd == LOAD || cmd == STORE ? operand : registers[operand];
+                if (!memory.Contains(tmp1)) {
+                    return Finish(fiber, kBadAddress, i);
+                }
+                if (cmd == LOAD || cmd == LOADR) {
+                    stack.push_back(memory.Data()[tmp1]);
+                } else {
+                    memory.Data()[tmp1] = stack.back();
+                    stack.pop_back();
+                }
+                break;
+            case CALL:
+                if (returns.size() == RETURN_STACK_SIZE) {
+                    return Finish(fiber, kCallOverflow, i);
+                }
+                returns.push_back(i + kCommandLength[CALL]);
+                break;
+            case RET:
+                if (returns.empty()) {
+                    return Finish(fiber, kReturnWithoutCall, i);
+                }
+                i = returns.back();
+                returns.pop_back();
+                continue;
+            case END:
+                return Finish(fiber, kNoTrap, i);
+            case HLT:
+            case JMP:
+            case JE:
+            case JNE:
+            case PUSH_JE:
+            case PUSH_JNE:
+                break;
+            default:
+                return Finish(fiber, kBadOpcode, i);
+        }
+        int jump = JumpOperand(cmd);
+        bool taken = cmd == JMP || cmd == CALL;
+        if (cmd == JE || cmd == JNE) {
+            tmp1 = stack.back();
+            tmp2 = stack[stack.size() - 2];
+            stack.resize(stack.size() - 2);
+            taken = (tmp1 == tmp2) == (cmd == JE);
+        } else if (cmd == PUSH_JE || cmd == PUSH_JNE) {
+            taken = (stack.back() == operand) == (cmd == PUSH_JE);
+            stack.pop_back();
+        }
+        if (!taken) {
+            i += kCommandLength[cmd];
+            continue;
+        }
+        target = code[i + jump];
+        if (static_cast<unsigned>(target) > static_cast<unsigned>(size)) {
+            return Finish(fiber, kBadJump, i);
+        }
+        if (!program.IsBoundary(target)) {
+            return Finish(fiber, kBadOpcode, target);
+        }
+        i = target;
+    }
+    fiber.pc = i;
+    return kYield;
+}
+
+#endif //PROCESSOR_SCHEDULER_H
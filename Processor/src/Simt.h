@@ -0,0 +1,382 @@
+#ifndef PROCESSOR_SIMT_H
+#define PROCESSOR_SIMT_H
+
+#include <algorithm>
+#include <cassert>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <vector>
+#include "Commands.h"
+#include "Io.h"
+#include "Program.h"
+#include "Trap.h"
+
+// Vector with the value in every lane, and a lane by lane choice by a mask of 0 and -1
+#define SPLAT(value) (Lanes{} + (value))
+#define SELECT(mask, yes, no) ((mask) ? (yes) : (no))
+// Pc of every lane, or a single pc shared by all running lanes
+#define PCS (converged ? SELECT(running, SPLAT(shared_pc), SPLAT(kDone)) : pcs)
+// Stores the values of the lanes in mask. In a converged step the other lanes have stopped,
+// so nothing of theirs is left to keep.
+#define PUT(destination, value) destination = converged ? (value) : SELECT(mask, (value), destination)
+
+// GCC drops vector_size on a dependent type, so every width gets its own specialization
+template <int kLanes>
+struct LaneVectors;
+
+template <>
+struct LaneVectors<8> {
+    typedef int Signed __attribute__((vector_size(32)));
+    typedef unsigned Unsigned __attribute__((vector_size(32)));
+};
+
+template <>
+struct LaneVectors<16> {
+    typedef int Signed __attribute__((vector_size(64)));
+    typedef unsigned Unsigned __attribute__((vector_size(64)));
+};
+
+// Runs one proven program over kLanes inputs in lockstep. Every register and stack slot
+// holds a vector with a value per lane, so ADD, MUL, moves and comparisons are single
+// vector operations (AVX2 when the build targets it, SSE pairs otherwise).
+//
+// Lanes that disagree on JE/JNE split up: every step runs the lanes with the lowest pc
+// under a mask and the others wait, until they meet again at a common pc. Verification
+// guarantees that the stack depth depends only on the pc, so the lanes of one step
+// always see the same stack layout. Return stacks are per lane, the nesting of calls
+// may differ between lanes that share a step.
+template <int kLanes>
+class SimtEngine {
+public:
+    typedef typename LaneVectors<kLanes>::Signed Lanes;
+    typedef typename LaneVectors<kLanes>::Unsigned UnsignedLanes;
+
+    explicit SimtEngine(const Program &program);
+
+    // Runs up to kLanes inputs, results[k] receives the outcome of inputs[k]
+    void Run(std::istream *const *inputs, std::ostream *const *outputs, int count, RunResult *results);
+
+private:
+    // Program counter of a lane that has stopped
+    static const int kDone = INT_MAX;
+
+    // Vectors are never passed by value, without AVX enabled that would change the calling convention
+    static bool IsEmpty(const Lanes &mask);
+    static bool IsSame(const Lanes &lhs, const Lanes &rhs);
+    // Picks the lanes that run the next step, false if none is left
+    bool NextStep(int &pc, Lanes &mask);
+    // Moves the lanes in mask to target where taken is set and to next elsewhere
+    void Branch(const Lanes &mask, const Lanes &taken, int target, int next);
+    void Stop(const Lanes &mask, Trap trap, int pc);
+
+    const Program &program;
+    std::vector<Lanes> stack;
+    Lanes registers[REGISTERS_SIZE];
+    std::vector<Lanes> returns;
+    Lanes return_depth;
+    std::vector<std::unique_ptr<InputBuffer>> inputs;
+    std::vector<std::unique_ptr<OutputBuffer>> outputs;
+    RunResult *results;
+
+    Lanes running;
+    Lanes pcs;
+    bool converged;
+    int shared_pc;
+};
+
+template <int kLanes>
+SimtEngine<kLanes>::SimtEngine(const Program &program)
+        : program(program), stack(program.MaxDepth() + 1), returns(RETURN_STACK_SIZE) {
+    assert(program.IsVerified() && "lanes run only proven programs");
+}
+
+template <int kLanes>
+bool SimtEngine<kLanes>::IsEmpty(const Lanes &mask) {
+    // Wide words reduce to a single vector test instead of a lane by lane loop
+    uint64_t words[kLanes / 2];
+    memcpy(words, &mask, sizeof(words));
+    uint64_t any = 0;
+    for (int w = 0; w < kLanes / 2; w++) {
+        any |= words[w];
+    }
+    return any == 0;
+}
+
+template <int kLanes>
+bool SimtEngine<kLanes>::IsSame(const Lanes &lhs, const Lanes &rhs) {
+    return IsEmpty(lhs != rhs);
+}
+
+template <int kLanes>
+bool SimtEngine<kLanes>::NextStep(int &pc, Lanes &mask) {
+    // Converged steps always have a running lane, Stop leaves that mode with the last one
+    if (converged) {
+        pc = shared_pc;
+        mask = running;
+        return true;
+    }
+    pc = kDone;
+    for (int l = 0; l < kLanes; l++) {
+        pc = std::min(pc, pcs[l]);
+    }
+    if (pc == kDone) {
+        return false;
+    }
+    mask = pcs == pc;
+    if (IsSame(mask, running)) {
+        converged = true;
+        shared_pc = pc;
+    }
+    return true;
+}
+
+template <int kLanes>
+void SimtEngine<kLanes>::Branch(const Lanes &mask, const Lanes &taken, int target, int next) {
+    Lanes active = taken & mask;
+    // A branch that all lanes of a converged step agree on keeps them together
+    if (converged && IsEmpty(active)) {
+        shared_pc = next;
+        return;
+    }
+    if (converged && IsSame(active, mask)) {
+        shared_pc = target;
+        return;
+    }
+    pcs = SELECT(mask, SELECT(taken, SPLAT(target), SPLAT(next)), PCS);
+    converged = false;
+}
+
+template <int kLanes>
+void SimtEngine<kLanes>::Stop(const Lanes &mask, Trap trap, int pc) {
+    for (int l = 0; l < kLanes; l++) {
+        if (mask[l] != 0) {
+            results[l] = {trap, pc};
+        }
+    }
+    pcs = SELECT(mask, SPLAT(kDone), PCS);
+    running &= ~mask;
+    converged = converged && !IsEmpty(running);
+}
+
+template <int kLanes>
+void SimtEngine<kLanes>::Run(std::istream *const *in, std::ostream *const *out, int count, RunResult *results) {
+    assert(count <= kLanes && "too many inputs for the lanes");
+    this->results = results;
+    inputs.clear();
+    outputs.clear();
+    for (int l = 0; l < count; l++) {
+        inputs.emplace_back(new InputBuffer(in[l]));
+        outputs.emplace_back(new OutputBuffer(*out[l], false));
+    }
+    for (int r = 0; r < REGISTERS_SIZE; r++) {
+        registers[r] = SPLAT(0);
+    }
+    return_depth = SPLAT(0);
+    for (int l = 0; l < kLanes; l++) {
+        running[l] = l < count ? -1 : 0;
+    }
+    converged = true;
+    shared_pc = 0;
+
+    const int *code = program.Code();
+    int size = program.Size();
+    Lanes *slots = stack.data();
+    const int *depths = &program.Depths()[0];
+    int pc;
+    Lanes mask;
+    while (NextStep(pc, mask)) {
+        if (pc >= size) {
+            Stop(mask, kNoTrap, pc);
+            continue;
+        }
+        int cmd = code[pc];
+        int next = pc + kCommandLength[cmd];
+        // Stack top of every lane in this step
+        Lanes *top = slots + depths[pc];
+        Lanes lhs, rhs, taken;
+        switch (cmd) {
+            case PUSH:
+                PUT(top[0], SPLAT(code[pc + 1]));
+                break;
+            case PUSHR:
+            case POPR:
+            case MOVD:
+                if (!IsRegister(code[pc + 1])) [[unlikely]] {
+                    Stop(mask, kBadRegister, pc);
+                    continue;
+                }
+                if (cmd == PUSHR) {
+                    PUT(top[0], registers[code[pc + 1]]);
+                } else {
+                    Lanes value = cmd == POPR ? top[-1] : SPLAT(code[pc + 2]);
+                    PUT(registers[code[pc + 1]], value);
+                }
+                break;
+            case MOV:
+                if (!IsRegister(code[pc + 1]) || !IsRegister(code[pc + 2])) [[unlikely]] {
+                    Stop(mask, kBadRegister, pc);
+                    continue;
+                }
+                PUT(registers[code[pc + 1]], registers[code[pc + 2]]);
+                break;
+            case DUP:
+            case DUP_POP: {
+                lhs = top[-2];
+                rhs = top[-1];
+                // The proof keeps the count within STACK_MAX_SIZE
+                int64_t pushed = 2 * static_cast<int64_t>(code[pc + 1]) - (cmd == DUP_POP ? 1 : 0);
+                for (int k = 0; k < pushed; k++) {
+                    PUT(top[k - 2], k % 2 == 0 ? lhs : rhs);
+                }
+                break;
+            }
+            case SWP:
+            case POP_SWP: {
+                Lanes *pair = cmd == SWP ? top - 2 : top - 3;
+                lhs = pair[0];
+                PUT(pair[0], pair[1]);
+                PUT(pair[1], lhs);
+                break;
+            }
+            case IN:
+                for (int l = 0; l < kLanes; l++) {
+                    int value;
+                    if (mask[l] == 0) {
+                        continue;
+                    }
+                    if (!inputs[l]->Read(value)) [[unlikely]] {
+                        Lanes lane = SPLAT(0);
+                        lane[l] = -1;
+                        Stop(lane, kNoInput, pc);
+                        mask[l] = 0;
+                        continue;
+                    }
+                    top[0][l] = value;
+                }
+                break;
+            case OUT:
+                for (int l = 0; l < kLanes; l++) {
+                    if (mask[l] != 0) {
+                        outputs[l]->Write(top[-1][l]);
+                    }
+                }
+                break;
+            case ADD:
+            case MUL:
+            case PUSH_ADD:
+            case PUSH_MUL: {
+                // Unsigned lanes give the wrap around of the scalar engines without UB
+                bool immediate = cmd == PUSH_ADD || cmd == PUSH_MUL;
+                Lanes *result = immediate ? top - 1 : top - 2;
+                UnsignedLanes a = (UnsignedLanes) result[0];
+                UnsignedLanes b = (UnsignedLanes) (immediate ? SPLAT(code[pc + 1]) : top[-1]);
+                Lanes value = (Lanes) (cmd == ADD || cmd == PUSH_ADD ? a + b : a * b);
+                PUT(result[0], value);
+                break;
+            }
+            case MOD: {
+                // AVX2 has no integer division, remainders are taken lane by lane
+                Lanes failed = SPLAT(0);
+                lhs = top[-2];
+                for (int l = 0; l < kLanes; l++) {
+                    if (mask[l] == 0) {
+                        continue;
+                    }
+                    if (top[-1][l] == 0) [[unlikely]] {
+                        failed[l] = -1;
+                        continue;
+                    }
+                    lhs[l] = Remainder(top[-2][l], top[-1][l]);
+                }
+                top[-2] = lhs;
+                if (!IsEmpty(failed)) [[unlikely]] {
+                    Stop(failed, kDivisionByZero, pc);
+                    mask &= ~failed;
+                }
+                break;
+            }
+            case JMP:
+                next = code[pc + 1];
+                break;
+            case JE:
+            case JNE:
+            case PUSH_JE:
+            case PUSH_JNE: {
+                bool immediate = cmd == PUSH_JE || cmd == PUSH_JNE;
+                taken = top[-1] == (immediate ? SPLAT(code[pc + 1]) : top[-2]);
+                if (cmd == JNE || cmd == PUSH_JNE) {
+                    taken = ~taken;
+                }
+                Branch(mask, taken, code[pc + JumpOperand(cmd)], next);
+                continue;
+            }
+            case CALL: {
+                Lanes full = (return_depth == RETURN_STACK_SIZE) & mask;
+                if (!IsEmpty(full)) [[unlikely]] {
+                    Stop(full, kCallOverflow, pc);
+                    mask &= ~full;
+                }
+                for (int l = 0; l < kLanes; l++) {
+                    if (mask[l] != 0) {
+                        returns[return_depth[l]][l] = next;
+                    }
+                }
+                // Mask lanes are -1
+                return_depth -= mask;
+                next = code[pc + 1];
+                break;
+            }
+            case RET: {
+                Lanes empty = (return_depth == 0) & mask;
+                if (!IsEmpty(empty)) [[unlikely]] {
+                    Stop(empty, kReturnWithoutCall, pc);
+                    mask &= ~empty;
+                }
+                return_depth += mask;
+                Lanes targets = PCS;
+                bool same = true;
+                int first = -1;
+                for (int l = 0; l < kLanes; l++) {
+                    if (mask[l] != 0) {
+                        targets[l] = returns[return_depth[l]][l];
+                        same = same && (first < 0 || first == targets[l]);
+                        first = targets[l];
+                    }
+                }
+                // Lanes called from different places part here
+                if (converged && same) {
+                    shared_pc = first;
+                } else {
+                    pcs = SELECT(mask, targets, PCS);
+                    converged = false;
+                }
+                continue;
+            }
+            case END:
+                Stop(mask, kNoTrap, pc);
+                continue;
+            default:
+                break;
+        }
+        // All lanes of a converged step go to the same place
+        if (converged) {
+            shared_pc = next;
+        } else {
+            pcs = SELECT(mask, SPLAT(next), pcs);
+        }
+    }
+    for (auto &output : outputs) {
+        output->Flush();
+    }
+}
+
+#undef PUT
+#undef PCS
+#undef SELECT
+#undef SPLAT
+
+#endif //PROCESSOR_SIMT_H
@@ -0,0 +1,186 @@
+#ifndef PROCESSOR_SNAPSHOT_H
+#define PROCESSOR_SNAPSHOT_H
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include "Commands.h"
+
+// Binary layout: SnapshotHeader, then the return stack, the operand stack and the memory
+// as int32 words, in this order.
+
+#define SNAPSHOT_MAGIC 0x31534250 // "PBS1"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_EXTENSION ".psn"
+
+struct SnapshotHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t program_hash;
+    int32_t pc;
+    int32_t registers[REGISTERS_SIZE];
+    uint32_t returns_count;
+    uint32_t stack_size;
+    uint32_t memory_size;
+};
+
+// State of a run that stopped at a safepoint, or of a processor between runs, where pc is 0.
+// It is valid only for the code it was taken from, which the hash of the code tells.
+struct Snapshot {
+    uint64_t program_hash = 0;
+    int pc = 0;
+    int registers[REGISTERS_SIZE] = {};
+    std::vector<int> returns;
+    std::vector<int> stack;
+    // Empty if the memory is a mapped file, the file keeps it by itself
+    std::vector<int> memory;
+
+    // Goes through a temporary file, so a crash while writing leaves the previous snapshot whole
+    bool Write(const std::string &path) const;
+    bool Read(const std::string &path);
+};
+
+bool Snapshot::Write(const std::string &path) const {
+    SnapshotHeader header = {SNAPSHOT_MAGIC, SNAPSHOT_VERSION, program_hash, pc, {},
+                             static_cast<uint32_t>(returns.size()), static_cast<uint32_t>(stack.size()),
+                             static_cast<uint32_t>(memory.size())};
+    std::copy(registers, registers + REGISTERS_SIZE, header.registers);
+    std::string tmp_path = path + ".tmp" + std::to_string(getpid());
+    FILE *file = fopen(tmp_path.c_str(), "wb");
+    if (file == nullptr) {
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(returns.data(), sizeof(int32_t), returns.size(), file) == returns.size() &&
+              fwrite(stack.data(), sizeof(int32_t), stack.size(), file) == stack.size() &&
+              fwrite(memory.data(), sizeof(int32_t), memory.size(), file) == memory.size();
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool Snapshot::Read(const std::string &path) {
+    FILE *file = fopen(path.c_str(), "rb");
+    if (file == nullptr) {
+        return false;
+    }
+    SnapshotHeader header;
+    bool ok = fread(&header, sizeof(header), 1, file) == 1 && header.magic == SNAPSHOT_MAGIC &&
+              header.version == SNAPSHOT_VERSION && header.returns_count <= RETURN_STACK_SIZE &&
+              header.memory_size <= MEMORY_MAX_SIZE;
+    if (ok) {
+        // The sizes have to agree with the length of the file before anything is allocated
+        long words = static_cast<long>(header.returns_count) + header.stack_size + header.memory_size;
+        ok = fseek(file, 0, SEEK_END) == 0 &&
+             ftell(file) == static_cast<long>(sizeof(header) + words * sizeof(int32_t)) &&
+             fseek(file, sizeof(header), SEEK_SET) == 0;
+    }
+    if (ok) {
+        returns.resize(header.returns_count);
+        stack.resize(header.stack_size);
+        memory.resize(header.memory_size);
+        ok = fread(returns.data(), sizeof(int32_t), returns.size(), file) == returns.size() &&
+             fread(stack.data(), sizeof(int32_t), stack.size(), file) == stack.size() &&
+             fread(memory.data(), sizeof(int32_t), memory.size(), file) == memory.size();
+        program_hash = header.program_hash;
+        pc = header.pc;
+        std::copy(header.registers, header.registers + REGISTERS_SIZE, registers);
+    }
+    fclose(file);
+    return ok;
+}
+
+// Writes the snapshots of a run from a helper thread, so that the run stops only for as long
+// as it takes to copy its state. A snapshot submitted while the previous one is being written
+// replaces any other one that waits.
+class Checkpointer {
+public:
+    Checkpointer(std::string path, std::chrono::milliseconds interval);
+    ~Checkpointer();
+    Checkpointer(const Checkpointer &other) = delete;
+    Checkpointer &operator=(const Checkpointer &other) = delete;
+
+    // The interval passed since the last snapshot was submitted
+    bool Due() const { return std::chrono::steady_clock::now() >= next; }
+    void Submit(Snapshot snapshot);
+    // Blocks until everything submitted is written
+    void Flush();
+    int Written() const { return written; }
+    bool Failed() const { return failed; }
+
+private:
+    void Work();
+
+    std::string path;
+    std::chrono::milliseconds interval;
+    std::chrono::steady_clock::time_point next;
+    std::unique_ptr<Snapshot> pending;
+    bool writing = false;
+    bool stopping = false;
+    int written = 0;
+    bool failed = false;
+    mutable std::mutex mutex;
+    std::condition_variable changed;
+    std::thread writer;
+};
+
+Checkpointer::Checkpointer(std::string path, std::chrono::milliseconds interval)
+        : path(std::move(path)), interval(interval), next(std::chrono::steady_clock::now() + interval) {
+    writer = std::thread(&Checkpointer::Work, this);
+}
+
+// The last snapshot submitted is written before the writer stops
+Checkpointer::~Checkpointer() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    changed.notify_all();
+    writer.join();
+}
+
+void Checkpointer::Submit(Snapshot snapshot) {
+    next = std::chrono::steady_clock::now() + interval;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.reset(new Snapshot(std::move(snapshot)));
+    }
+    changed.notify_all();
+}
+
+void Checkpointer::Flush() {
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [&]() { return pending == nullptr && !writing; });
+}
+
+void Checkpointer::Work() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        changed.wait(lock, [&]() { return stopping || pending != nullptr; });
+        if (pending == nullptr) {
+            return;
+        }
+        std::unique_ptr<Snapshot> snapshot = std::move(pending);
+        writing = true;
+        lock.unlock();
+        bool ok = snapshot->Write(path);
+        lock.lock();
+        writing = false;
+        written += ok;
+        failed = failed || !ok;
+        changed.notify_all();
+    }
+}
+
+#endif //PROCESSOR_SNAPSHOT_H
@@ -0,0 +1,1114 @@
+#ifndef PROCESSOR_SSA_H
+#define PROCESSOR_SSA_H
+
+#include <algorithm>
+#include <initializer_list>
+#include <map>
+#include <string>
+#include <vector>
+#include "Commands.h"
+#include "Optimizer.h"
+#include "Verifier.h"
+
+// Dataflow optimization of a proven program. Blocks start at the jump targets, the marks and
+// the return sites, and every register and stack entry becomes a value in SSA form, with phis
+// where paths join. Over these values run sparse conditional constant propagation, which also
+// drops the branches that always go one way and the code only they lead to, copy propagation
+// through chains of MOV, removal of register writes nothing reads, and motion of register
+// writes that do not change in a loop in front of it. The stack code is then written again
+// block by block: pure values are kept aside until a command needs them on the stack, so a
+// value that is popped, stored to a register or folded never gets there. Registers are unknown
+// on entry and all of them are read at the end, as they outlive the run. A run that traps may
+// leave other values behind than the original code would.
+class SsaOptimizer {
+public:
+    SsaOptimizer(std::vector<int> &program, std::map<std::string, int> &marks, std::vector<int> *lines = nullptr)
+            : program(program), marks(marks), lines(lines) {}
+
+    // False if the program has no stack proof, it stays as it is then
+    bool Run();
+
+private:
+    // Longest value kept off the stack, in code words
+    static constexpr int kMaxDeferred = 16;
+    // Successor that ends the program
+    static constexpr int kExit = -1;
+
+    enum NodeOp { kUnknown, kConst, kCopy, kPhi, kAdd, kMul, kMod };
+    enum Lattice { kTop, kConstant, kBottom };
+
+    struct Node {
+        NodeOp op;
+        // The constant of kConst, the copied value of kCopy, the variable of kPhi
+        int lhs;
+        int rhs;
+        // Command that made the node, the block of a phi
+        int at;
+        // Register a MOV copies, -1 for other copies
+        int source;
+        // Values of a phi, one per predecessor, the entry of the program last
+        std::vector<int> operands;
+    };
+
+    struct Block {
+        int start;
+        int end;
+        int last;
+        // The target of a jump comes first, the next command second
+        std::vector<int> succs;
+        // Predecessors and the index of the edge among their successors
+        std::vector<std::pair<int, int>> preds;
+        // Edges constant propagation found executable, parallel to succs
+        std::vector<bool> taken;
+        // Values of the registers and then of the stack entries, at the start and at the end
+        std::vector<int> entry;
+        std::vector<int> out;
+        std::vector<int> phis;
+        std::vector<int> nodes;
+        bool executable = false;
+    };
+
+    // A value that is not on the stack yet, with the code that pushes it
+    struct Deferred {
+        std::vector<int> code;
+        // Mask of the registers the code reads
+        int reads;
+        bool constant;
+        int value;
+    };
+
+    int Next(int i) const { return i + kCommandLength[program[i]]; }
+
+    void BuildBlocks();
+    void BuildValues();
+    void Step(int i, int block, std::vector<int> &values);
+    int Make(NodeOp op, int lhs, int rhs, int at, int block);
+    int Resolve(int n) const;
+    void Propagate();
+    bool Evaluate(int n);
+    bool Incoming(int block, int k) const;
+    std::vector<bool> Edges(int block) const;
+    bool Constant(int n, int &value) const;
+    int RegisterValue(int i, int r) const { return Resolve(registers_at[i * REGISTERS_SIZE + r]); }
+    // Register holding the same value as r before command i, the first of a chain of MOV
+    int Register(int i, int r) const;
+    void MarkLive();
+    void Use(int n);
+    bool Dominates(int a, int b) const;
+    void HoistInvariants();
+    void Emit(bool dry);
+    void Rewrite(int i, int block, bool dry);
+    void Arithmetic(int i, int cmd);
+    void Assign(int i, int r, bool dry);
+    void Put(int i, std::initializer_list<int> words);
+    void Copy(int i);
+    void Drop(int i);
+    void PushTop();
+    void Spill(int reads = ~0);
+    void Defer(int value);
+
+    std::vector<int> &program;
+    std::map<std::string, int> &marks;
+    std::vector<int> *lines;
+    std::vector<int> depths;
+    std::map<int, std::vector<int>> return_sites;
+
+    std::vector<Block> blocks;
+    std::vector<int> block_of;
+    // Blocks in reverse postorder
+    std::vector<int> order;
+    std::vector<Node> nodes;
+    std::vector<int> forward;
+    std::vector<int> phis;
+    // Values of the registers before every command, the values it reads and the one it makes
+    std::vector<int> registers_at;
+    std::vector<int> reads_at;
+    std::vector<int> def_at;
+
+    std::vector<Lattice> state;
+    std::vector<int> value;
+    std::vector<bool> live;
+    std::vector<int> worklist;
+    std::vector<int> idom;
+    std::vector<int> rpo_index;
+
+    // Writes moved in front of a loop, by its header, and the commands they came from
+    std::map<int, std::vector<int>> hoists;
+    std::vector<bool> hoisted;
+    // Value a register write takes off the stack, if it was kept aside
+    std::map<int, Deferred> assigned;
+
+    std::vector<int> code;
+    // Jumps and marks go to the first word emitted for a command, values spilled in front of it
+    // included, lines go to the command itself
+    std::vector<int> new_offset;
+    std::vector<int> command_offset;
+    std::vector<Deferred> deferred;
+};
+
+bool SsaOptimizer::Run() {
+    int size = program.size();
+    StackVerifier verifier(program.data(), size);
+    if (size == 0 || !verifier.Verify()) {
+        return false;
+    }
+    depths = verifier.Depths();
+    return_sites = verifier.ReturnSites();
+    BuildBlocks();
+    BuildValues();
+    Propagate();
+    MarkLive();
+    hoisted.assign(size + 1, false);
+    hoists.clear();
+    assigned.clear();
+    // The first pass only finds out which values reach register writes kept aside
+    Emit(true);
+    HoistInvariants();
+    Emit(false);
+    Relocate(code, new_offset, size, marks, nullptr);
+    if (lines != nullptr) {
+        for (int &line : *lines) {
+            if (line >= 0 && line <= size) {
+                line = command_offset[line];
+            }
+        }
+    }
+    program.swap(code);
+    return true;
+}
+
+void SsaOptimizer::BuildBlocks() {
+    int size = program.size();
+    std::vector<bool> leader(size + 1, false);
+    leader[0] = true;
+    for (auto &mark : marks) {
+        if (mark.second >= 0 && mark.second <= size) {
+            leader[mark.second] = true;
+        }
+    }
+    for (auto &ret : return_sites) {
+        for (int site : ret.second) {
+            leader[site] = true;
+        }
+    }
+    for (int i = 0; i < size; i = Next(i)) {
+        int cmd = program[i];
+        int operand = JumpOperand(cmd);
+        if (depths[i] >= 0 && operand != 0) {
+            leader[program[i + operand]] = true;
+        }
+        if (depths[i] >= 0 && (operand != 0 || cmd == RET || cmd == END)) {
+            leader[Next(i)] = true;
+        }
+    }
+
+    blocks.clear();
+    block_of.assign(size + 1, -1);
+    bool open = false;
+    for (int i = 0; i < size; i = Next(i)) {
+        if (depths[i] < 0) {
+            open = false;
+            continue;
+        }
+        if (leader[i] || !open) {
+            blocks.emplace_back();
+            blocks.back().start = i;
+            open = true;
+        }
+        blocks.back().last = i;
+        blocks.back().end = Next(i);
+        block_of[i] = blocks.size() - 1;
+        open = open && !leader[Next(i)];
+    }
+
+    auto block_at = [&](int offset) { return offset == size ? kExit : block_of[offset]; };
+    for (size_t b = 0; b < blocks.size(); b++) {
+        Block &block = blocks[b];
+        int cmd = program[block.last];
+        int operand = JumpOperand(cmd);
+        if (cmd == RET) {
+            for (int site : return_sites[block.last]) {
+                block.succs.push_back(block_of[site]);
+            }
+        } else if (cmd == END) {
+            block.succs.push_back(kExit);
+        } else {
+            if (operand != 0) {
+                block.succs.push_back(block_at(program[block.last + operand]));
+            }
+            if (cmd != JMP && cmd != CALL) {
+                block.succs.push_back(block_at(block.end));
+            }
+        }
+        block.taken.assign(block.succs.size(), false);
+        for (size_t k = 0; k < block.succs.size(); k++) {
+            if (block.succs[k] != kExit) {
+                blocks[block.succs[k]].preds.emplace_back(b, k);
+            }
+        }
+    }
+
+    // Reverse postorder from the entry
+    order.clear();
+    std::vector<bool> seen(blocks.size(), false);
+    std::vector<std::pair<int, size_t>> path = {{0, 0}};
+    seen[0] = true;
+    while (!path.empty()) {
+        int b = path.back().first;
+        size_t k = path.back().second++;
+        if (k == blocks[b].succs.size()) {
+            order.push_back(b);
+            path.pop_back();
+        } else if (blocks[b].succs[k] != kExit && !seen[blocks[b].succs[k]]) {
+            seen[blocks[b].succs[k]] = true;
+            path.emplace_back(blocks[b].succs[k], 0);
+        }
+    }
+    std::reverse(order.begin(), order.end());
+}
+
+int SsaOptimizer::Make(NodeOp op, int lhs, int rhs, int at, int block) {
+    nodes.push_back({op, lhs, rhs, at, -1, {}});
+    forward.push_back(nodes.size() - 1);
+    if (op == kPhi) {
+        blocks[block].phis.push_back(nodes.size() - 1);
+        phis.push_back(nodes.size() - 1);
+    } else if (block >= 0) {
+        blocks[block].nodes.push_back(nodes.size() - 1);
+    }
+    return nodes.size() - 1;
+}
+
+int SsaOptimizer::Resolve(int n) const {
+    while (forward[n] != n) {
+        n = forward[n];
+    }
+    return n;
+}
+
+void SsaOptimizer::BuildValues() {
+    int size = program.size();
+    nodes.clear();
+    forward.clear();
+    phis.clear();
+    registers_at.assign((size + 1) * REGISTERS_SIZE, 0);
+    reads_at.assign((size + 1) * 2, -1);
+    def_at.assign(size + 1, -1);
+    std::vector<int> params;
+    for (int r = 0; r < REGISTERS_SIZE; r++) {
+        params.push_back(Make(kUnknown, 0, 0, -1, -1));
+    }
+    std::vector<bool> built(blocks.size(), false);
+    for (int b : order) {
+        Block &block = blocks[b];
+        if (b == 0 && block.preds.empty()) {
+            block.entry = params;
+        } else if (b != 0 && block.preds.size() == 1 && built[block.preds[0].first]) {
+            block.entry = blocks[block.preds[0].first].out;
+        } else {
+            for (int v = 0; v < REGISTERS_SIZE + depths[block.start]; v++) {
+                block.entry.push_back(Make(kPhi, v, 0, b, b));
+            }
+        }
+        std::vector<int> values = block.entry;
+        for (int i = block.start; i < block.end; i = Next(i)) {
+            Step(i, b, values);
+        }
+        block.out = values;
+        built[b] = true;
+    }
+    for (int n : phis) {
+        int b = nodes[n].at;
+        int v = nodes[n].lhs;
+        for (auto &pred : blocks[b].preds) {
+            nodes[n].operands.push_back(blocks[pred.first].out[v]);
+        }
+        if (b == 0) {
+            nodes[n].operands.push_back(params[v]);
+        }
+    }
+    // A phi of one value and itself is that value
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (int n : phis) {
+            if (forward[n] != n) {
+                continue;
+            }
+            int same = -1;
+            bool trivial = true;
+            for (int operand : nodes[n].operands) {
+                operand = Resolve(operand);
+                if (operand != n && operand != same) {
+                    trivial = trivial && same == -1;
+                    same = operand;
+                }
+            }
+            if (trivial && same != -1) {
+                forward[n] = same;
+                changed = true;
+            }
+        }
+    }
+}
+
+void SsaOptimizer::Step(int i, int block, std::vector<int> &values) {
+    int cmd = program[i];
+    int arg = kCommandLength[cmd] > 1 ? program[i + 1] : 0;
+    std::copy(values.begin(), values.begin() + REGISTERS_SIZE, registers_at.begin() + i * REGISTERS_SIZE);
+    auto pop = [&]() {
+        int top = values.back();
+        values.pop_back();
+        return top;
+    };
+    auto push = [&](int n) {
+        values.push_back(n);
+        def_at[i] = n;
+    };
+    auto assign = [&](int r, int n, int source) {
+        int copy = Make(kCopy, n, 0, i, block);
+        nodes[copy].source = source;
+        values[r] = copy;
+        def_at[i] = copy;
+    };
+    switch (cmd) {
+        case PUSH:
+            push(Make(kConst, arg, 0, i, block));
+            break;
+        case PUSHR:
+            reads_at[2 * i] = IsRegister(arg) ? values[arg] : -1;
+            push(IsRegister(arg) ? values[arg] : Make(kUnknown, 0, 0, i, block));
+            break;
+        case POP:
+            pop();
+            break;
+        case POPR: {
+            int top = pop();
+            if (IsRegister(arg)) {
+                assign(arg, top, -1);
+            }
+            break;
+        }
+        case DUP:
+        case DUP_POP: {
+            int rhs = pop();
+            int lhs = pop();
+            for (int k = 0; k < arg; k++) {
+                values.push_back(lhs);
+                if (k + 1 < arg || cmd == DUP) {
+                    values.push_back(rhs);
+                }
+            }
+            break;
+        }
+        case POP_SWP:
+        case SWP:
+            if (cmd == POP_SWP) {
+                pop();
+            }
+            std::swap(values[values.size() - 1], values[values.size() - 2]);
+            break;
+        case MOV:
+            if (IsRegister(arg) && IsRegister(program[i + 2])) {
+                assign(arg, values[program[i + 2]], program[i + 2]);
+            }
+            break;
+        case MOVD:
+            if (IsRegister(arg)) {
+                assign(arg, Make(kConst, program[i + 2], 0, i, block), -1);
+            }
+            break;
+        case IN:
+        case LOAD:
+        case LOADR:
+            push(Make(kUnknown, 0, 0, i, block));
+            break;
+        case OUT:
+        case STORE:
+        case STORER:
+            reads_at[2 * i] = pop();
+            break;
+        case MUL:
+        case ADD:
+        case MOD: {
+            int rhs = pop();
+            int lhs = pop();
+            push(Make(cmd == MUL ? kMul : cmd == ADD ? kAdd : kMod, lhs, rhs, i, block));
+            break;
+        }
+        case PUSH_ADD:
+        case PUSH_MUL: {
+            int lhs = pop();
+            push(Make(cmd == PUSH_ADD ? kAdd : kMul, lhs, Make(kConst, arg, 0, i, block), i, block));
+            break;
+        }
+        case JE:
+        case JNE:
+            reads_at[2 * i + 1] = pop();
+            reads_at[2 * i] = pop();
+            break;
+        case PUSH_JE:
+        case PUSH_JNE:
+            reads_at[2 * i] = pop();
+            break;
+        default:
+            break;
+    }
+}
+
+bool SsaOptimizer::Constant(int n, int &result) const {
+    n = Resolve(n);
+    result = value[n];
+    return state[n] == kConstant;
+}
+
+bool SsaOptimizer::Incoming(int block, int k) const {
+    const std::vector<std::pair<int, int>> &preds = blocks[block].preds;
+    // The entry of the program is always taken
+    return k == static_cast<int>(preds.size()) || blocks[preds[k].first].taken[preds[k].second];
+}
+
+bool SsaOptimizer::Evaluate(int n) {
+    const Node &node = nodes[n];
+    Lattice s = kBottom;
+    int v = 0;
+    switch (node.op) {
+        case kConst:
+            s = kConstant;
+            v = node.lhs;
+            break;
+        case kCopy:
+            s = state[Resolve(node.lhs)];
+            v = value[Resolve(node.lhs)];
+            break;
+        case kAdd:
+        case kMul:
+        case kMod: {
+            int lhs = Resolve(node.lhs);
+            int rhs = Resolve(node.rhs);
+            if (state[lhs] == kBottom || state[rhs] == kBottom) {
+                s = kBottom;
+            } else if (state[lhs] == kTop || state[rhs] == kTop) {
+                s = kTop;
+            } else if (node.op == kMod && value[rhs] == 0) {
+                s = kBottom;
+            } else {
+                s = kConstant;
+                unsigned l = value[lhs];
+                unsigned r = value[rhs];
+                v = node.op == kAdd ? static_cast<int>(l + r) : node.op == kMul ? static_cast<int>(l * r)
+                                                                                : Remainder(value[lhs], value[rhs]);
+            }
+            break;
+        }
+        case kPhi:
+            s = kTop;
+            for (size_t k = 0; k < node.operands.size() && s != kBottom; k++) {
+                int operand = Resolve(node.operands[k]);
+                if (!Incoming(node.at, k) || state[operand] == kTop) {
+                    continue;
+                }
+                if (state[operand] == kBottom || (s == kConstant && value[operand] != v)) {
+                    s = kBottom;
+                } else {
+                    s = kConstant;
+                    v = value[operand];
+                }
+            }
+            break;
+        default:
+            break;
+    }
+    // Values only go down the lattice
+    if (s == kTop || state[n] == kBottom || (state[n] == kConstant && s == kConstant && v == value[n])) {
+        return false;
+    }
+    state[n] = state[n] == kConstant ? kBottom : s;
+    value[n] = v;
+    return true;
+}
+
+std::vector<bool> SsaOptimizer::Edges(int block) const {
+    const Block &b = blocks[block];
+    int cmd = program[b.last];
+    std::vector<bool> taken(b.succs.size(), true);
+    if (IsConditionalJump(cmd)) {
+        int lhs = Resolve(reads_at[2 * b.last]);
+        bool pair = cmd == JE || cmd == JNE;
+        int rhs = pair ? Resolve(reads_at[2 * b.last + 1]) : -1;
+        Lattice s = std::max(state[lhs], pair ? state[rhs] : kConstant);
+        if (state[lhs] == kTop || (pair && state[rhs] == kTop)) {
+            taken.assign(taken.size(), false);
+        } else if (s == kConstant) {
+            bool equal = value[lhs] == (pair ? value[rhs] : program[b.last + 1]);
+            taken[0] = (cmd == JE || cmd == PUSH_JE) == equal;
+            taken[1] = !taken[0];
+        }
+    } else if (cmd == RET) {
+        // A site is taken once its call is
+        const std::vector<int> &sites = return_sites.at(b.last);
+        for (size_t k = 0; k < sites.size(); k++) {
+            taken[k] = blocks[block_of[sites[k] - kCommandLength[CALL]]].executable;
+        }
+    }
+    return taken;
+}
+
+void SsaOptimizer::Propagate() {
+    state.assign(nodes.size(), kTop);
+    value.assign(nodes.size(), 0);
+    // Registers on entry, input and memory
+    for (size_t n = 0; n < nodes.size(); n++) {
+        if (nodes[n].op == kUnknown) {
+            state[n] = kBottom;
+        }
+    }
+    blocks[0].executable = true;
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (int b : order) {
+            if (!blocks[b].executable) {
+                continue;
+            }
+            for (int n : blocks[b].phis) {
+                changed = (forward[n] == n && Evaluate(n)) || changed;
+            }
+            for (int n : blocks[b].nodes) {
+                changed = Evaluate(n) || changed;
+            }
+            std::vector<bool> taken = Edges(b);
+            for (size_t k = 0; k < taken.size(); k++) {
+                if (taken[k] && !blocks[b].taken[k]) {
+                    blocks[b].taken[k] = true;
+                    if (blocks[b].succs[k] != kExit) {
+                        blocks[blocks[b].succs[k]].executable = true;
+                    }
+                    changed = true;
+                }
+            }
+        }
+    }
+}
+
+int SsaOptimizer::Register(int i, int r) const {
+    for (int k = 0; k < REGISTERS_SIZE; k++) {
+        const Node &node = nodes[RegisterValue(i, r)];
+        if (node.op != kCopy || node.source < 0 || RegisterValue(i, node.source) != Resolve(node.lhs)) {
+            break;
+        }
+        r = node.source;
+    }
+    return r;
+}
+
+void SsaOptimizer::Use(int n) {
+    n = Resolve(n);
+    if (!live[n]) {
+        live[n] = true;
+        worklist.push_back(n);
+    }
+}
+
+void SsaOptimizer::MarkLive() {
+    live.assign(nodes.size(), false);
+    worklist.clear();
+    int constant;
+    for (const Block &block : blocks) {
+        if (!block.executable) {
+            continue;
+        }
+        for (int i = block.start; i < block.end; i = Next(i)) {
+            int cmd = program[i];
+            int r = kCommandLength[cmd] > 1 ? program[i + 1] : -1;
+            if ((cmd == PUSHR || cmd == LOADR || cmd == STORER) && IsRegister(r) &&
+                !Constant(RegisterValue(i, r), constant)) {
+                Use(RegisterValue(i, Register(i, r)));
+            }
+        }
+        for (size_t k = 0; k < block.succs.size(); k++) {
+            if (block.succs[k] == kExit && block.taken[k]) {
+                for (int r = 0; r < REGISTERS_SIZE; r++) {
+                    Use(block.out[r]);
+                }
+            }
+        }
+    }
+    while (!worklist.empty()) {
+        int n = worklist.back();
+        worklist.pop_back();
+        const Node &node = nodes[n];
+        if (node.op == kPhi) {
+            for (size_t k = 0; k < node.operands.size(); k++) {
+                if (Incoming(node.at, k)) {
+                    Use(node.operands[k]);
+                }
+            }
+        } else if (node.op == kCopy && node.source >= 0 && !Constant(n, constant)) {
+            Use(RegisterValue(node.at, Register(node.at, node.source)));
+        }
+    }
+}
+
+bool SsaOptimizer::Dominates(int a, int b) const {
+    while (b != a && b != 0) {
+        b = idom[b];
+    }
+    return b == a;
+}
+
+// A register write moves in front of a loop when it is the only one of its register in the
+// loop, every read there sees it, it runs before the loop is left, and what it reads does not
+// change in the loop. The loop has to be entered only by falling into its header.
+void SsaOptimizer::HoistInvariants() {
+    rpo_index.assign(blocks.size(), -1);
+    std::vector<int> rpo;
+    for (int b : order) {
+        if (blocks[b].executable) {
+            rpo_index[b] = rpo.size();
+            rpo.push_back(b);
+        }
+    }
+    // Dominators as Cooper, Harvey and Kennedy find them
+    idom.assign(blocks.size(), -1);
+    idom[0] = 0;
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (size_t k = 1; k < rpo.size(); k++) {
+            int b = rpo[k];
+            int dominator = -1;
+            for (auto &pred : blocks[b].preds) {
+                int p = pred.first;
+                if (!blocks[p].taken[pred.second] || idom[p] == -1) {
+                    continue;
+                }
+                int other = dominator;
+                dominator = p;
+                while (other != -1 && dominator != other) {
+                    while (rpo_index[dominator] > rpo_index[other]) {
+                        dominator = idom[dominator];
+                    }
+                    while (rpo_index[other] > rpo_index[dominator]) {
+                        other = idom[other];
+                    }
+                }
+            }
+            if (idom[b] != dominator) {
+                idom[b] = dominator;
+                changed = true;
+            }
+        }
+    }
+
+    // Natural loops, the ones with a common header are one loop
+    std::map<int, std::vector<bool>> loops;
+    for (int t : rpo) {
+        for (size_t k = 0; k < blocks[t].succs.size(); k++) {
+            int h = blocks[t].succs[k];
+            if (h == kExit || !blocks[t].taken[k] || !Dominates(h, t)) {
+                continue;
+            }
+            std::vector<bool> &body = loops[h];
+            body.resize(blocks.size(), false);
+            body[h] = true;
+            std::vector<int> pending;
+            if (!body[t]) {
+                body[t] = true;
+                pending.push_back(t);
+            }
+            while (!pending.empty()) {
+                int b = pending.back();
+                pending.pop_back();
+                for (auto &pred : blocks[b].preds) {
+                    if (blocks[pred.first].taken[pred.second] && !body[pred.first]) {
+                        body[pred.first] = true;
+                        pending.push_back(pred.first);
+                    }
+                }
+            }
+        }
+    }
+    // Outer loops first, a write goes as far out as it may
+    std::vector<std::pair<int, int>> by_size;
+    for (auto &loop : loops) {
+        by_size.emplace_back(-std::count(loop.second.begin(), loop.second.end(), true), loop.first);
+    }
+    std::sort(by_size.begin(), by_size.end());
+
+    int constant;
+    for (auto &entry : by_size) {
+        int h = entry.second;
+        const std::vector<bool> &body = loops[h];
+        int outside = 0;
+        bool falls = true;
+        for (auto &pred : blocks[h].preds) {
+            const Block &p = blocks[pred.first];
+            if (!p.taken[pred.second] || body[pred.first]) {
+                continue;
+            }
+            int cmd = program[p.last];
+            outside++;
+            falls = falls && p.end == blocks[h].start && pred.second + 1 == static_cast<int>(p.succs.size()) &&
+                    cmd != JMP && cmd != CALL && cmd != RET && cmd != END;
+        }
+        if (!falls || (outside == 0) != (blocks[h].start == 0)) {
+            continue;
+        }
+
+        int writes[REGISTERS_SIZE] = {};
+        std::vector<std::pair<int, int>> reads;
+        std::vector<int> exiting;
+        std::vector<int> candidates;
+        for (int b : rpo) {
+            if (!body[b]) {
+                continue;
+            }
+            const Block &block = blocks[b];
+            for (int i = block.start; i < block.end; i = Next(i)) {
+                int cmd = program[i];
+                int r = kCommandLength[cmd] > 1 ? program[i + 1] : -1;
+                if ((cmd == PUSHR || cmd == LOADR || cmd == STORER) && IsRegister(r) &&
+                    !Constant(RegisterValue(i, r), constant)) {
+                    int source = Register(i, r);
+                    reads.emplace_back(source, RegisterValue(i, source));
+                }
+                if ((cmd != POPR && cmd != MOV && cmd != MOVD) || def_at[i] < 0 || !live[def_at[i]] || hoisted[i]) {
+                    continue;
+                }
+                writes[r]++;
+                candidates.push_back(i);
+                if (cmd == MOV && !Constant(def_at[i], constant)) {
+                    int source = Register(i, program[i + 2]);
+                    reads.emplace_back(source, RegisterValue(i, source));
+                }
+            }
+            for (size_t k = 0; k < block.succs.size(); k++) {
+                if (!block.taken[k] || (block.succs[k] != kExit && body[block.succs[k]])) {
+                    continue;
+                }
+                exiting.push_back(b);
+                if (block.succs[k] == kExit) {
+                    for (int r = 0; r < REGISTERS_SIZE; r++) {
+                        reads.emplace_back(r, Resolve(block.out[r]));
+                    }
+                }
+            }
+        }
+
+        for (int i : candidates) {
+            int cmd = program[i];
+            int r = program[i + 1];
+            int def = def_at[i];
+            bool movable = writes[r] == 1;
+            for (auto &read : reads) {
+                movable = movable && (read.first != r || read.second == def);
+            }
+            for (int b : exiting) {
+                movable = movable && Dominates(block_of[i], b);
+            }
+            if (!movable) {
+                continue;
+            }
+            std::vector<int> &moved = hoists[h];
+            if (Constant(def, constant)) {
+                moved.insert(moved.end(), {MOVD, r, constant});
+            } else if (cmd == MOV) {
+                int source = Register(i, program[i + 2]);
+                if (source == r || writes[source] != 0) {
+                    continue;
+                }
+                moved.insert(moved.end(), {MOV, r, source});
+            } else {
+                auto tree = assigned.find(i);
+                bool invariant = tree != assigned.end() && (tree->second.reads & (1 << r)) == 0;
+                for (int source = 0; invariant && source < REGISTERS_SIZE; source++) {
+                    invariant = (tree->second.reads & (1 << source)) == 0 || writes[source] == 0;
+                }
+                if (!invariant) {
+                    continue;
+                }
+                moved.insert(moved.end(), tree->second.code.begin(), tree->second.code.end());
+                moved.insert(moved.end(), {POPR, r});
+            }
+            hoisted[i] = true;
+        }
+    }
+}
+
+void SsaOptimizer::Emit(bool dry) {
+    int size = program.size();
+    code.clear();
+    code.reserve(size);
+    new_offset.assign(size + 1, 0);
+    command_offset.assign(size + 1, 0);
+    deferred.clear();
+    for (int i = 0; i < size; i = Next(i)) {
+        int b = block_of[i];
+        if (!dry && b != -1 && i == blocks[b].start && hoists.count(b) != 0) {
+            code.insert(code.end(), hoists[b].begin(), hoists[b].end());
+        }
+        new_offset[i] = code.size();
+        command_offset[i] = code.size();
+        if (b == -1 || !blocks[b].executable) {
+            continue;
+        }
+        Rewrite(i, b, dry);
+        if (Next(i) == blocks[b].end) {
+            Spill();
+        }
+    }
+    new_offset[size] = code.size();
+    command_offset[size] = code.size();
+}
+
+void SsaOptimizer::Put(int i, std::initializer_list<int> words) {
+    command_offset[i] = code.size();
+    code.insert(code.end(), words);
+}
+
+void SsaOptimizer::Copy(int i) {
+    command_offset[i] = code.size();
+    code.insert(code.end(), program.begin() + i, program.begin() + Next(i));
+}
+
+// Pops the top of the stack, a value kept aside is just forgotten
+void SsaOptimizer::Drop(int i) {
+    if (deferred.empty()) {
+        Put(i, {POP});
+    } else {
+        deferred.pop_back();
+    }
+}
+
+// Pushes the top value for a command that takes it off right away, the values below it may
+// stay aside as the stack is the same after the command
+void SsaOptimizer::PushTop() {
+    if (!deferred.empty()) {
+        code.insert(code.end(), deferred.back().code.begin(), deferred.back().code.end());
+        deferred.pop_back();
+    }
+}
+
+// Pushes every value kept aside, if any of them reads one of the registers
+void SsaOptimizer::Spill(int reads) {
+    bool needed = false;
+    for (const Deferred &item : deferred) {
+        needed = needed || (item.reads & reads) != 0 || reads == ~0;
+    }
+    if (!needed) {
+        return;
+    }
+    for (const Deferred &item : deferred) {
+        code.insert(code.end(), item.code.begin(), item.code.end());
+    }
+    deferred.clear();
+}
+
+void SsaOptimizer::Defer(int constant) {
+    deferred.push_back({{PUSH, constant}, 0, true, constant});
+}
+
+void SsaOptimizer::Arithmetic(int i, int cmd) {
+    size_t k = deferred.size();
+    int constant;
+    if (k >= 2) {
+        Deferred lhs = deferred[k - 2];
+        const Deferred &rhs = deferred[k - 1];
+        if (Constant(def_at[i], constant)) {
+            deferred.resize(k - 2);
+            Defer(constant);
+            return;
+        }
+        // A remainder kept aside may not trap
+        bool pure = cmd != MOD || (rhs.constant && rhs.value != 0);
+        if (pure && lhs.code.size() + rhs.code.size() < kMaxDeferred) {
+            lhs.code.insert(lhs.code.end(), rhs.code.begin(), rhs.code.end());
+            lhs.code.push_back(cmd);
+            lhs.reads |= rhs.reads;
+            lhs.constant = false;
+            deferred.resize(k - 2);
+            deferred.push_back(lhs);
+            return;
+        }
+        Spill();
+    }
+    // With one value aside the other one is on the stack, and so is everything below
+    PushTop();
+    Put(i, {cmd});
+}
+
+void SsaOptimizer::Assign(int i, int r, bool dry) {
+    if (deferred.empty()) {
+        Put(i, {POPR, r});
+        return;
+    }
+    int below = 0;
+    for (size_t k = 0; k + 1 < deferred.size(); k++) {
+        below |= deferred[k].reads;
+    }
+    if ((below & (1 << r)) != 0) {
+        Spill();
+        Put(i, {POPR, r});
+        return;
+    }
+    if (dry) {
+        assigned[i] = deferred.back();
+    }
+    Deferred top = deferred.back();
+    deferred.pop_back();
+    if (top.constant) {
+        Put(i, {MOVD, r, top.value});
+    } else if (top.code.size() == 2 && top.code[0] == PUSHR) {
+        if (top.code[1] != r) {
+            Put(i, {MOV, r, top.code[1]});
+        }
+    } else {
+        code.insert(code.end(), top.code.begin(), top.code.end());
+        Put(i, {POPR, r});
+    }
+}
+
+void SsaOptimizer::Rewrite(int i, int block, bool dry) {
+    int cmd = program[i];
+    int arg = kCommandLength[cmd] > 1 ? program[i + 1] : 0;
+    // A bad register traps, the command stays as it is with the stack it expects
+    bool bad_register = ((cmd == PUSHR || cmd == POPR || cmd == MOV || cmd == MOVD || cmd == LOADR ||
+                          cmd == STORER) && !IsRegister(arg)) || (cmd == MOV && !IsRegister(program[i + 2]));
+    if (bad_register) {
+        Spill();
+        Copy(i);
+        return;
+    }
+    bool dead = (cmd == POPR || cmd == MOV || cmd == MOVD) && def_at[i] >= 0 && !live[def_at[i]];
+    int constant;
+    size_t k = deferred.size();
+    switch (cmd) {
+        case PUSH:
+            Defer(arg);
+            break;
+        case PUSHR:
+            if (Constant(RegisterValue(i, arg), constant)) {
+                Defer(constant);
+            } else {
+                int r = Register(i, arg);
+                deferred.push_back({{PUSHR, r}, 1 << r, false, 0});
+            }
+            break;
+        case POP:
+            Drop(i);
+            break;
+        case POPR:
+            if (dead || (hoisted[i] && k > 0)) {
+                Drop(i);
+            } else {
+                Assign(i, arg, dry);
+            }
+            break;
+        case MOV:
+        case MOVD:
+            if (dead || hoisted[i]) {
+                break;
+            }
+            Spill(1 << arg);
+            if (Constant(def_at[i], constant)) {
+                Put(i, {MOVD, arg, constant});
+            } else if (Register(i, program[i + 2]) != arg) {
+                Put(i, {MOV, arg, Register(i, program[i + 2])});
+            }
+            break;
+        case DUP:
+        case DUP_POP:
+            if (k >= 2 && deferred[k - 2].code.size() == 2 && deferred[k - 1].code.size() == 2) {
+                Deferred lhs = deferred[k - 2];
+                Deferred rhs = deferred[k - 1];
+                deferred.resize(k - 2);
+                for (int n = 0; n < arg; n++) {
+                    deferred.push_back(lhs);
+                    if (n + 1 < arg || cmd == DUP) {
+                        deferred.push_back(rhs);
+                    }
+                }
+            } else {
+                Spill();
+                Copy(i);
+            }
+            break;
+        case SWP:
+        case POP_SWP:
+            if (k >= (cmd == SWP ? 2u : 3u)) {
+                if (cmd == POP_SWP) {
+                    deferred.pop_back();
+                }
+                std::swap(deferred[deferred.size() - 1], deferred[deferred.size() - 2]);
+            } else {
+                Spill();
+                Copy(i);
+            }
+            break;
+        case MUL:
+        case ADD:
+        case MOD:
+            Arithmetic(i, cmd);
+            break;
+        case PUSH_ADD:
+        case PUSH_MUL:
+            Defer(arg);
+            Arithmetic(i, cmd == PUSH_ADD ? ADD : MUL);
+            break;
+        case LOADR:
+            Spill();
+            if (Constant(RegisterValue(i, arg), constant)) {
+                Put(i, {LOAD, constant});
+            } else {
+                Put(i, {LOADR, Register(i, arg)});
+            }
+            break;
+        case OUT:
+        case STORE:
+            PushTop();
+            Copy(i);
+            break;
+        case STORER:
+            PushTop();
+            if (Constant(RegisterValue(i, arg), constant)) {
+                Put(i, {STORE, constant});
+            } else {
+                Put(i, {STORER, Register(i, arg)});
+            }
+            break;
+        case JE:
+        case JNE:
+        case PUSH_JE:
+        case PUSH_JNE: {
+            const std::vector<bool> &taken = blocks[block].taken;
+            if (taken[0] == taken[1]) {
+                Spill();
+                Copy(i);
+                break;
+            }
+            // The branch always goes one way, its operands are only dropped
+            for (int n = cmd == JE || cmd == JNE ? 2 : 1; n > 0; n--) {
+                Drop(i);
+            }
+            Spill();
+            if (taken[0]) {
+                Put(i, {JMP, program[i + JumpOperand(cmd)]});
+            }
+            break;
+        }
+        case HLT:
+            break;
+        default:
+            Spill();
+            Copy(i);
+            break;
+    }
+}
+
+// The stack code CallOptimizer leaves goes through the SSA passes, and the peephole pass
+// fuses what they leave behind
+void Optimize(std::vector<int> &program, std::map<std::string, int> &marks, std::vector<int> *lines = nullptr) {
+    CallOptimizer(program, marks, lines).Run();
+    SsaOptimizer(program, marks, lines).Run();
+    program.resize(PeepholeOptimizer(program.data(), program.size(), marks, lines).Run());
+}
+
+#endif //PROCESSOR_SSA_H
@@ -0,0 +1,246 @@
+#ifndef PROCESSOR_TRANSPILER_H
+#define PROCESSOR_TRANSPILER_H
+
+#include <ostream>
+#include <set>
+#include <string>
+#include <vector>
+#include "Commands.h"
+#include "Memory.h"
+#include "Program.h"
+#include "Trap.h"
+
+// Writes a proven program as a standalone C++ translation unit with a single function
+//     int name(int (*in)(), void (*out)(int))
+// that runs the program once from a clean state and returns 0 or the Trap it stopped on.
+// Labels become goto targets, registers become locals, and since StackVerifier knows the
+// depth at every command, the stack becomes a local array indexed by constants, which the
+// host compiler keeps in registers. in has no way to report the end of the input, the host
+// decides what an IN past it gets.
+class Transpiler {
+public:
+    explicit Transpiler(const Program &program) : program(program) {}
+
+    // False for programs without a stack proof, their depths are not known ahead
+    bool Write(const std::string &function, std::ostream &out);
+
+private:
+    void WriteCommand(int i, std::ostream &out) const;
+    static std::string Slot(int index);
+    static std::string Trapped(Trap trap);
+    // Jump to an offset, the end of the code is the end of the run
+    std::string Goto(int target) const;
+
+    const Program &program;
+    // Offsets that get a label, and the return addresses RET chooses from
+    std::set<int> targets;
+    std::vector<int> return_sites;
+};
+
+bool Transpiler::Write(const std::string &function, std::ostream &out) {
+    if (!program.IsVerified()) {
+        return false;
+    }
+    const int *code = program.Code();
+    int size = program.Size();
+    const std::vector<int> &depths = program.Depths();
+    targets.clear();
+    return_sites.clear();
+    bool calls = false;
+    for (int i = 0; i < size; i += kCommandLength[code[i]]) {
+        if (depths[i] < 0) {
+            continue;
+        }
+        int operand = JumpOperand(code[i]);
+        if (operand != 0 && code[i + operand] != size) {
+            targets.insert(code[i + operand]);
+        }
+        // A call into a subroutine that never returns has no return site
+        calls = calls || code[i] == CALL || code[i] == RET;
+        if (code[i] == CALL && depths[i + kCommandLength[CALL]] >= 0) {
+            targets.insert(i + kCommandLength[CALL]);
+            return_sites.push_back(i + kCommandLength[CALL]);
+        }
+    }
+
+    out << "// Generated by Processor -t, do not edit\n"
+           "// Returns 0 when the program ends, otherwise the number of the trap it stopped on\n\n";
+    if (program.UsesMemory()) {
+        out << "#include <vector>\n\n";
+    }
+    out << "namespace {\n\n"
+           "// Arithmetic wraps around like the interpreters do\n"
+           "inline int Add(int lhs, int rhs) { return static_cast<int>(static_cast<unsigned>(lhs) + rhs); }\n"
+           "inline int Mul(int lhs, int rhs) { return static_cast<int>(static_cast<unsigned>(lhs) * rhs); }\n"
+           "inline int Remainder(int lhs, int rhs) { return rhs == -1 ? 0 : lhs % rhs; }\n\n"
+           "} // namespace\n\n";
+    out << "int " << function << "(int (*in)(), void (*out)(int)) {\n";
+    for (int r = 0; r < REGISTERS_SIZE; r++) {
+        out << "    int r" << r << " = 0;\n";
+    }
+    out << "    int s[" << std::max(program.MaxDepth(), 1) << "];\n";
+    if (calls) {
+        out << "    int returns[" << RETURN_STACK_SIZE << "];\n"
+               "    int return_depth = 0;\n";
+    }
+    if (program.UsesMemory()) {
+        out << "    std::vector<int> memory(" << DEFAULT_MEMORY_SIZE << ");\n";
+    }
+    // Whatever the program leaves unused
+    out << "    (void) in;\n    (void) out;\n    (void) s;\n";
+    for (int r = 0; r < REGISTERS_SIZE; r++) {
+        out << "    (void) r" << r << ";\n";
+    }
+    for (int i = 0; i < size; i += kCommandLength[code[i]]) {
+        if (depths[i] < 0) {
+            continue;
+        }
+        if (targets.count(i) != 0) {
+            out << "L" << i << ":\n";
+        }
+        WriteCommand(i, out);
+    }
+    // Only a call at the very end returns there
+    if (targets.count(size) != 0) {
+        out << "L" << size << ":\n";
+    }
+    out << "    return 0;\n}\n";
+    return true;
+}
+
+void Transpiler::WriteCommand(int i, std::ostream &out) const {
+    const int *code = program.Code();
+    int cmd = code[i];
+    int arg = kCommandLength[cmd] > 1 ? code[i + 1] : 0;
+    int d = program.Depths()[i];
+    // Register operands are not part of the proof, a bad one is a trap at its command
+    bool bad_register = ((cmd == PUSHR || cmd == POPR || cmd == MOV || cmd == MOVD || cmd == LOADR ||
+                          cmd == STORER) && !IsRegister(arg)) || (cmd == MOV && !IsRegister(code[i + 2]));
+    if (bad_register) {
+        out << "    " << Trapped(kBadRegister) << "\n";
+        return;
+    }
+    std::string r = "r" + std::to_string(arg);
+    switch (cmd) {
+        case PUSH:
+            out << "    " << Slot(d) << " = " << arg << ";\n";
+            break;
+        case PUSHR:
+            out << "    " << Slot(d) << " = " << r << ";\n";
+            break;
+        case POP:
+        case HLT:
+            break;
+        case POPR:
+            out << "    " << r << " = " << Slot(d - 1) << ";\n";
+            break;
+        case DUP:
+        case DUP_POP:
+            // The pair on top is pushed arg times, it is already there once
+            for (int k = 1; k < arg; k++) {
+                out << "    " << Slot(d - 2 + 2 * k) << " = " << Slot(d - 2) << ";\n";
+                if (k + 1 < arg || cmd == DUP) {
+                    out << "    " << Slot(d - 1 + 2 * k) << " = " << Slot(d - 1) << ";\n";
+                }
+            }
+            break;
+        case SWP:
+        case POP_SWP: {
+            int top = cmd == SWP ? d - 1 : d - 2;
+            out << "    { int t = " << Slot(top) << "; " << Slot(top) << " = " << Slot(top - 1) << "; "
+                << Slot(top - 1) << " = t; }\n";
+            break;
+        }
+        case MOV:
+            out << "    " << r << " = r" << code[i + 2] << ";\n";
+            break;
+        case MOVD:
+            out << "    " << r << " = " << code[i + 2] << ";\n";
+            break;
+        case IN:
+            out << "    " << Slot(d) << " = in();\n";
+            break;
+        case OUT:
+            out << "    out(" << Slot(d - 1) << ");\n";
+            break;
+        case MUL:
+        case ADD:
+            out << "    " << Slot(d - 2) << " = " << (cmd == MUL ? "Mul(" : "Add(") << Slot(d - 2) << ", "
+                << Slot(d - 1) << ");\n";
+            break;
+        case MOD:
+            out << "    if (" << Slot(d - 1) << " == 0) " << Trapped(kDivisionByZero) << "\n"
+                << "    " << Slot(d - 2) << " = Remainder(" << Slot(d - 2) << ", " << Slot(d - 1) << ");\n";
+            break;
+        case LOAD:
+        case LOADR:
+        case STORE:
+        case STORER: {
+            std::string address = cmd == LOAD || cmd == STORE ? std::to_string(arg) : r;
+            // The memory has the size a run of Processor gets unless it is told otherwise
+            bool checked = !program.IsProvenAccess(i) || program.MemoryExtent() > DEFAULT_MEMORY_SIZE;
+            if (checked) {
+                out << "    if (static_cast<unsigned>(" << address << ") >= memory.size()) "
+                    << Trapped(kBadAddress) << "\n";
+            }
+            if (cmd == LOAD || cmd == LOADR) {
+                out << "    " << Slot(d) << " = memory[" << address << "];\n";
+            } else {
+                out << "    memory[" << address << "] = " << Slot(d - 1) << ";\n";
+            }
+            break;
+        }
+        case JMP:
+            out << "    " << Goto(arg) << "\n";
+            break;
+        case JE:
+        case JNE:
+            out << "    if (" << Slot(d - 1) << (cmd == JE ? " == " : " != ") << Slot(d - 2) << ") "
+                << Goto(arg) << "\n";
+            break;
+        case PUSH_JE:
+        case PUSH_JNE:
+            out << "    if (" << Slot(d - 1) << (cmd == PUSH_JE ? " == " : " != ") << arg << ") "
+                << Goto(code[i + 2]) << "\n";
+            break;
+        case PUSH_ADD:
+        case PUSH_MUL:
+            out << "    " << Slot(d - 1) << " = " << (cmd == PUSH_MUL ? "Mul(" : "Add(") << Slot(d - 1) << ", "
+                << arg << ");\n";
+            break;
+        case CALL:
+            out << "    if (return_depth == " << RETURN_STACK_SIZE << ") " << Trapped(kCallOverflow) << "\n"
+                << "    returns[return_depth++] = " << i + kCommandLength[CALL] << ";\n"
+                << "    " << Goto(arg) << "\n";
+            break;
+        case RET:
+            out << "    if (return_depth == 0) " << Trapped(kReturnWithoutCall) << "\n"
+                << "    switch (returns[--return_depth]) {\n";
+            for (int site : return_sites) {
+                out << "        case " << site << ": goto L" << site << ";\n";
+            }
+            out << "    }\n"
+                << "    " << Trapped(kReturnWithoutCall) << "\n";
+            break;
+        case END:
+            out << "    return 0;\n";
+            break;
+        default:
+            out << "    " << Trapped(kBadOpcode) << "\n";
+            break;
+    }
+}
+
+std::string Transpiler::Slot(int index) {
+    return "s[" + std::to_string(index) + "]";
+}
+
+std::string Transpiler::Trapped(Trap trap) {
+    return "return " + std::to_string(trap) + "; // " + TrapMessage(trap);
+}
+
+std::string Transpiler::Goto(int target) const {
+    return target == program.Size() ? "return 0;" : "goto L" + std::to_string(target) + ";";
+}
+
+#endif //PROCESSOR_TRANSPILER_H
@@ -0,0 +1,54 @@
+#ifndef PROCESSOR_TRAP_H
+#define PROCESSOR_TRAP_H
+
+// Reasons for a program to stop before END or the end of the code
+enum Trap {
+    kNoTrap, kStackUnderflow, kStackOverflow, kBadRegister, kBadOpcode, kBadJump, kDivisionByZero, kNoInput,
+    kCallOverflow, kReturnWithoutCall, kBadAddress,
+    // Not a trap, the interpreter stopped to let a checkpoint be taken and goes on after it
+    kSafepoint,
+    // Not a trap either, the gas of the run is spent and the next run goes on from here
+    kOutOfGas
+};
+
+// Outcome of a run, pc is the offset of the command that trapped
+struct RunResult {
+    Trap trap;
+    int pc;
+
+    bool Ok() const { return trap == kNoTrap; }
+};
+
+inline const char *TrapMessage(Trap trap) {
+    switch (trap) {
+        case kNoTrap:
+            return "no trap";
+        case kStackUnderflow:
+            return "stack underflow";
+        case kStackOverflow:
+            return "stack overflow";
+        case kBadRegister:
+            return "bad register";
+        case kBadOpcode:
+            return "bad opcode";
+        case kBadJump:
+            return "jump out of the program";
+        case kDivisionByZero:
+            return "division by zero";
+        case kNoInput:
+            return "no input";
+        case kCallOverflow:
+            return "call stack overflow";
+        case kReturnWithoutCall:
+            return "return without call";
+        case kBadAddress:
+            return "address out of the memory";
+        case kSafepoint:
+            return "safepoint";
+        case kOutOfGas:
+            return "out of gas";
+    }
+    return "unknown trap";
+}
+
+#endif //PROCESSOR_TRAP_H
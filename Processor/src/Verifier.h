@@ -0,0 +1,491 @@
+#ifndef PROCESSOR_VERIFIER_H
+#define PROCESSOR_VERIFIER_H
+
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <map>
+#include <vector>
+#include "Commands.h"
+
+// Walks the control flow graph of the program and proves that no command pops from an
+// empty stack, given that the stack is empty on entry, and that the stack stays within
+// STACK_MAX_SIZE. The depth has to be the same on
+// every path into a command, otherwise a loop could grow the stack without a bound.
+// RET goes back to the call sites of the subroutines it ends, so every subroutine has to be
+// called at one depth only.
+class StackVerifier {
+public:
+    StackVerifier(const int *program, int program_size) : program(program), program_size(program_size) {}
+
+    bool Verify();
+    // Peak stack depth over all paths, makes sense only if Verify succeeded
+    int MaxDepth() const { return max_depth; }
+    // Depth before every offset, -1 for unreachable ones. Every path agrees on it
+    // once Verify succeeded.
+    const std::vector<int> &Depths() const { return depth_at; }
+    // Offsets every RET may resume at
+    const std::map<int, std::vector<int>> &ReturnSites() const { return return_sites; }
+
+private:
+    // Elements the command needs on the stack, change of the depth and the highest point
+    // reached in between, both relative to the depth before the command
+    struct Effect {
+        int needs;
+        int64_t delta;
+        int64_t peak;
+    };
+
+    Effect CommandEffect(int i) const;
+    bool Visit(int target, int depth);
+    // Finds the RETs of the subroutine at entry, without going into the calls it makes
+    void CollectReturns(int entry, int stamp, std::vector<int> &seen, std::vector<int> &returns) const;
+
+    const int *program;
+    int program_size;
+    int max_depth = 0;
+    std::vector<int> depth_at;
+    std::vector<int> worklist;
+    std::vector<bool> boundary;
+    // Offsets every RET may resume at, right after the calls of its subroutines
+    std::map<int, std::vector<int>> return_sites;
+};
+
+StackVerifier::Effect StackVerifier::CommandEffect(int i) const {
+    int64_t n = kCommandLength[program[i]] > 1 ? program[i + 1] : 0;
+    switch (program[i]) {
+        case PUSH:
+        case PUSHR:
+        case IN:
+        case LOAD:
+        case LOADR:
+            return {0, 1, 1};
+        case POP:
+        case POPR:
+        case OUT:
+        case STORE:
+        case STORER:
+            return {1, -1, 0};
+        case DUP:
+            return n > 0 ? Effect{2, 2 * n - 2, 2 * n - 2} : Effect{2, -2, 0};
+        case DUP_POP:
+            return n > 0 ? Effect{2, 2 * n - 3, 2 * n - 2} : Effect{2, -2, 0};
+        case SWP:
+            return {2, 0, 0};
+        case MUL:
+        case ADD:
+        case MOD:
+            return {2, -1, 0};
+        case JE:
+        case JNE:
+            return {2, -2, 0};
+        case PUSH_JE:
+        case PUSH_JNE:
+        case POP_SWP:
+            return {program[i] == POP_SWP ? 3 : 1, -1, 0};
+        case PUSH_ADD:
+        case PUSH_MUL:
+            return {1, 0, 0};
+        default:
+            return {0, 0, 0};
+    }
+}
+
+bool StackVerifier::Visit(int target, int depth) {
+    if (target < 0 || target > program_size) {
+        return false;
+    }
+    if (depth_at[target] == -1) {
+        depth_at[target] = depth;
+        worklist.push_back(target);
+        return true;
+    }
+    return depth_at[target] == depth;
+}
+
+void StackVerifier::CollectReturns(int entry, int stamp, std::vector<int> &seen, std::vector<int> &returns) const {
+    std::vector<int> pending;
+    if (entry >= 0 && entry <= program_size && boundary[entry]) {
+        pending.push_back(entry);
+    }
+    while (!pending.empty()) {
+        int i = pending.back();
+        pending.pop_back();
+        if (seen[i] == stamp || i == program_size) {
+            continue;
+        }
+        seen[i] = stamp;
+        int cmd = program[i];
+        if (cmd == RET) {
+            returns.push_back(i);
+            continue;
+        }
+        // A call comes back to the next command, jumps stay in the subroutine
+        int operand = JumpOperand(cmd);
+        if (operand != 0 && cmd != CALL) {
+            int target = program[i + operand];
+            if (target >= 0 && target <= program_size && boundary[target]) {
+                pending.push_back(target);
+            }
+        }
+        if (cmd != JMP && cmd != END) {
+            pending.push_back(i + kCommandLength[cmd]);
+        }
+    }
+}
+
+bool StackVerifier::Verify() {
+    depth_at.assign(program_size + 1, -1);
+    worklist.clear();
+    max_depth = 0;
+    // Jump targets must be command boundaries
+    boundary.assign(program_size + 1, false);
+    std::map<int, std::vector<int>> callers;
+    for (int i = 0; i < program_size; i += kCommandLength[program[i]]) {
+        if (program[i] < 0 || program[i] >= COMMANDS_COUNT || i + kCommandLength[program[i]] > program_size) {
+            return false;
+        }
+        boundary[i] = true;
+        if (program[i] == CALL) {
+            callers[program[i + 1]].push_back(i + kCommandLength[CALL]);
+        }
+    }
+    boundary[program_size] = true;
+    return_sites.clear();
+    std::vector<int> seen(program_size + 1, -1);
+    std::vector<int> returns;
+    for (auto &subroutine : callers) {
+        returns.clear();
+        CollectReturns(subroutine.first, subroutine.first, seen, returns);
+        for (int ret : returns) {
+            std::vector<int> &sites = return_sites[ret];
+            sites.insert(sites.end(), subroutine.second.begin(), subroutine.second.end());
+        }
+    }
+
+    Visit(0, 0);
+    while (!worklist.empty()) {
+        int i = worklist.back();
+        worklist.pop_back();
+        int depth = depth_at[i];
+        if (i == program_size) {
+            continue;
+        }
+        Effect effect = CommandEffect(i);
+        if (depth < effect.needs || depth + std::max(effect.peak, effect.delta) > STACK_MAX_SIZE) {
+            return false;
+        }
+        max_depth = std::max<int64_t>(max_depth, depth + std::max(effect.peak, effect.delta));
+        int cmd = program[i];
+        int operand = JumpOperand(cmd);
+        if (operand != 0) {
+            int target = program[i + operand];
+            if (target < 0 || target > program_size || !boundary[target] || !Visit(target, depth + effect.delta)) {
+                return false;
+            }
+        }
+        if (cmd == RET) {
+            for (int site : return_sites[i]) {
+                if (!Visit(site, depth)) {
+                    return false;
+                }
+            }
+            continue;
+        }
+        // Code after a CALL is reached through RET
+        if (cmd != JMP && cmd != END && cmd != CALL && !Visit(i + kCommandLength[cmd], depth + effect.delta)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Closed interval of the values a register or a stack entry may hold
+struct Range {
+    int64_t lo;
+    int64_t hi;
+
+    static Range Any() { return {INT_MIN, INT_MAX}; }
+    static Range Of(int value) { return {value, value}; }
+    // Results that may wrap around know nothing
+    static Range Fit(int64_t lo, int64_t hi) { return lo < INT_MIN || hi > INT_MAX ? Any() : Range{lo, hi}; }
+    bool operator==(const Range &other) const { return lo == other.lo && hi == other.hi; }
+    bool operator!=(const Range &other) const { return !(*this == other); }
+};
+
+// Interval analysis of a proven program, run over the same graph as StackVerifier. It finds
+// the addresses every memory command may use, so a run whose memory covers all of them may
+// leave the bounds checks of these commands out, once for the whole run instead of once per
+// access in a loop. Registers are unknown on entry, as they are kept between runs. A bound
+// that still moves after a few rounds jumps to the next constant of the program, or to no
+// bound at all, so a counter kept by a remainder settles at the size of its table.
+class RangeAnalysis {
+public:
+    RangeAnalysis(const int *program, int program_size, const std::vector<int> &depths,
+                  const std::map<int, std::vector<int>> &return_sites)
+            : program(program), program_size(program_size), depths(depths), return_sites(return_sites) {}
+
+    void Run();
+    // Memory commands whose address is always in [0, Extent())
+    const std::vector<bool> &Proven() const { return proven; }
+    int Extent() const { return extent; }
+
+private:
+    // Stack entries deeper than this are unknown
+    static constexpr int kTrackedDepth = 8;
+    static constexpr int kWidenAfter = 4;
+
+    struct State {
+        Range registers[REGISTERS_SIZE];
+        // Top of the stack, the last entry is the top one
+        std::vector<Range> top;
+    };
+
+    static Range Pop(State &state);
+    static void Push(State &state, const Range &range);
+    static Range Modulo(const Range &lhs, const Range &rhs);
+    State Step(int i, State state) const;
+    // Nearest thresholds outside of the range
+    Range Widen(const Range &range) const;
+    Range Address(int i) const;
+    void Flow(int target, const State &state);
+
+    const int *program;
+    int program_size;
+    const std::vector<int> &depths;
+    const std::map<int, std::vector<int>> &return_sites;
+    std::vector<State> states;
+    std::vector<int> rounds;
+    std::vector<bool> queued;
+    std::vector<int> worklist;
+    std::vector<int64_t> thresholds;
+    std::vector<bool> proven;
+    int extent = 0;
+};
+
+Range RangeAnalysis::Pop(State &state) {
+    if (state.top.empty()) {
+        return Range::Any();
+    }
+    Range range = state.top.back();
+    state.top.pop_back();
+    return range;
+}
+
+void RangeAnalysis::Push(State &state, const Range &range) {
+    if (state.top.size() == kTrackedDepth) {
+        state.top.erase(state.top.begin());
+    }
+    state.top.push_back(range);
+}
+
+// The remainder is smaller than the divisor and takes the sign of the dividend
+Range RangeAnalysis::Modulo(const Range &lhs, const Range &rhs) {
+    int64_t bound = std::min(std::max(-rhs.lo, rhs.hi) - 1, std::max(-lhs.lo, lhs.hi));
+    if (bound < 0) {
+        return Range::Any();
+    }
+    return {lhs.lo >= 0 ? 0 : -bound, lhs.hi <= 0 ? 0 : bound};
+}
+
+RangeAnalysis::State RangeAnalysis::Step(int i, State state) const {
+    const int *op = program + i;
+    Range *registers = state.registers;
+    Range lhs, rhs;
+    switch (op[0]) {
+        case PUSH:
+            Push(state, Range::Of(op[1]));
+            break;
+        case PUSHR:
+            Push(state, IsRegister(op[1]) ? registers[op[1]] : Range::Any());
+            break;
+        case POP:
+        case OUT:
+        case STORE:
+        case STORER:
+        case PUSH_JE:
+        case PUSH_JNE:
+            Pop(state);
+            break;
+        case POPR:
+            lhs = Pop(state);
+            if (IsRegister(op[1])) {
+                registers[op[1]] = lhs;
+            }
+            break;
+        case DUP:
+        case DUP_POP:
+            rhs = Pop(state);
+            lhs = Pop(state);
+            // Only the last pairs can stay tracked
+            for (int k = 0; k < std::min(op[1], kTrackedDepth); k++) {
+                Push(state, lhs);
+                Push(state, rhs);
+            }
+            if (op[0] == DUP_POP) {
+                Pop(state);
+            }
+            break;
+        case SWP:
+        case POP_SWP:
+            if (op[0] == POP_SWP) {
+                Pop(state);
+            }
+            rhs = Pop(state);
+            lhs = Pop(state);
+            Push(state, rhs);
+            Push(state, lhs);
+            break;
+        case MOV:
+            if (IsRegister(op[1]) && IsRegister(op[2])) {
+                registers[op[1]] = registers[op[2]];
+            }
+            break;
+        case MOVD:
+            if (IsRegister(op[1])) {
+                registers[op[1]] = Range::Of(op[2]);
+            }
+            break;
+        case IN:
+        case LOAD:
+        case LOADR:
+            Push(state, Range::Any());
+            break;
+        case ADD:
+        case MUL:
+        case MOD:
+        case PUSH_ADD:
+        case PUSH_MUL:
+            rhs = op[0] == PUSH_ADD || op[0] == PUSH_MUL ? Range::Of(op[1]) : Pop(state);
+            lhs = Pop(state);
+            if (op[0] == ADD || op[0] == PUSH_ADD) {
+                Push(state, Range::Fit(lhs.lo + rhs.lo, lhs.hi + rhs.hi));
+            } else if (op[0] == MOD) {
+                Push(state, Modulo(lhs, rhs));
+            } else {
+                int64_t corners[] = {lhs.lo * rhs.lo, lhs.lo * rhs.hi, lhs.hi * rhs.lo, lhs.hi * rhs.hi};
+                Push(state, Range::Fit(*std::min_element(corners, corners + 4), *std::max_element(corners, corners + 4)));
+            }
+            break;
+        case JE:
+        case JNE:
+            Pop(state);
+            Pop(state);
+            break;
+        default:
+            break;
+    }
+    return state;
+}
+
+Range RangeAnalysis::Address(int i) const {
+    const State &state = states[i];
+    if (program[i] == LOAD || program[i] == STORE) {
+        return Range::Of(program[i + 1]);
+    }
+    return IsRegister(program[i + 1]) ? state.registers[program[i + 1]] : Range::Any();
+}
+
+Range RangeAnalysis::Widen(const Range &range) const {
+    auto hi = std::lower_bound(thresholds.begin(), thresholds.end(), range.hi);
+    auto lo = std::upper_bound(thresholds.begin(), thresholds.end(), range.lo);
+    return {*(lo - 1), *hi};
+}
+
+void RangeAnalysis::Flow(int target, const State &state) {
+    if (target < 0 || target > program_size || depths[target] < 0) {
+        return;
+    }
+    State &old = states[target];
+    bool changed = rounds[target] == 0;
+    if (changed) {
+        old = state;
+    } else {
+        // Both stacks have the same depth, the tops are joined from the top down
+        size_t tracked = std::min(old.top.size(), state.top.size());
+        old.top.erase(old.top.begin(), old.top.end() - tracked);
+        changed = tracked != old.top.size();
+        bool widen = rounds[target] > kWidenAfter;
+        auto join = [&](Range &into, const Range &from) {
+            Range joined = {std::min(into.lo, from.lo), std::max(into.hi, from.hi)};
+            if (widen) {
+                Range wide = Widen(joined);
+                joined.lo = joined.lo < into.lo ? wide.lo : joined.lo;
+                joined.hi = joined.hi > into.hi ? wide.hi : joined.hi;
+            }
+            changed = changed || joined != into;
+            into = joined;
+        };
+        for (int r = 0; r < REGISTERS_SIZE; r++) {
+            join(old.registers[r], state.registers[r]);
+        }
+        for (size_t k = 0; k < tracked; k++) {
+            join(old.top[old.top.size() - 1 - k], state.top[state.top.size() - 1 - k]);
+        }
+    }
+    if (changed) {
+        rounds[target]++;
+        if (!queued[target]) {
+            queued[target] = true;
+            worklist.push_back(target);
+        }
+    }
+}
+
+void RangeAnalysis::Run() {
+    states.assign(program_size + 1, State());
+    rounds.assign(program_size + 1, 0);
+    queued.assign(program_size + 1, false);
+    proven.assign(program_size + 1, false);
+    extent = 0;
+    thresholds = {INT_MIN, INT_MAX};
+    for (int i = 0; i < program_size; i += kCommandLength[program[i]]) {
+        int cmd = program[i];
+        if (cmd == PUSH || cmd == PUSH_ADD || cmd == PUSH_MUL || cmd == PUSH_JE || cmd == PUSH_JNE || cmd == MOVD) {
+            int64_t constant = program[i + (cmd == MOVD ? 2 : 1)];
+            thresholds.push_back(constant);
+            // Remainders by the constant reach one less
+            thresholds.push_back(std::max<int64_t>(constant - 1, INT_MIN));
+        }
+    }
+    std::sort(thresholds.begin(), thresholds.end());
+    State entry;
+    std::fill(entry.registers, entry.registers + REGISTERS_SIZE, Range::Any());
+    Flow(0, entry);
+    while (!worklist.empty()) {
+        int i = worklist.back();
+        worklist.pop_back();
+        queued[i] = false;
+        if (i == program_size) {
+            continue;
+        }
+        int cmd = program[i];
+        State after = Step(i, states[i]);
+        int operand = JumpOperand(cmd);
+        if (operand != 0) {
+            Flow(program[i + operand], cmd == CALL ? states[i] : after);
+        }
+        if (cmd == RET) {
+            auto sites = return_sites.find(i);
+            if (sites != return_sites.end()) {
+                for (int site : sites->second) {
+                    Flow(site, after);
+                }
+            }
+        } else if (cmd != JMP && cmd != END && cmd != CALL) {
+            Flow(i + kCommandLength[cmd], after);
+        }
+    }
+    for (int i = 0; i < program_size; i += kCommandLength[program[i]]) {
+        if (rounds[i] == 0 || !IsMemoryAccess(program[i])) {
+            continue;
+        }
+        Range address = Address(i);
+        if (address.lo >= 0 && address.hi < MEMORY_MAX_SIZE) {
+            proven[i] = true;
+            extent = std::max<int>(extent, address.hi + 1);
+        }
+    }
+}
+
+#endif //PROCESSOR_VERIFIER_H
@@ -1,5 +1,6 @@
 #include "gtest/gtest.h"
 #include "../src/Processor.h"
+#include "../src/Transpiler.h"
 
 #include <vector>
 #include <cmath>
@@ -10,15 +11,54 @@
  */
 class ProcessorTest : public ::testing::Test {
 protected:
-    void AssertErrorByFile(const std::string &file_name, const std::string& expected) {
+    void AssertErrorByFile(const std::string &file_name, const std::string& expected,
+                           Engine engine = kDefaultEngine) {
       std::ifstream file;
       file.open("../Processor/data/" + file_name + ".txt");
-      Processor p(file, 100);
+      Processor p(file, 100, engine);
       file.close();
       std::stringstream stream;
       p.Run(nullptr, stream);
       ASSERT_EQ(expected + "\n", stream.str());
     }
+
+    void AssertOutputByText(const std::string &text, const std::string &expected, bool optimize) {
+      for (Engine engine : {kSwitchEngine, kThreadedEngine, kJitEngine, kIrEngine, kCompactEngine, kCachedEngine}) {
+        std::stringstream program(text);
+        Processor p(program, 100, engine, optimize);
+        std::stringstream stream;
+        p.Run(nullptr, stream);
+        ASSERT_EQ(expected, stream.str());
+      }
+    }
+
+    void AssertTrapByText(const std::string &text, Trap trap, int pc, const std::string &input = "") {
+      for (Engine engine : {kSwitchEngine, kThreadedEngine, kJitEngine, kIrEngine, kCompactEngine, kCachedEngine}) {
+        std::stringstream program(text);
+        Processor p(program, 100, engine, false);
+        std::stringstream in(input);
+        std::stringstream stream;
+        RunResult result = p.Run(&in, stream);
+        ASSERT_EQ(trap, result.trap);
+        ASSERT_EQ(pc, result.pc);
+      }
+    }
+
+    // Raw code can't be written in assembly, so it goes through an image
+    void AssertTrapByCode(const std::vector<int> &code, Trap trap, int pc) {
+      std::string path = "processor_test_trap" IMAGE_EXTENSION;
+      ASSERT_TRUE(Image::Write(path, 0, {}, code.data(), code.size()));
+      for (Engine engine : {kSwitchEngine, kThreadedEngine, kJitEngine, kIrEngine, kCompactEngine, kCachedEngine}) {
+        Image image;
+        ASSERT_TRUE(image.Map(path));
+        Processor p(std::move(image), engine);
+        std::stringstream stream;
+        RunResult result = p.Run(nullptr, stream);
+        ASSERT_EQ(trap, result.trap);
+        ASSERT_EQ(pc, result.pc);
+      }
+      unlink(path.c_str());
+    }
 };
 
 TEST_F(ProcessorTest, Sum) {
@@ -41,6 +81,870 @@ TEST_F(ProcessorTest, Pop) {
     AssertErrorByFile("pop", "12");
 }
 
+TEST_F(ProcessorTest, SwitchEngine) {
+    AssertErrorByFile("euclid", "4", kSwitchEngine);
+    AssertErrorByFile("pop", "12", kSwitchEngine);
+}
+
+TEST_F(ProcessorTest, ThreadedEngine) {
+    AssertErrorByFile("euclid", "4", kThreadedEngine);
+    AssertErrorByFile("pop", "12", kThreadedEngine);
+}
+
+TEST_F(ProcessorTest, JitEngine) {
+    AssertErrorByFile("sum", "3", kJitEngine);
+    AssertErrorByFile("mul", "30", kJitEngine);
+    AssertErrorByFile("euclid", "4", kJitEngine);
+    AssertErrorByFile("mov", "12", kJitEngine);
+    AssertErrorByFile("pop", "12", kJitEngine);
+
+    std::ifstream file("../Processor/data/sum_cin.txt");
+    Processor p(file, 100, kJitEngine);
+    std::stringstream in("20 22");
+    std::stringstream out;
+    p.Run(&in, out);
+    ASSERT_EQ("42\n", out.str());
+}
+
+TEST_F(ProcessorTest, Verifier) {
+    for (const char *name : {"sum", "mul", "euclid", "mov", "pop", "sum_cin"}) {
+        std::ifstream file(std::string("../Processor/data/") + name + ".txt");
+        Processor p(file, 100);
+        ASSERT_TRUE(p.IsVerified()) << name;
+    }
+
+    int program[] = {PUSH, 1, POP, POP};
+    StackVerifier underflow(program, 4);
+    ASSERT_FALSE(underflow.Verify());
+
+    // Every iteration leaves one more element, the depth has no bound
+    int loop[] = {PUSH, 1, JMP, 0};
+    StackVerifier unbounded(loop, 4);
+    ASSERT_FALSE(unbounded.Verify());
+
+    int dup[] = {PUSH, 1, PUSH, 2, DUP, 3, OUT, END};
+    StackVerifier bounded(dup, 8);
+    ASSERT_TRUE(bounded.Verify());
+    ASSERT_EQ(6, bounded.MaxDepth());
+
+    // Paths into "skip" disagree on the depth, so this one runs on the protected stack
+    const std::string text = "push 1\npush 1\nje skip\npush 5\nskip:\npush 7\nout";
+    std::stringstream input(text);
+    ASSERT_FALSE(Processor(input, 100).IsVerified());
+    AssertOutputByText(text, "7\n", false);
+    // The depth of a huge DUP does not fit into an int, the program is not proven and traps
+    const std::string huge = "push 1\npush 2\ndup 1500000000\nout";
+    for (bool optimize : {false, true}) {
+        std::stringstream huge_input(huge);
+        ASSERT_FALSE(Processor(huge_input, 100, kDefaultEngine, optimize).IsVerified());
+    }
+    AssertTrapByText(huge, kStackOverflow, 4);
+}
+
+TEST_F(ProcessorTest, Peephole) {
+    const std::string text = "push 2\npush 3\nadd\npush 4\nmul\npush 7\npop\nout\n"
+                             "push 0\npush 5\nloop:\npush 1\nadd\ndup 2\npop\npop\ndup 2\nswp\npop\npush 9\njne loop\nout\npop\n"
+                             "push 1\npush 2\npush 3\npop\nswp\nout\nout\npush 4\npush 6\nswp\nswp\nout\nout\n"
+                             "mov RAX RAX\njmp end\nend:";
+    AssertOutputByText(text, "20\n9\n1\n2\n6\n4\n", false);
+    AssertOutputByText(text, "20\n9\n1\n2\n6\n4\n", true);
+
+    std::ifstream file("../Processor/data/euclid.txt");
+    Processor plain(file, 100, kDefaultEngine, false);
+    file.clear();
+    file.seekg(0, file.beg);
+    Processor optimized(file, 100, kDefaultEngine, true);
+    ASSERT_LT(optimized.Size(), plain.Size());
+    // The pair of SWP underflows, dropping it would leave the loop without a trap
+    for (Engine engine : {kSwitchEngine, kThreadedEngine, kJitEngine, kIrEngine, kCompactEngine, kCachedEngine}) {
+        std::stringstream program("push 1\npop RAX\npush 0\nswp\nswp\nloop:\njmp loop");
+        Processor p(program, 100, engine, true);
+        p.SetGas(1000);
+        std::stringstream out;
+        RunResult result = p.Run(nullptr, out);
+        ASSERT_EQ(kStackUnderflow, result.trap);
+        ASSERT_EQ(6, result.pc);
+    }
+}
+
+TEST_F(ProcessorTest, Traps) {
+    AssertTrapByText("push 1\nout\npop", kStackUnderflow, 3);
+    AssertTrapByText("push 1\npush 0\nmod", kDivisionByZero, 4);
+    AssertTrapByText("in", kNoInput, 0);
+    AssertTrapByText("in\nin", kNoInput, 1, "5");
+    AssertTrapByText("push 1\nout", kNoTrap, 3);
+    AssertTrapByText("push 1\nout\nend\npush 2", kNoTrap, 3);
+
+    AssertTrapByCode({PUSH, 1, POPR, 7}, kBadRegister, 2);
+    AssertTrapByCode({PUSH, 1, 99, OUT}, kBadOpcode, 2);
+    AssertTrapByCode({PUSH, 1, JMP, 1000}, kBadJump, 2);
+    AssertTrapByCode({JMP, 3, PUSH, 1}, kBadOpcode, 3);
+    AssertTrapByCode({PUSH}, kBadOpcode, 0);
+}
+
+TEST_F(ProcessorTest, BufferedIo) {
+    // Echoes three values, the rest of the input is left for the next run
+    const std::string text = "in\nout\nin\nout\nin\nout";
+    for (Engine engine : {kSwitchEngine, kThreadedEngine, kJitEngine, kIrEngine, kCompactEngine, kCachedEngine}) {
+        for (bool interactive : {false, true}) {
+            std::stringstream program(text);
+            Processor p(program, 100, engine);
+            p.SetInteractive(interactive);
+            std::stringstream in(" -2147483648\n+7\t2147483647 0 -15 x");
+            std::stringstream out;
+            ASSERT_TRUE(p.Run(&in, out).Ok());
+            ASSERT_EQ("-2147483648\n7\n2147483647\n", out.str());
+            ASSERT_TRUE(p.Run(&in, out).trap == kNoInput);
+            ASSERT_EQ("-2147483648\n7\n2147483647\n0\n-15\n", out.str());
+        }
+    }
+
+    // More output than fits into a single buffer
+    std::stringstream program("push 100000\nloop:\npush -1\nadd\npop RAX\npush RAX\npush RAX\nout\npush RAX\npush 0\njne loop");
+    Processor p(program, 100);
+    std::stringstream out;
+    ASSERT_TRUE(p.Run(nullptr, out).Ok());
+    std::stringstream expected;
+    for (int i = 99999; i >= 0; i--) {
+        expected << i << "\n";
+    }
+    ASSERT_EQ(expected.str(), out.str());
+}
+
+TEST_F(ProcessorTest, Batch) {
+    std::ifstream file("../Processor/data/sum_cin.txt");
+    std::shared_ptr<const Program> program = std::make_shared<Program>(file, 100);
+    for (Engine engine : {kSwitchEngine, kThreadedEngine, kJitEngine, kIrEngine, kCompactEngine, kCachedEngine}) {
+        Processor p(program, engine);
+        std::vector<std::stringstream> in(64), out(64);
+        std::vector<std::istream*> inputs;
+        std::vector<std::ostream*> outputs;
+        for (int k = 0; k < 64; k++) {
+            in[k] << k << " " << 1000 * k;
+            inputs.push_back(&in[k]);
+            outputs.push_back(&out[k]);
+        }
+        std::vector<RunResult> results = p.RunBatch(inputs, outputs, 4);
+        for (int k = 0; k < 64; k++) {
+            ASSERT_TRUE(results[k].Ok());
+            ASSERT_EQ(std::to_string(1001 * k) + "\n", out[k].str());
+        }
+    }
+
+    // Processors share one program, a context can be passed to either of them
+    Processor first(program), second(program);
+    ExecutionContext context;
+    std::stringstream in("1 2 3 4"), out;
+    ASSERT_TRUE(first.Run(context, &in, out).Ok());
+    ASSERT_TRUE(second.Run(context, &in, out).Ok());
+    ASSERT_EQ("3\n7\n", out.str());
+    ASSERT_EQ(first.GetProgram(), second.GetProgram());
+}
+
+TEST_F(ProcessorTest, Lanes) {
+    // Counts down from the input, lanes leave the loop on different iterations
+    // and the odd ones take another branch at the end
+    const std::string text = "in\npop RAX\npush 0\npop RBX\nloop:\npush RAX\npush 0\nje done\n"
+                             "push RAX\npush -1\nadd\npop RAX\npush RBX\npush 3\nmul\npush 1\nadd\npop RBX\njmp loop\n"
+                             "done:\npush RBX\npush 2\nmod\npush 0\nje even\npush RBX\nout\nend\n"
+                             "even:\npush RBX\npush 7\nmod\nout";
+    for (int lanes : {8, 16}) {
+        for (bool optimize : {false, true}) {
+            std::stringstream program(text);
+            Processor p(program, 200, kDefaultEngine, optimize);
+            ASSERT_TRUE(p.IsVerified());
+            std::vector<std::stringstream> in(21), out(21), expected(21);
+            std::vector<std::istream*> inputs;
+            std::vector<std::ostream*> outputs;
+            for (int k = 0; k < 21; k++) {
+                in[k] << (k == 20 ? "" : std::to_string(k * 7 % 12));
+                inputs.push_back(&in[k]);
+                outputs.push_back(&out[k]);
+            }
+            std::vector<RunResult> results = p.RunLanes(inputs, outputs, lanes);
+            for (int k = 0; k < 20; k++) {
+                std::stringstream single_in(std::to_string(k * 7 % 12));
+                ExecutionContext context;
+                ASSERT_TRUE(p.Run(context, &single_in, expected[k]).Ok());
+                ASSERT_TRUE(results[k].Ok());
+                ASSERT_EQ(expected[k].str(), out[k].str());
+            }
+            ASSERT_EQ(kNoInput, results[20].trap);
+            ASSERT_EQ(0, results[20].pc);
+        }
+    }
+
+    // Lanes return to different call sites and nest calls to different depths
+    const std::string calls = "in\npop RAX\npush RAX\npush RAX\npush 1\nje one\npush RAX\npush 2\nje two\n"
+                              "call double\njmp print\none:\ncall triple\njmp print\ntwo:\ncall quad\nprint:\nout\nend\n"
+                              "triple:\npush 3\nmul\nret\nquad:\ncall double\ncall double\nret\n"
+                              "double:\npush 2\nmul\nret";
+    std::stringstream program(calls);
+    Processor p(program, 200, kDefaultEngine, false);
+    ASSERT_TRUE(p.IsVerified());
+    std::vector<std::stringstream> in(8), out(8);
+    std::vector<std::istream*> inputs;
+    std::vector<std::ostream*> outputs;
+    for (int k = 0; k < 8; k++) {
+        in[k] << k;
+        inputs.push_back(&in[k]);
+        outputs.push_back(&out[k]);
+    }
+    std::vector<RunResult> results = p.RunLanes(inputs, outputs, 8);
+    for (int k = 0; k < 8; k++) {
+        ASSERT_TRUE(results[k].Ok());
+        ASSERT_EQ(std::to_string(k == 1 ? 3 : k == 2 ? 8 : k * 2) + "\n", out[k].str());
+    }
+}
+
+TEST_F(ProcessorTest, Profiler) {
+    const std::string text = "push 3\npop RAX\nloop:\npush RAX\npush -1\nadd\npop RAX\n"
+                             "push RAX\npush 0\njne loop\npush RAX\nout";
+    for (Engine engine : {kSwitchEngine, kThreadedEngine, kJitEngine, kIrEngine, kCompactEngine, kCachedEngine}) {
+        for (bool optimize : {false, true}) {
+            std::stringstream program(text);
+            Processor p(program, 100, engine, optimize);
+            Profile profile(*p.GetProgram());
+            std::stringstream out;
+            ASSERT_TRUE(p.Run(nullptr, out, profile).Ok());
+            ASSERT_EQ("0\n", out.str());
+
+            int jne = p.GetProgram()->Lines()[9];
+            ASSERT_EQ(3u, profile.Count(jne));
+            ASSERT_EQ(2u, profile.Taken(jne));
+            ASSERT_EQ(1u, profile.NotTaken(jne));
+            ASSERT_EQ(1u, profile.Count(0));
+            ASSERT_GT(profile.LabelCycles("loop"), 0u);
+
+            std::stringstream source(text), listing;
+            profile.WriteListing(source, listing);
+            std::string jne_line = std::string(11, ' ') + "3 " + std::string(17, ' ') + "2/1 | jne loop\n";
+            ASSERT_NE(std::string::npos, listing.str().find(jne_line));
+            std::stringstream folded;
+            profile.WriteFolded(folded, "test");
+            ASSERT_NE(std::string::npos, folded.str().find("test;loop "));
+        }
+    }
+}
+
+TEST_F(ProcessorTest, Image) {
+    std::ifstream file("../Processor/data/euclid.txt");
+    Processor compiled(file, 100);
+    file.close();
+    std::string path = "processor_test_euclid" IMAGE_EXTENSION;
+    ASSERT_TRUE(compiled.SaveImage(path, 42));
+
+    Image image;
+    ASSERT_TRUE(image.Map(path));
+    ASSERT_EQ(42u, image.Header().source_hash);
+    ASSERT_GT(image.Header().marks_count, 0u);
+    int32_t far = image.Header().code_size + 1;
+    Processor p(std::move(image));
+    std::stringstream stream;
+    p.Run(nullptr, stream);
+    ASSERT_EQ("4\n", stream.str());
+
+    // A truncated file, a name running past the label table and a mark past the code are refused
+    std::ifstream saved(path, std::ios::binary);
+    std::string bytes((std::istreambuf_iterator<char>(saved)), std::istreambuf_iterator<char>());
+    saved.close();
+    uint32_t huge = 1u << 30;
+    std::string truncated = bytes.substr(0, sizeof(ImageHeader) + 6);
+    std::string long_name = bytes;
+    long_name.replace(sizeof(ImageHeader) + sizeof(int32_t), sizeof(huge), reinterpret_cast<const char *>(&huge),
+                      sizeof(huge));
+    std::string far_mark = bytes;
+    far_mark.replace(sizeof(ImageHeader), sizeof(far), reinterpret_cast<const char *>(&far), sizeof(far));
+    for (const std::string &corrupt : {truncated, long_name, far_mark}) {
+        std::ofstream(path, std::ios::binary) << corrupt;
+        Image bad;
+        ASSERT_FALSE(bad.Map(path));
+    }
+    unlink(path.c_str());
+}
+
+TEST_F(ProcessorTest, ImageCache) {
+    setenv("PROCESSOR_CACHE_DIR", "processor_test_cache", 1);
+    for (int i = 0; i < 2; i++) {
+        std::unique_ptr<Processor> p = LoadProcessor("../Processor/data/mul.txt", 100);
+        std::stringstream stream;
+        p->Run(nullptr, stream);
+        ASSERT_EQ("30\n", stream.str());
+    }
+    std::ifstream file("../Processor/data/mul.txt");
+    std::stringstream text;
+    text << file.rdbuf();
+    std::string cached_path = CachedImagePath(HashSource(text.str()));
+    Image image;
+    ASSERT_TRUE(image.Map(cached_path));
+    image.Unmap();
+
+    ASSERT_EQ(nullptr, LoadProcessor("../Processor/data/missing.txt", 100));
+
+    // A broken entry is assembled again from the text
+    std::ofstream(cached_path, std::ios::binary) << "PBC1";
+    std::unique_ptr<Processor> p = LoadProcessor("../Processor/data/mul.txt", 100);
+    std::stringstream stream;
+    p->Run(nullptr, stream);
+    ASSERT_EQ("30\n", stream.str());
+}
+
+TEST_F(ProcessorTest, Calls) {
+    // down prints its argument and recurses through a tail call, square is a small leaf
+    const std::string text = "push 3\ncall down\npush 5\ncall square\nout\nend\n"
+                             "down:\npop RAX\npush RAX\nout\npush RAX\npush -1\nadd\npop RAX\n"
+                             "push RAX\npush RAX\npush 0\nje stop\ncall down\nret\nstop:\npop\nret\n"
+                             "square:\npop RBX\npush RBX\npush RBX\nmul\nret";
+    AssertOutputByText(text, "3\n2\n1\n25\n", false);
+    AssertOutputByText(text, "3\n2\n1\n25\n", true);
+
+    for (bool optimize : {false, true}) {
+        std::stringstream program(text);
+        Processor p(program, 100, kDefaultEngine, optimize);
+        ASSERT_TRUE(p.IsVerified());
+        const int *code = p.GetProgram()->Code();
+        int calls = 0;
+        for (int i = 0; i < p.Size(); i += kCommandLength[code[i]]) {
+            calls += code[i] == CALL;
+        }
+        // Only the first call of down is left, square is inlined and the recursion is a jump
+        ASSERT_EQ(optimize ? 1 : 3, calls);
+    }
+
+    AssertTrapByText("ret", kReturnWithoutCall, 0);
+    AssertTrapByText("f:\ncall f", kCallOverflow, 1);
+}
+
+// Hands out one character at a time and refuses to seek, like a pipe
+class PipeBuffer : public std::streambuf {
+public:
+    explicit PipeBuffer(const std::string &text) : text(text) {}
+
+protected:
+    int_type underflow() override {
+        if (position == text.size()) {
+            return traits_type::eof();
+        }
+        current = text[position++];
+        setg(&current, &current, &current + 1);
+        return traits_type::to_int_type(current);
+    }
+
+private:
+    std::string text;
+    size_t position = 0;
+    char current = 0;
+};
+
+TEST_F(ProcessorTest, StreamingAssembler) {
+    for (int k = 0; k < kMnemonicsCount; k++) {
+        ASSERT_EQ(&kMnemonics[k], FindMnemonic(kMnemonics[k].name));
+    }
+    ASSERT_EQ(nullptr, FindMnemonic("pushr"));
+    ASSERT_EQ(nullptr, FindMnemonic("loop:"));
+    ASSERT_EQ(nullptr, FindMnemonic(""));
+
+    // Forward jumps on a stream that can't be rewound, and far more code than the hint
+    std::string text = "jmp start\nback:\nout\nend\nstart:\n";
+    for (int i = 0; i < 10000; i++) {
+        text += "push " + std::to_string(i) + "\npop\n";
+    }
+    text += "push 7\njmp back";
+    for (bool optimize : {false, true}) {
+        PipeBuffer buffer(text);
+        std::istream pipe(&buffer);
+        Processor p(pipe, 1, kDefaultEngine, optimize);
+        if (!optimize) {
+            ASSERT_EQ(30010, p.Size());
+        }
+        std::stringstream stream;
+        ASSERT_TRUE(p.Run(nullptr, stream).Ok());
+        ASSERT_EQ("7\n", stream.str());
+    }
+}
+
+TEST_F(ProcessorTest, Ir) {
+    // A block of stack arithmetic becomes register operations, the stack is only written
+    // where the block ends with values on it
+    std::stringstream text("in\nin\npush 3\nmul\npush 4\nadd\nswp\nout\nout\nend");
+    Processor p(text, 100, kIrEngine);
+    const IrProgram *ir = p.GetProgram()->Ir();
+    ASSERT_NE(nullptr, ir);
+    for (const IrInstruction &instruction : ir->Code()) {
+        ASSERT_NE(kIrMove, instruction.op);
+        ASSERT_NE(kIrConst, instruction.op);
+    }
+    std::stringstream in("5 6");
+    std::stringstream out;
+    ASSERT_TRUE(p.Run(&in, out).Ok());
+    ASSERT_EQ("5\n22\n", out.str());
+
+    // A loop keeps its counter in a slot across blocks
+    AssertOutputByText("mov RAX 3\nloop:\npush RAX\nout\npush RAX\npush -1\nadd\npop RAX\npush RAX\npush 0\njne loop\nend",
+                       "3\n2\n1\n", false);
+
+    // A proof failure falls back to the interpreter
+    std::stringstream unproven("loop:\npush 1\njmp loop");
+    Processor q(unproven, 100, kIrEngine);
+    ASSERT_EQ(nullptr, q.GetProgram()->Ir());
+}
+
+TEST_F(ProcessorTest, Memory) {
+    // Histogram of the inputs by remainder, the index is brought into [0, 4) and proven there
+    const std::string text = "in\npop RCX\nloop:\nin\npush 4\nmod\npush 4\nadd\npush 4\nmod\npop RBX\n"
+                             "load RBX\npush 1\nadd\nstore RBX\npush RCX\npush -1\nadd\npop RCX\n"
+                             "push RCX\npush 0\njne loop\nload 0\nout\nload 1\nout\nload 2\nout\nload 3\nout\nend";
+    for (Engine engine : {kSwitchEngine, kThreadedEngine, kJitEngine, kIrEngine, kCompactEngine, kCachedEngine}) {
+        for (int size : {4, 3}) {
+            std::stringstream program(text);
+            Processor p(program, 100, engine);
+            ASSERT_EQ(4, p.GetProgram()->MemoryExtent());
+            for (int i = 0; i < p.Size(); i += kCommandLength[p.GetProgram()->Code()[i]]) {
+                ASSERT_EQ(IsMemoryAccess(p.GetProgram()->Code()[i]), p.GetProgram()->IsProvenAccess(i));
+            }
+            p.SetMemorySize(size);
+            std::stringstream in("6 1 2 3 4 5 -3");
+            std::stringstream out;
+            RunResult result = p.Run(&in, out);
+            if (size == 4) {
+                ASSERT_TRUE(result.Ok());
+                ASSERT_EQ("1\n3\n1\n1\n", out.str());
+            } else {
+                // Too small for the proof, the checks stay and the access to 3 traps
+                ASSERT_EQ(kBadAddress, result.trap);
+            }
+        }
+    }
+
+    AssertTrapByText("push 1\nstore -1", kBadAddress, 2);
+    AssertTrapByText("mov RAX 65536\nload RAX", kBadAddress, 3);
+    AssertTrapByText("load 5\nload RDX\nadd\nout\nstore 70000", kStackUnderflow, 6);
+
+    // A STORE that traps has popped its value on every engine
+    for (const char *text : {"push 5\npush 6\nstore 100000", "push 5\npush 6\nstore 10", "push 5\npush 6\nstore RAX"}) {
+        std::vector<std::vector<int>> stacks;
+        for (Engine engine : {kThreadedEngine, kJitEngine}) {
+            std::stringstream program(text);
+            Processor p(program, 100, engine, false);
+            p.SetMemorySize(0);
+            ASSERT_EQ(kBadAddress, p.Run(nullptr, std::cout).trap) << text;
+            stacks.push_back(p.TakeSnapshot().stack);
+        }
+        ASSERT_EQ(std::vector<int>{5}, stacks[0]) << text;
+        ASSERT_EQ(stacks[0], stacks[1]) << text;
+    }
+}
+
+TEST_F(ProcessorTest, MappedMemory) {
+    std::string path = "processor_test_memory.bin";
+    std::vector<int> words = {10, 20, 0};
+    std::ofstream(path, std::ios::binary).write(reinterpret_cast<const char *>(words.data()), 12);
+    std::stringstream text("load 0\nload 1\nadd\nstore 2\nload 2\nout");
+    Processor p(text, 100);
+    ASSERT_TRUE(p.MapMemory(path));
+
+    // Batch runs work on private copies, the own run writes through
+    std::stringstream batch_out;
+    ASSERT_TRUE(p.RunBatch({nullptr}, {&batch_out})[0].Ok());
+    ASSERT_EQ("30\n", batch_out.str());
+    std::ifstream(path, std::ios::binary).read(reinterpret_cast<char *>(words.data()), 12);
+    ASSERT_EQ(0, words[2]);
+    std::stringstream out;
+    ASSERT_TRUE(p.Run(nullptr, out).Ok());
+    ASSERT_EQ("30\n", out.str());
+    std::ifstream(path, std::ios::binary).read(reinterpret_cast<char *>(words.data()), 12);
+    ASSERT_EQ(30, words[2]);
+    unlink(path.c_str());
+}
+
+TEST_F(ProcessorTest, Scheduler) {
+    ASSERT_LT(sizeof(Fiber), 512u);
+    // Doubles its inputs until 0, parking in IN whenever the input runs dry
+    std::stringstream text("loop:\nin\npop RAX\npush RAX\npush 0\nje done\npush RAX\npush 2\nmul\nout\n"
+                           "jmp loop\ndone:\nend");
+    std::shared_ptr<const Program> program = std::make_shared<Program>(text, 100);
+    Scheduler scheduler(4, 16);
+    const int kFibers = 1000;
+    for (int k = 0; k < kFibers; k++) {
+        ASSERT_EQ(k, scheduler.Spawn(program));
+        scheduler.Feed(k, k + 1);
+    }
+    for (int k = 0; k < kFibers; k++) {
+        if (k % 2 == 0) {
+            scheduler.Feed(k, {k + 2, 0});
+        } else {
+            scheduler.Feed(k, k + 2);
+            scheduler.CloseInput(k);
+        }
+    }
+    for (int k = 0; k < kFibers; k++) {
+        RunResult result = scheduler.Wait(k);
+        ASSERT_EQ(k % 2 == 0 ? kNoTrap : kNoInput, result.trap);
+        ASSERT_EQ(std::vector<int>({2 * k + 2, 2 * k + 4}), scheduler.TakeOutput(k));
+    }
+
+    // A long loop gives way to the others at every quantum
+    std::stringstream spin("mov RAX 1000000\nloop:\npush RAX\npush -1\nadd\npop RAX\npush RAX\npush 0\n"
+                           "jne loop\npush RAX\nout\nend");
+    int id = scheduler.Spawn(std::make_shared<Program>(spin, 100));
+    int quick = scheduler.Spawn(program);
+    scheduler.Feed(quick, {5, 0});
+    ASSERT_TRUE(scheduler.Wait(quick).Ok());
+    ASSERT_EQ(std::vector<int>({10}), scheduler.TakeOutput(quick));
+    ASSERT_TRUE(scheduler.Wait(id).Ok());
+    ASSERT_EQ(std::vector<int>({0}), scheduler.TakeOutput(id));
+}
+
+TEST_F(ProcessorTest, Snapshot) {
+    // step adds the counter to a sum kept in memory, the loop takes a few safepoints
+    const std::string text = "push 200000\npop RAX\nloop:\ncall step\npush RAX\npush -1\nadd\npop RAX\n"
+                             "push RAX\npush 0\njne loop\nload 0\nout\nend\n"
+                             "step:\nload 0\npush RAX\nadd\npush 1009\nmod\nstore 0\nret";
+    std::string path = "processor_test_snapshot" SNAPSHOT_EXTENSION;
+    std::stringstream plain_program(text);
+    Processor plain(plain_program, 100);
+    std::stringstream expected;
+    ASSERT_TRUE(plain.Run(nullptr, expected).Ok());
+
+    for (Engine engine : {kSwitchEngine, kThreadedEngine}) {
+        std::stringstream program(text);
+        Processor p(program, 100, engine);
+        std::stringstream out;
+        {
+            Checkpointer checkpointer(path, std::chrono::milliseconds(0));
+            ASSERT_TRUE(p.Run(nullptr, out, checkpointer).Ok());
+            checkpointer.Flush();
+            ASSERT_LT(0, checkpointer.Written());
+            ASSERT_FALSE(checkpointer.Failed());
+        }
+        ASSERT_EQ(expected.str(), out.str());
+
+        // The last checkpoint resumes on any engine and ends the same way
+        Snapshot snapshot;
+        ASSERT_TRUE(snapshot.Read(path));
+        ASSERT_NE(0, snapshot.pc);
+        std::stringstream resumed_program(text);
+        Processor resumed(resumed_program, 100, kJitEngine);
+        ASSERT_TRUE(resumed.Restore(snapshot));
+        std::stringstream resumed_out;
+        ASSERT_TRUE(resumed.Run(nullptr, resumed_out).Ok());
+        ASSERT_EQ(expected.str(), resumed_out.str());
+
+        snapshot.pc = 1;
+        ASSERT_FALSE(resumed.Restore(snapshot));
+        std::stringstream other_program("push 1\nout");
+        Processor other(other_program, 100);
+        snapshot.pc = 0;
+        ASSERT_FALSE(other.Restore(snapshot));
+    }
+    unlink(path.c_str());
+}
+
+TEST_F(ProcessorTest, FastStart) {
+    // The first run computes a table entry and sets RBX, later runs only read the input
+    const std::string text = "push RBX\npush 0\njne ready\npush 1\nstore 0\npush 20\npop RCX\n"
+                             "init:\nload 0\npush 2\nmul\nstore 0\npush RCX\npush -1\nadd\npop RCX\n"
+                             "push RCX\npush 0\njne init\npush -1\nout\npush 1\npop RBX\n"
+                             "ready:\nload 0\nin\nadd\nout";
+    std::string path = "processor_test_start" SNAPSHOT_EXTENSION;
+    std::stringstream program(text);
+    Processor p(program, 100);
+    std::stringstream in("3");
+    std::stringstream out;
+    ASSERT_TRUE(p.Run(&in, out).Ok());
+    ASSERT_EQ("-1\n1048579\n", out.str());
+    ASSERT_TRUE(p.TakeSnapshot().Write(path));
+
+    Snapshot snapshot;
+    ASSERT_TRUE(snapshot.Read(path));
+    ASSERT_EQ(0, snapshot.pc);
+    std::stringstream started_program(text);
+    Processor started(started_program, 100);
+    ASSERT_TRUE(started.Restore(snapshot));
+    std::stringstream started_in("5");
+    std::stringstream started_out;
+    ASSERT_TRUE(started.Run(&started_in, started_out).Ok());
+    ASSERT_EQ("1048581\n", started_out.str());
+    unlink(path.c_str());
+}
+
+TEST_F(ProcessorTest, Transpiler) {
+    std::ifstream file("../Processor/data/euclid.txt");
+    Program euclid(file, 100);
+    file.close();
+    std::stringstream code;
+    Transpiler transpiler(euclid);
+    ASSERT_TRUE(transpiler.Write("euclid", code));
+    std::string text = code.str();
+    ASSERT_NE(std::string::npos, text.find("int euclid(int (*in)(), void (*out)(int)) {"));
+    // The loop is a label, the stack is indexed by constants
+    ASSERT_NE(std::string::npos, text.find("goto L"));
+    ASSERT_NE(std::string::npos, text.find("s[1] = Remainder(s[1], s[2]);"));
+    ASSERT_NE(std::string::npos, text.find("return 6; // division by zero"));
+
+    std::stringstream calls_text("push 3\ncall square\nout\nend\nsquare:\npop RAX\npush RAX\npush RAX\nmul\nret");
+    Program calls(calls_text, 100, false);
+    std::stringstream calls_code;
+    Transpiler calls_transpiler(calls);
+    ASSERT_TRUE(calls_transpiler.Write("square", calls_code));
+    ASSERT_NE(std::string::npos, calls_code.str().find("case 4: goto L4;"));
+
+    std::stringstream unproven_text("pop\nout");
+    Program unproven(unproven_text, 100);
+    std::stringstream unproven_code;
+    Transpiler unproven_transpiler(unproven);
+    ASSERT_FALSE(unproven_transpiler.Write("unproven", unproven_code));
+}
+
+TEST_F(ProcessorTest, Ssa) {
+    // RAX is the same in every round, the branch always goes to skip, the first value of RDX
+    // is overwritten before anything reads it and the output reads RBX through a chain of copies
+    const std::string text = "push 3\npop RBX\nloop:\nmov RAX 7\npush RBX\npop RDX\nmov RCX RBX\nmov RDX RCX\n"
+                             "push RDX\npush RAX\nmul\nout\npush 1\npush 1\nje skip\npush 5\nout\nskip:\n"
+                             "push RBX\npush -1\nadd\npop RBX\npush RBX\npush 0\njne loop\nend";
+    AssertOutputByText(text, "21\n14\n7\n", false);
+    AssertOutputByText(text, "21\n14\n7\n", true);
+
+    std::stringstream plain_text(text);
+    Program plain(plain_text, 100, false);
+    std::stringstream optimized_text(text);
+    Program optimized(optimized_text, 100);
+    ASSERT_LT(optimized.Size(), plain.Size());
+    const int *code = optimized.Code();
+    int loop = -1;
+    for (int i = 0; i < optimized.Size(); i += kCommandLength[code[i]]) {
+        ASSERT_NE(JE, code[i]);
+        ASSERT_NE(PUSH_JE, code[i]);
+        if (code[i] == PUSH_JNE) {
+            loop = code[i + 2];
+        }
+    }
+    // The copies stay in the loop as registers outlive the run, RAX moved in front of it
+    ASSERT_GE(loop, 0);
+    for (int i = loop; i < optimized.Size(); i += kCommandLength[code[i]]) {
+        ASSERT_NE(MOVD, code[i]);
+        ASSERT_FALSE(code[i] == POPR && code[i + 1] != RBX);
+        ASSERT_FALSE(code[i] == PUSHR && code[i + 1] != RBX);
+    }
+    // A jump into a folded branch still pops its operands
+    AssertOutputByText("push 0\npush 5\npush 1\njmp L\nL:\njne M\nM:\nout", "0\n", true);
+}
+
+TEST_F(ProcessorTest, Compact) {
+    std::vector<uint8_t> bytes;
+    const std::vector<int> values = {0, 1, -1, 63, -64, 64, 1 << 20, INT_MAX, INT_MIN};
+    for (int value : values) {
+        PutSigned(bytes, value);
+        // Small numbers of either sign take a byte, the largest ones five
+        if (value == -64) {
+            ASSERT_EQ(5u, bytes.size());
+        }
+    }
+    ASSERT_EQ(21u, bytes.size());
+    const uint8_t *ip = bytes.data();
+    for (int value : values) {
+        ASSERT_EQ(value, ReadSigned(ip));
+    }
+
+    // The loop is long enough for its jumps to need two bytes
+    std::string text = "push 300\npop RCX\nloop:\n";
+    for (int k = 0; k < 40; k++) {
+        text += "push RCX\npush " + std::to_string(k * 1000) + "\nadd\npop RAX\n";
+    }
+    text += "push RCX\npush -1\nadd\npop RCX\npush RCX\npush 0\njne loop\npush RAX\nout";
+    AssertOutputByText(text, "39001\n", false);
+    std::stringstream program(text);
+    Program p(program, 100, false);
+    const CompactProgram *compact = p.Compact();
+    ASSERT_NE(nullptr, compact);
+    ASSERT_LT(static_cast<size_t>(compact->Size()) * 3, p.Size() * sizeof(int));
+    // Traps report offsets of the code words
+    ASSERT_EQ(0, compact->Pc(0));
+    ASSERT_EQ(p.Size(), compact->Pc(compact->Size() - 1));
+    AssertTrapByText("push 1\npush 0\nmod", kDivisionByZero, 4);
+
+    int bad_jump[] = {PUSH, 1, JMP, 3};
+    ASSERT_FALSE(CompactProgram(bad_jump, 4).IsEncoded());
+}
+
+TEST_F(ProcessorTest, Layout) {
+    // The common case jumps over the rare one, and the loop tests its counter on top
+    const std::string text = "in\npop RCX\nmov RAX 0\n"
+                             "loop:\npush RCX\npush 0\nje done\n"
+                             "push RCX\npush 7\nmod\npush 0\njne common\npush RAX\npush 100\nadd\npop RAX\n"
+                             "common:\npush RAX\npush 1\nadd\npop RAX\npush RCX\npush -1\nadd\npop RCX\njmp loop\n"
+                             "done:\npush RAX\nout";
+    std::stringstream source(text);
+    Processor trained(source, 100);
+    const Program &program = *trained.GetProgram();
+    Profile profile(program);
+    std::stringstream train_in("70\n"), train_out;
+    ASSERT_TRUE(trained.Run(&train_in, train_out, profile).Ok());
+    std::shared_ptr<const Program> laid_out = LayOut(program, profile);
+    ASSERT_EQ(program.Code()[program.Marks().at("done")], laid_out->Code()[laid_out->Marks().at("done")]);
+
+    // Taken conditional jumps and JMP commands of a profiled run
+    auto jumps = [](const Program &p, const Profile &counts) {
+        uint64_t taken = 0;
+        for (int i = 0; i < p.Size(); i += kCommandLength[p.Code()[i]]) {
+            taken += p.Code()[i] == JMP ? counts.Count(i) : counts.Taken(i);
+        }
+        return taken;
+    };
+    Processor relaid(laid_out, kSwitchEngine);
+    Profile relaid_profile(*laid_out);
+    std::stringstream again_in("70\n"), again_out;
+    ASSERT_TRUE(relaid.Run(&again_in, again_out, relaid_profile).Ok());
+    ASSERT_EQ(train_out.str(), again_out.str());
+    ASSERT_LT(jumps(*laid_out, relaid_profile) * 3, jumps(program, profile) * 2);
+
+    // Other inputs take the other paths just as well
+    for (Engine engine : {kSwitchEngine, kThreadedEngine, kJitEngine, kIrEngine, kCompactEngine, kCachedEngine}) {
+        Processor p(laid_out, engine);
+        std::stringstream in("45\n"), out;
+        ASSERT_TRUE(p.Run(&in, out).Ok());
+        ASSERT_EQ("645\n", out.str());
+    }
+}
+
+TEST_F(ProcessorTest, Gas) {
+    const std::string text = "in\npop RCX\nmov RAX 0\n"
+                             "loop:\npush RCX\npush 0\nje done\nin\npush RAX\nadd\npop RAX\n"
+                             "push RCX\npush -1\nadd\npop RCX\njmp loop\n"
+                             "done:\npush RAX\nout";
+    const std::string input = "10 1 2 3 4 5 6 7 8 9 10";
+    for (Engine engine : {kSwitchEngine, kThreadedEngine}) {
+        std::stringstream source(text);
+        Processor p(source, 100, engine);
+        Profile profile(*p.GetProgram());
+        std::stringstream counted_in(input), counted_out;
+        ASSERT_TRUE(p.Run(&counted_in, counted_out, profile).Ok());
+        uint64_t commands = 0;
+        for (int pc = 0; pc < p.Size(); pc++) {
+            commands += p.GetProgram()->Code()[pc] == HLT ? 0 : profile.Count(pc);
+        }
+
+        // Every stop goes on where it left off, with the gas of the next slice on top
+        p.SetGas(20);
+        std::stringstream in(input), out;
+        int slices = 1;
+        RunResult result;
+        while ((result = p.Run(&in, out)).trap == kOutOfGas) {
+            ASSERT_TRUE(p.GetProgram()->IsBoundary(result.pc));
+            p.SetGas(p.Gas() + 20);
+            slices++;
+        }
+        ASSERT_TRUE(result.Ok());
+        ASSERT_EQ("55\n", out.str());
+        ASSERT_GT(slices, 2);
+        // Blocks are paid whole, so a run that ends has paid for exactly the commands it ran
+        ASSERT_EQ(commands, 20u * slices - p.Gas());
+    }
+
+    // A block the gas does not cover is not started at all
+    std::stringstream source("push 1\nout\npush 2\nout");
+    Processor p(source, 100);
+    p.SetGas(3);
+    std::stringstream out;
+    RunResult result = p.Run(nullptr, out);
+    ASSERT_EQ(kOutOfGas, result.trap);
+    ASSERT_EQ(0, result.pc);
+    ASSERT_EQ("", out.str());
+    p.SetGas(kUnlimitedGas);
+    ASSERT_TRUE(p.Run(nullptr, out).Ok());
+    ASSERT_EQ("1\n2\n", out.str());
+}
+
+TEST_F(ProcessorTest, Embedding) {
+    const std::string text = "in\npop RCX\nloop:\npush RCX\npush 0\nje done\nin\npush 2\nmul\nout\n"
+                             "push RCX\npush -1\nadd\npop RCX\njmp loop\ndone:\nend";
+    const int input[] = {3, 5, -7, 11};
+    for (Engine engine : {kSwitchEngine, kThreadedEngine, kJitEngine, kIrEngine, kCompactEngine, kCachedEngine}) {
+        std::stringstream source(text);
+        Processor p(source, 100, engine);
+        // The context and the output are reused by every run
+        ExecutionContext context;
+        std::vector<int> output;
+        for (int k = 0; k < 3; k++) {
+            output.clear();
+            ASSERT_TRUE(p.Run(context, input, 4, output).Ok());
+            ASSERT_EQ(std::vector<int>({10, -14, 22}), output);
+        }
+        output.clear();
+        RunResult result = p.Run(input, 3, output);
+        ASSERT_EQ(kNoInput, result.trap);
+        ASSERT_EQ(std::vector<int>({10, -14}), output);
+
+        // Ports get the host pointer back, the values come from a counter here
+        struct Host {
+            int next;
+            int sum;
+        } host = {0, 0};
+        ReadPort read = [](void *host, int &value) {
+            value = static_cast<Host*>(host)->next++ == 0 ? 100 : 1;
+            return true;
+        };
+        WritePort write = [](void *host, int value) { static_cast<Host*>(host)->sum += value; };
+        ASSERT_TRUE(p.Run(context, read, write, &host).Ok());
+        ASSERT_EQ(200, host.sum);
+    }
+}
+
+TEST_F(ProcessorTest, Cached) {
+    // Traps with none, one and two values cached, the stack they leave is the one of the switch engine
+    const std::vector<std::string> texts = {
+            "push 5\npush 6\npush 7\nin", "push 5\npush 6\nin", "push 5\npush 6\npush 0\nmod",
+            "push 5\npush 6\npush 7\nload 100000", "push 5\npush 6\nstore 100000", "push 5\nswp",
+            "push 1\npush 2\npush 3\npush 4\nadd\nmul\nadd\nadd", "push 1\npush 2\npush 3\nend",
+            "push 1\npush 2\npush 3\nret", "in\npush 1\npush 2\npush 3\nadd\npush 5\nmul\nswp\ndup 2"
+    };
+    for (const std::string &text : texts) {
+        std::vector<int> expected;
+        for (Engine engine : {kSwitchEngine, kCachedEngine}) {
+            std::stringstream source(text);
+            Processor p(source, 100, engine, false);
+            std::stringstream in("9"), out;
+            RunResult result = p.Run(&in, out);
+            std::vector<int> stack = p.TakeSnapshot().stack;
+            stack.push_back(result.trap);
+            stack.push_back(result.pc);
+            if (engine == kSwitchEngine) {
+                expected = stack;
+            } else {
+                ASSERT_EQ(expected, stack) << text;
+            }
+        }
+    }
+}
+
+TEST_F(ProcessorTest, ParallelAssembler) {
+    // Jumps both ways between marks that end up in other chunks, and a call into the last one
+    std::string text = "mov RCX 0\njmp start\n";
+    for (int i = 0; i < 200; i++) {
+        std::string mark = "m" + std::to_string(i);
+        text += mark + ":\npush RCX\npush " + std::to_string(i % 7) + "\nadd\npop RCX\n";
+        text += i % 3 == 0 ? "jmp m" + std::to_string(i + 1) + "\n" : "push RCX\npush -1\njne m" + std::to_string(i + 1) + "\n";
+    }
+    text += "m200:\ncall print\nend\nstart:\njmp m0\nprint:\npush RCX\nout\nret";
+    for (const std::string &source : {text, text + "\n"}) {
+        std::stringstream stream(source);
+        Assembler expected(1);
+        expected.Assemble(stream);
+        for (size_t min_chunk : {1, 16, 1000, 1 << 20}) {
+            ParallelAssembler assembler(1, 4, min_chunk);
+            assembler.Assemble(source);
+            ASSERT_EQ(expected.Code(), assembler.Code()) << min_chunk;
+            ASSERT_EQ(expected.Marks(), assembler.Marks()) << min_chunk;
+            ASSERT_EQ(expected.Lines(), assembler.Lines()) << min_chunk;
+        }
+    }
+
+    Processor p(std::make_shared<Program>(std::string_view(text), 1));
+    std::stringstream out;
+    ASSERT_TRUE(p.Run(nullptr, out).Ok());
+    ASSERT_EQ("594\n", out.str());
+}
+
 int main(int argc, char *argv[]) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();